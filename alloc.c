@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include "alloc.h"
+#include "stats.h"
+
+// Marks buffers too large for any size class
+#define NO_CLASS POOL_CLASSES
+
+/**
+ * Stored right before every pool buffer, takes `BMP_ALIGNMENT` bytes, so
+ * the buffer stays aligned.
+ */
+struct buffer_prefix {
+    void* next;                 // next free buffer of the class
+    size_t size_class;
+};
+
+// Allocator of the calling thread
+static _Thread_local struct bmp_allocator *current = NULL;
+
+static size_t round_up(size_t size) {
+    return (size + BMP_ALIGNMENT - 1) / BMP_ALIGNMENT * BMP_ALIGNMENT;
+}
+
+/**
+ * Size of buffers in class, classes grow by quarters of power of two.
+ */
+static size_t class_size(size_t size_class) {
+    return (size_t) (4 + size_class % 4) << (10 + size_class / 4);
+}
+
+static size_t find_class(size_t size) {
+    for (size_t size_class = 0; size_class < POOL_CLASSES; size_class++) {
+        if (class_size(size_class) >= size) {
+            return size_class;
+        }
+    }
+    return NO_CLASS;
+}
+
+struct bmp_allocator* bmp_allocator_create(size_t cache_limit) {
+
+    struct bmp_allocator *allocator = (struct bmp_allocator*) calloc(1, sizeof(struct bmp_allocator));
+    if (allocator == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&allocator->lock, NULL);
+    allocator->cache_limit = cache_limit;
+
+    return allocator;
+}
+
+void bmp_allocator_free(struct bmp_allocator* allocator) {
+    if (allocator != NULL) {
+        for (size_t size_class = 0; size_class < POOL_CLASSES; size_class++) {
+            void *buffer = allocator->free_buffers[size_class];
+            while (buffer != NULL) {
+                struct buffer_prefix *prefix = (struct buffer_prefix*) ((uint8_t*) buffer - BMP_ALIGNMENT);
+                buffer = prefix->next;
+                free(prefix);
+            }
+        }
+
+        if (current == allocator) {
+            current = NULL;
+        }
+        pthread_mutex_destroy(&allocator->lock);
+        free(allocator);
+    }
+}
+
+size_t bmp_allocator_system_allocations(struct bmp_allocator* allocator) {
+
+    if (allocator == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&allocator->lock);
+    size_t count = allocator->system_allocations;
+    pthread_mutex_unlock(&allocator->lock);
+
+    return count;
+}
+
+void bmp_set_allocator(struct bmp_allocator* allocator) {
+    current = allocator;
+}
+
+struct bmp_allocator* bmp_get_allocator(void) {
+    return current;
+}
+
+void* bmp_buffer_alloc(struct bmp_allocator* allocator, size_t size) {
+
+    BMP_STAT_ALLOCATED(size);
+
+    if (allocator == NULL) {
+        return aligned_alloc(BMP_ALIGNMENT, round_up(size > 0 ? size : 1));
+    }
+
+    size_t size_class = find_class(size);
+
+    // Take free buffer of the class
+    if (size_class != NO_CLASS) {
+        pthread_mutex_lock(&allocator->lock);
+        void *buffer = allocator->free_buffers[size_class];
+        if (buffer != NULL) {
+            struct buffer_prefix *prefix = (struct buffer_prefix*) ((uint8_t*) buffer - BMP_ALIGNMENT);
+            allocator->free_buffers[size_class] = prefix->next;
+            allocator->cached_bytes -= class_size(size_class);
+            pthread_mutex_unlock(&allocator->lock);
+            return buffer;
+        }
+        pthread_mutex_unlock(&allocator->lock);
+    }
+
+    size_t bufferSize = size_class != NO_CLASS ? class_size(size_class) : round_up(size);
+    struct buffer_prefix *prefix = (struct buffer_prefix*) aligned_alloc(BMP_ALIGNMENT, BMP_ALIGNMENT + bufferSize);
+    if (prefix == NULL) {
+        return NULL;
+    }
+    prefix->next = NULL;
+    prefix->size_class = size_class;
+
+    pthread_mutex_lock(&allocator->lock);
+    allocator->system_allocations++;
+    pthread_mutex_unlock(&allocator->lock);
+
+    return (uint8_t*) prefix + BMP_ALIGNMENT;
+}
+
+void bmp_buffer_free(struct bmp_allocator* allocator, void* buffer) {
+
+    if (buffer == NULL) {
+        return;
+    }
+
+    if (allocator == NULL) {
+        free(buffer);
+        return;
+    }
+
+    struct buffer_prefix *prefix = (struct buffer_prefix*) ((uint8_t*) buffer - BMP_ALIGNMENT);
+    size_t size_class = prefix->size_class;
+
+    pthread_mutex_lock(&allocator->lock);
+
+    // Keep buffer for reuse unless the pool is full
+    if (size_class != NO_CLASS && (allocator->cache_limit == 0 || allocator->cached_bytes + class_size(size_class) <= allocator->cache_limit)) {
+        prefix->next = allocator->free_buffers[size_class];
+        allocator->free_buffers[size_class] = buffer;
+        allocator->cached_bytes += class_size(size_class);
+        buffer = NULL;
+    }
+
+    pthread_mutex_unlock(&allocator->lock);
+
+    if (buffer != NULL) {
+        free(prefix);
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef _ALLOC_H
+#define _ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Alignment of pixel buffers
+#define BMP_ALIGNMENT 64
+
+// Number of buffer size classes, 4 classes per power of two from 4 KiB
+#define POOL_CLASSES 160
+
+
+/**
+ * Structure describes allocator context of a job. It is a pool of aligned
+ * buffers (images together with their header and pixels, scratch rows),
+ * freed buffers are kept by size class and handed out again for buffers of
+ * the same class. Once the pool is warmed up, processing an image doesn't
+ * call `malloc()` at all. The context can be shared by threads.
+ */
+struct bmp_allocator {
+    pthread_mutex_t lock;
+    void* free_buffers[POOL_CLASSES];
+    size_t cached_bytes;            // size of buffers kept in the pool
+    size_t cache_limit;             // buffers over the limit are freed, 0 for no limit
+    size_t system_allocations;      // number of buffers taken from the system
+};
+
+
+/**
+ * Creates allocator context
+ *
+ * @param cache_limit maximal size of free buffers kept in the pool in bytes, 0 for no limit
+ * @return the allocator or `NULL` if there is not enough memory
+ */
+struct bmp_allocator* bmp_allocator_create(size_t cache_limit);
+
+
+/**
+ * Frees the allocator from the memory
+ *
+ * Releases all free buffers of the pool. Images allocated by
+ * the context have to be freed before.
+ *
+ * @param allocator the allocator
+ */
+void bmp_allocator_free(struct bmp_allocator* allocator);
+
+
+/**
+ * Returns number of buffers the allocator took from the system
+ *
+ * The number stops growing once the pool is warmed up by jobs of the same
+ * size.
+ *
+ * @param allocator the allocator
+ * @return the number of buffers or 0 if allocator is `NULL`
+ */
+size_t bmp_allocator_system_allocations(struct bmp_allocator* allocator);
+
+
+/**
+ * Sets allocator used implicitly by the calling thread
+ *
+ * `read_bmp()`, all transformations and `create_bmp_image()` allocate from the
+ * current allocator of the thread. `free_bmp_image()` returns memory to the
+ * allocator the image was created by.
+ *
+ * @param allocator the allocator or `NULL` to use `malloc()`
+ */
+void bmp_set_allocator(struct bmp_allocator* allocator);
+
+
+/**
+ * Returns allocator used implicitly by the calling thread
+ *
+ * @return the allocator or `NULL` if none is set
+ */
+struct bmp_allocator* bmp_get_allocator(void);
+
+
+/**
+ * Allocates buffer aligned to `BMP_ALIGNMENT`
+ *
+ * Buffer is taken from the pool if there is a free one of the same size
+ * class. Content of the buffer is not initialized. If allocator is `NULL`,
+ * buffer is allocated from the system.
+ *
+ * @param allocator the allocator or `NULL`
+ * @param size size in bytes
+ * @return the buffer or `NULL` if there is not enough memory
+ */
+void* bmp_buffer_alloc(struct bmp_allocator* allocator, size_t size);
+
+
+/**
+ * Returns buffer to the pool
+ *
+ * @param allocator the allocator the buffer was allocated from or `NULL`
+ * @param buffer the buffer
+ */
+void bmp_buffer_free(struct bmp_allocator* allocator, void* buffer);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _BANDS_H
+#define _BANDS_H
+
+#include "bmp.h"
+
+// Rows of one band of tasks, which work on bands instead of single rows
+#define BAND_ROWS 64
+
+
+/**
+ * Returns number of bands of `rows` rows covering `height` rows.
+ */
+static inline size_t band_count(size_t height, size_t rows) {
+    return (height + rows - 1) / rows;
+}
+
+
+/**
+ * Computes rows <first, last) of bands <start, end) of `rows` rows, the
+ * last band ends with the image.
+ */
+static inline void band_range(size_t height, size_t rows, size_t start, size_t end, size_t* first, size_t* last) {
+    *first = start * rows < height ? start * rows : height;
+    *last = end * rows < height ? end * rows : height;
+}
+
+
+/**
+ * Converts rows <first, last) of palette image to 24-bit pixels of `dest`,
+ * indices out of the palette are black.
+ */
+static inline void expand_palette_rows(const struct bmp_image* image, struct bmp_image* dest, size_t first, size_t last) {
+    size_t width = image->info.width;
+    const struct bmp_color *palette = image->palette;
+    size_t colors = image->colors;
+
+    for (size_t h = first; h < last; h++) {
+        const uint8_t *source = (const uint8_t*) bmp_row(image, h);
+        struct pixel *row = bmp_row(dest, h);
+        for (size_t w = 0; w < width; w++) {
+            struct pixel color = { 0, 0, 0 };
+            if (source[w] < colors) {
+                color.blue = palette[source[w]].blue;
+                color.green = palette[source[w]].green;
+                color.red = palette[source[w]].red;
+            }
+            row[w] = color;
+        }
+    }
+}
+
+
+/**
+ * Marks that a task couldn't allocate its scratch buffers, so the caller
+ * frees the result after the pool is done.
+ */
+static inline void band_failed(bool* failed) {
+    __atomic_store_n(failed, true, __ATOMIC_RELAXED);
+}
+
+#endif
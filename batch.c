@@ -0,0 +1,696 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "queue.h"
+#include "alloc.h"
+
+// Memory kept for reuse by the allocator shared by all threads
+#define BATCH_CACHE_LIMIT (256 << 20)
+
+// Files read or written at once with asynchronous I/O by default
+#define BATCH_IO_DEPTH 64
+
+// Files taken by a probing thread at once
+#define PROBE_CHUNK 32
+
+/**
+ * One file going through the stages.
+ */
+struct job {
+    const char* path;
+    char* output;               // path of result
+    struct bmp_image* image;    // source, result after processing
+    struct bmp_io_request request;  // file contents with asynchronous I/O
+    double started;             // start of asynchronous read or write
+    uint32_t width;
+    uint32_t height;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    double read_seconds;
+    double compute_seconds;
+    double write_seconds;
+    bool cached;                // result was taken from the cache
+    bool ok;
+};
+
+/**
+ * State shared by threads of the batch.
+ */
+struct batch {
+    const char* const* paths;
+    size_t count;
+    const struct batch_options* options;
+    struct bmp_allocator* allocator;
+    struct bmp_io* read_io;     // asynchronous I/O or `NULL`
+    struct bmp_io* write_io;
+    size_t io_depth;
+    uint64_t ops_hash;          // part of cache keys given by the pipeline and format
+    struct queue* loaded;       // read images waiting for processing
+    struct queue* processed;    // results waiting for writing
+    pthread_mutex_t lock;       // guards all fields below
+    size_t next;                // next file to read
+    size_t readers_left;
+    size_t workers_left;
+    size_t writers_left;
+    struct batch_stats* stats;
+};
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/**
+ * Adds job to totals, reports it and frees it.
+ */
+static void finish_job(struct batch* batch, struct job* job) {
+
+    pthread_mutex_lock(&batch->lock);
+
+    struct batch_stats *stats = batch->stats;
+    if (job->ok) {
+        stats->files++;
+        stats->cached += job->cached;
+        stats->bytes_read += job->bytes_read;
+        stats->bytes_written += job->bytes_written;
+        stats->pixels += (uint64_t) job->width * job->height;
+    }
+    else {
+        stats->failed++;
+    }
+    stats->read_seconds += job->read_seconds;
+    stats->compute_seconds += job->compute_seconds;
+    stats->write_seconds += job->write_seconds;
+
+    FILE *report = batch->options->report;
+    if (report != NULL && job->ok) {
+        fprintf(report, "%s: %ux%u%s, read %.2f ms, compute %.2f ms, write %.2f ms, %llu -> %llu B\n",
+            job->path, job->width, job->height, job->cached ? " (cached)" : "", job->read_seconds * 1e3, job->compute_seconds * 1e3,
+            job->write_seconds * 1e3, (unsigned long long) job->bytes_read, (unsigned long long) job->bytes_written);
+    }
+    else if (report != NULL) {
+        fprintf(report, "%s: failed\n", job->path);
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+
+    // Read buffers come from the allocator, encoded results from `malloc()`
+    if (job->request.op == BMP_IO_READ) {
+        bmp_buffer_free(batch->allocator, job->request.data);
+    }
+    else {
+        free(job->request.data);
+    }
+    free(job->output);
+    free_bmp_image(job->image);
+    free(job);
+}
+
+/**
+ * Called by every thread of a stage when it ends. The last one closes
+ * queues around the stage, so the next stage ends too and the previous one
+ * doesn't wait for it if it ended early.
+ */
+static void leave_stage(struct batch* batch, size_t* left, struct queue* input, struct queue* output) {
+
+    pthread_mutex_lock(&batch->lock);
+    bool last = --*left == 0;
+    pthread_mutex_unlock(&batch->lock);
+
+    if (last) {
+        if (input != NULL) {
+            queue_close(input);
+        }
+        queue_close(output);
+    }
+}
+
+/**
+ * Path of result of the input file.
+ */
+static char* output_path(const struct batch_options* options, const char* path) {
+
+    char *result;
+    if (options->output_dir != NULL) {
+        const char *name = strrchr(path, '/');
+        name = name != NULL ? name + 1 : path;
+        result = (char*) malloc(strlen(options->output_dir) + strlen(name) + 2);
+        if (result != NULL) {
+            sprintf(result, "%s/%s", options->output_dir, name);
+        }
+        return result;
+    }
+
+    // Extension is replaced
+    size_t length = strlen(path);
+    if (length >= 4 && strcmp(path + length - 4, ".bmp") == 0) {
+        length -= 4;
+    }
+    result = (char*) malloc(length + sizeof(".out.bmp"));
+    if (result != NULL) {
+        memcpy(result, path, length);
+        strcpy(result + length, ".out.bmp");
+    }
+    return result;
+}
+
+static void* read_files(void* arg) {
+
+    struct batch *batch = (struct batch*) arg;
+    bmp_set_allocator(batch->allocator);
+
+    while (true) {
+        pthread_mutex_lock(&batch->lock);
+        size_t index = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (index >= batch->count) {
+            break;
+        }
+
+        struct job *job = (struct job*) calloc(1, sizeof(struct job));
+        if (job == NULL) {
+            pthread_mutex_lock(&batch->lock);
+            batch->stats->failed++;
+            pthread_mutex_unlock(&batch->lock);
+            continue;
+        }
+        job->path = batch->paths[index];
+
+        // Pixels are mapped, they are read while the image is processed
+        double start = now();
+        job->image = read_bmp_mmap(job->path);
+        job->read_seconds = now() - start;
+
+        struct stat st;
+        if (job->image == NULL || stat(job->path, &st) != 0) {
+            finish_job(batch, job);
+            continue;
+        }
+        job->bytes_read = st.st_size;
+        job->width = job->image->info.width;
+        job->height = job->image->info.height;
+
+        if (!queue_push(batch->loaded, job)) {
+            finish_job(batch, job);
+        }
+    }
+
+    leave_stage(batch, &batch->readers_left, NULL, batch->loaded);
+    bmp_set_allocator(NULL);
+    return NULL;
+}
+
+/**
+ * Keeps up to `io_depth` reads in flight and passes whole files to
+ * workers, which decode them.
+ */
+static void* read_files_async(void* arg) {
+
+    struct batch *batch = (struct batch*) arg;
+    struct bmp_io *io = batch->read_io;
+    double busy = 0;
+    double busyStart = 0;
+
+    while (true) {
+        while (bmp_io_pending(io) < batch->io_depth && batch->next < batch->count) {
+            struct job *job = (struct job*) calloc(1, sizeof(struct job));
+            pthread_mutex_lock(&batch->lock);
+            size_t index = batch->next++;
+            if (job == NULL) {
+                batch->stats->failed++;
+            }
+            pthread_mutex_unlock(&batch->lock);
+            if (job == NULL) {
+                continue;
+            }
+
+            job->path = batch->paths[index];
+            job->request.op = BMP_IO_READ;
+            job->request.path = job->path;
+            job->request.user = job;
+            job->started = now();
+            if (bmp_io_pending(io) == 0) {
+                busyStart = job->started;
+            }
+            bmp_io_submit(io, &job->request);
+        }
+
+        struct bmp_io_request *request = bmp_io_wait(io);
+        if (request == NULL) {
+            break;
+        }
+
+        double done = now();
+        if (bmp_io_pending(io) == 0) {
+            busy += done - busyStart;
+        }
+
+        struct job *job = (struct job*) request->user;
+        job->read_seconds = done - job->started;
+        job->bytes_read = request->size;
+        if (request->error != 0 || !queue_push(batch->loaded, job)) {
+            finish_job(batch, job);
+        }
+    }
+
+    // Requests lost by failed backend
+    pthread_mutex_lock(&batch->lock);
+    batch->stats->failed += bmp_io_pending(io);
+    batch->stats->read_busy_seconds += busy;
+    pthread_mutex_unlock(&batch->lock);
+
+    leave_stage(batch, &batch->readers_left, NULL, batch->loaded);
+    return NULL;
+}
+
+/**
+ * Decodes file read asynchronously and frees its buffer.
+ */
+static struct bmp_image* decode_job(struct batch* batch, struct job* job) {
+
+    double start = now();
+    struct bmp_image *image = read_bmp_memory(job->request.data, job->request.size);
+    bmp_buffer_free(batch->allocator, job->request.data);
+    job->request.data = NULL;
+    job->read_seconds += now() - start;
+
+    if (image != NULL) {
+        job->width = image->info.width;
+        job->height = image->info.height;
+    }
+
+    return image;
+}
+
+/**
+ * Encodes result into memory for asynchronous write.
+ */
+static bool encode_job(struct batch* batch, struct job* job) {
+
+    double start = now();
+    char *data = NULL;
+    size_t size = 0;
+    FILE *stream = open_memstream(&data, &size);
+    if (stream == NULL) {
+        return false;
+    }
+
+    bool ok = batch->options->rle ? write_bmp_rle(stream, job->image) : write_bmp(stream, job->image);
+    ok = fclose(stream) == 0 && ok;
+
+    job->request.op = BMP_IO_WRITE;
+    job->request.data = (uint8_t*) data;
+    job->request.size = size;
+    job->write_seconds = now() - start;
+
+    return ok;
+}
+
+static void* process_images(void* arg) {
+
+    struct batch *batch = (struct batch*) arg;
+    bmp_set_allocator(batch->allocator);
+
+    struct job *job;
+    while ((job = (struct job*) queue_pop(batch->loaded)) != NULL) {
+        if (batch->read_io != NULL) {
+            job->image = decode_job(batch, job);
+            if (job->image == NULL) {
+                finish_job(batch, job);
+                continue;
+            }
+        }
+
+        double start = now();
+        struct bmp_cache *cache = batch->options->cache;
+        struct bmp_cache_key key = { 0, batch->ops_hash };
+        if (cache != NULL) {
+            key.image = bmp_hash(job->image);
+            job->request.data = bmp_cache_get(cache, &key, &job->request.size);
+        }
+
+        // Cached result is written as it is
+        if (job->request.data != NULL) {
+            free_bmp_image(job->image);
+            job->image = NULL;
+            job->request.op = BMP_IO_WRITE;
+            job->cached = true;
+            job->compute_seconds = now() - start;
+
+            if (!queue_push(batch->processed, job)) {
+                finish_job(batch, job);
+            }
+            continue;
+        }
+
+        struct bmp_image *result = pipeline_run(batch->options->pipeline, job->image);
+        free_bmp_image(job->image);
+        job->image = result;
+        job->compute_seconds = now() - start;
+
+        // Results are stored encoded, so they are written the same way
+        bool encode = batch->write_io != NULL || cache != NULL;
+        if (result != NULL && encode && !encode_job(batch, job)) {
+            free_bmp_image(job->image);
+            job->image = result = NULL;
+        }
+        if (result != NULL && cache != NULL) {
+            bmp_cache_put(cache, &key, job->request.data, job->request.size);
+            free_bmp_image(job->image);
+            job->image = NULL;
+        }
+
+        if (result == NULL || !queue_push(batch->processed, job)) {
+            finish_job(batch, job);
+        }
+    }
+
+    leave_stage(batch, &batch->workers_left, batch->loaded, batch->processed);
+    bmp_set_allocator(NULL);
+    return NULL;
+}
+
+static void* write_results(void* arg) {
+
+    struct batch *batch = (struct batch*) arg;
+    bmp_set_allocator(batch->allocator);
+
+    struct job *job;
+    while ((job = (struct job*) queue_pop(batch->processed)) != NULL) {
+        double start = now();
+        char *path = output_path(batch->options, job->path);
+        FILE *stream = path != NULL ? fopen(path, "wb") : NULL;
+        if (stream != NULL) {
+            // Results encoded by workers have no image
+            if (job->image == NULL)
+                job->ok = fwrite(job->request.data, 1, job->request.size, stream) == job->request.size;
+            else
+                job->ok = batch->options->rle ? write_bmp_rle(stream, job->image) : write_bmp(stream, job->image);
+            long size = ftell(stream);
+            job->ok = fclose(stream) == 0 && job->ok;
+            job->bytes_written = size > 0 ? size : 0;
+        }
+        free(path);
+        job->write_seconds = now() - start;
+
+        finish_job(batch, job);
+    }
+
+    leave_stage(batch, &batch->writers_left, batch->processed, batch->processed);
+    bmp_set_allocator(NULL);
+    return NULL;
+}
+
+/**
+ * Writes results encoded by workers, keeps up to `io_depth` writes in
+ * flight and blocks on the queue only when nothing is being written.
+ */
+static void* write_results_async(void* arg) {
+
+    struct batch *batch = (struct batch*) arg;
+    struct bmp_io *io = batch->write_io;
+    bool closed = false;
+    double busy = 0;
+    double busyStart = 0;
+
+    while (!closed || bmp_io_pending(io) > 0) {
+        while (!closed && bmp_io_pending(io) < batch->io_depth) {
+            struct job *job = bmp_io_pending(io) == 0 ? (struct job*) queue_pop(batch->processed) : (struct job*) queue_try_pop(batch->processed, &closed);
+            if (job == NULL) {
+                closed = closed || bmp_io_pending(io) == 0;
+                break;
+            }
+
+            // Pixels are not needed anymore
+            free_bmp_image(job->image);
+            job->image = NULL;
+
+            job->output = output_path(batch->options, job->path);
+            if (job->output == NULL) {
+                finish_job(batch, job);
+                continue;
+            }
+            job->request.path = job->output;
+            job->request.user = job;
+            job->started = now();
+            if (bmp_io_pending(io) == 0) {
+                busyStart = job->started;
+            }
+            bmp_io_submit(io, &job->request);
+        }
+
+        struct bmp_io_request *request = bmp_io_wait(io);
+        if (request == NULL) {
+            break;
+        }
+
+        double done = now();
+        if (bmp_io_pending(io) == 0) {
+            busy += done - busyStart;
+        }
+
+        struct job *job = (struct job*) request->user;
+        job->write_seconds += done - job->started;
+        job->ok = request->error == 0;
+        job->bytes_written = job->ok ? request->size : 0;
+        finish_job(batch, job);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    batch->stats->failed += bmp_io_pending(io);
+    batch->stats->write_busy_seconds += busy;
+    pthread_mutex_unlock(&batch->lock);
+
+    leave_stage(batch, &batch->writers_left, batch->processed, batch->processed);
+    return NULL;
+}
+
+/**
+ * Starts `count` threads of a stage. Threads which can't be started leave
+ * the stage right away.
+ */
+static void start_stage(struct batch* batch, pthread_t* threads, bool* started, size_t count, void* (*stage)(void*), size_t* left, struct queue* input, struct queue* output) {
+    for (size_t index = 0; index < count; index++) {
+        started[index] = pthread_create(&threads[index], NULL, stage, batch) == 0;
+        if (!started[index]) {
+            leave_stage(batch, left, input, output);
+        }
+    }
+}
+
+bool batch_run(const char* const* paths, size_t count, const struct batch_options* options, struct batch_stats* stats) {
+
+    if (stats == NULL) {
+        return false;
+    }
+    memset(stats, 0, sizeof(struct batch_stats));
+
+    if (paths == NULL || options == NULL || options->pipeline == NULL) {
+        return false;
+    }
+
+    // One worker per CPU by default
+    size_t workers = options->workers;
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (size_t) cpus : 1;
+    }
+    size_t readers = options->readers > 0 ? options->readers : 1;
+    size_t writers = options->writers > 0 ? options->writers : 1;
+    size_t depth = options->queue_depth > 0 ? options->queue_depth : 2 * workers;
+    size_t io_depth = options->io_depth > 0 ? options->io_depth : BATCH_IO_DEPTH;
+
+    // Same operations written in another format give another result
+    uint64_t ops_hash = pipeline_hash(options->pipeline);
+    ops_hash = bmp_hash_bytes(&options->rle, sizeof(options->rle), ops_hash);
+
+    struct bmp_allocator *allocator = bmp_allocator_create(BATCH_CACHE_LIMIT);
+    struct bmp_io *read_io = NULL;
+    struct bmp_io *write_io = NULL;
+    if (options->async_io && allocator != NULL) {
+        read_io = bmp_io_create(options->backend, io_depth, allocator);
+        write_io = read_io != NULL ? bmp_io_create(options->backend, io_depth, allocator) : NULL;
+    }
+
+    // One thread drives each backend, files are read directly without it
+    if (read_io != NULL && write_io != NULL) {
+        readers = 1;
+        writers = 1;
+        stats->io = bmp_io_name(read_io);
+    }
+    else {
+        bmp_io_free(read_io);
+        read_io = NULL;
+        stats->io = "mmap";
+    }
+
+    struct batch batch = {
+        .paths = paths,
+        .count = count,
+        .options = options,
+        .allocator = allocator,
+        .read_io = read_io,
+        .write_io = write_io,
+        .io_depth = io_depth,
+        .ops_hash = ops_hash,
+        .loaded = queue_create(depth),
+        .processed = queue_create(depth),
+        .readers_left = readers,
+        .workers_left = workers,
+        .writers_left = writers,
+        .stats = stats
+    };
+    pthread_mutex_init(&batch.lock, NULL);
+
+    size_t total = readers + workers + writers;
+    pthread_t *threads = (pthread_t*) calloc(total, sizeof(pthread_t));
+    bool *started = (bool*) calloc(total, sizeof(bool));
+    if (batch.allocator == NULL || batch.loaded == NULL || batch.processed == NULL || threads == NULL || started == NULL) {
+        bmp_io_free(read_io);
+        bmp_io_free(write_io);
+        bmp_allocator_free(batch.allocator);
+        queue_free(batch.loaded);
+        queue_free(batch.processed);
+        free(threads);
+        free(started);
+        pthread_mutex_destroy(&batch.lock);
+        stats->failed = count;
+        return false;
+    }
+
+    double start = now();
+    start_stage(&batch, threads + readers + workers, started + readers + workers, writers, write_io != NULL ? write_results_async : write_results, &batch.writers_left, batch.processed, batch.processed);
+    start_stage(&batch, threads + readers, started + readers, workers, process_images, &batch.workers_left, batch.loaded, batch.processed);
+    start_stage(&batch, threads, started, readers, read_io != NULL ? read_files_async : read_files, &batch.readers_left, NULL, batch.loaded);
+
+    for (size_t index = 0; index < total; index++) {
+        if (started[index]) {
+            pthread_join(threads[index], NULL);
+        }
+    }
+
+    // Jobs left behind by stages which couldn't start
+    struct job *job;
+    while ((job = (struct job*) queue_pop(batch.loaded)) != NULL) {
+        finish_job(&batch, job);
+    }
+    while ((job = (struct job*) queue_pop(batch.processed)) != NULL) {
+        finish_job(&batch, job);
+    }
+    stats->failed += batch.next < count ? count - batch.next : 0;
+    stats->seconds = now() - start;
+
+    bmp_io_free(read_io);
+    bmp_io_free(write_io);
+    bmp_allocator_free(batch.allocator);
+    queue_free(batch.loaded);
+    queue_free(batch.processed);
+    free(threads);
+    free(started);
+    pthread_mutex_destroy(&batch.lock);
+
+    return stats->failed == 0;
+}
+
+/**
+ * Files probed by threads of `batch_probe()`.
+ */
+struct probe {
+    const char* const* paths;
+    size_t count;
+    struct bmp_header* headers;
+    bool* valid;
+    pthread_mutex_t lock;       // guards fields below
+    size_t next;                // next file to probe
+    size_t found;               // valid files
+};
+
+static void* probe_files(void* arg) {
+
+    struct probe *probe = (struct probe*) arg;
+    size_t found = 0;
+
+    while (true) {
+        pthread_mutex_lock(&probe->lock);
+        size_t first = probe->next;
+        probe->next += PROBE_CHUNK;
+        pthread_mutex_unlock(&probe->lock);
+        if (first >= probe->count) {
+            break;
+        }
+
+        size_t last = first + PROBE_CHUNK < probe->count ? first + PROBE_CHUNK : probe->count;
+        for (size_t index = first; index < last; index++) {
+            probe->valid[index] = bmp_probe(probe->paths[index], &probe->headers[index]);
+            found += probe->valid[index];
+        }
+    }
+
+    pthread_mutex_lock(&probe->lock);
+    probe->found += found;
+    pthread_mutex_unlock(&probe->lock);
+    return NULL;
+}
+
+size_t batch_probe(const char* const* paths, size_t count, size_t threads, struct bmp_header* headers, bool* valid) {
+
+    if (paths == NULL || headers == NULL || valid == NULL) {
+        return 0;
+    }
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = BATCH_PROBE_THREADS * (cpus > 0 ? (size_t) cpus : 1);
+    }
+    size_t chunks = (count + PROBE_CHUNK - 1) / PROBE_CHUNK;
+    threads = threads < chunks ? threads : chunks;
+
+    struct probe probe = { .paths = paths, .count = count, .headers = headers, .valid = valid };
+    pthread_mutex_init(&probe.lock, NULL);
+
+    // Calling thread probes too, threads which can't be started are skipped
+    pthread_t *ids = (pthread_t*) calloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+    bool *started = (bool*) calloc(threads > 0 ? threads : 1, sizeof(bool));
+    for (size_t index = 1; index < threads && ids != NULL && started != NULL; index++) {
+        started[index] = pthread_create(&ids[index], NULL, probe_files, &probe) == 0;
+    }
+    probe_files(&probe);
+    for (size_t index = 1; index < threads && ids != NULL && started != NULL; index++) {
+        if (started[index]) {
+            pthread_join(ids[index], NULL);
+        }
+    }
+
+    free(ids);
+    free(started);
+    pthread_mutex_destroy(&probe.lock);
+    return probe.found;
+}
+
+void batch_print_stats(FILE* stream, const struct batch_stats* stats) {
+
+    if (stream == NULL || stats == NULL) {
+        return;
+    }
+
+    double seconds = stats->seconds > 0 ? stats->seconds : 1e-9;
+    fprintf(stream, "files: %zu processed, %zu failed in %.3f s (%.1f files/s), I/O: %s\n",
+        stats->files, stats->failed, stats->seconds, stats->files / seconds, stats->io != NULL ? stats->io : "none");
+    fprintf(stream, "read: %.2f MB (%.1f MB/s), written: %.2f MB (%.1f MB/s), %.1f Mpx/s\n",
+        stats->bytes_read / 1e6, stats->bytes_read / 1e6 / seconds,
+        stats->bytes_written / 1e6, stats->bytes_written / 1e6 / seconds, stats->pixels / 1e6 / seconds);
+    fprintf(stream, "time of stages summed over files: read %.3f s, compute %.3f s, write %.3f s\n",
+        stats->read_seconds, stats->compute_seconds, stats->write_seconds);
+    if (stats->read_busy_seconds > 0 || stats->write_busy_seconds > 0) {
+        fprintf(stream, "asynchronous I/O busy: read %.3f s, write %.3f s of %.3f s\n",
+            stats->read_busy_seconds, stats->write_busy_seconds, stats->seconds);
+    }
+    if (stats->cached > 0) {
+        fprintf(stream, "cache: %zu of %zu files written from the cache\n", stats->cached, stats->files);
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "bmp.h"
+#include "pipeline.h"
+#include "fileio.h"
+#include "cache.h"
+
+// Threads probing files per CPU by default
+#define BATCH_PROBE_THREADS 4
+
+
+/**
+ * Options of batch processing.
+ */
+struct batch_options {
+    const struct pipeline* pipeline;    // operations applied to every image
+    const char* output_dir;     // directory of results or `NULL` to write next to inputs
+    size_t readers;             // threads reading files
+    size_t workers;             // threads running the pipeline
+    size_t writers;             // threads writing files
+    size_t queue_depth;         // images waiting between two stages
+    bool rle;                   // write RLE compressed files when smaller
+    bool async_io;              // read and write whole files with asynchronous I/O
+    enum bmp_io_backend backend;    // backend of asynchronous I/O
+    size_t io_depth;            // files read or written at once with asynchronous I/O
+    FILE* report;               // per-file report or `NULL`
+    struct bmp_cache* cache;    // results of repeated inputs or `NULL`
+};
+
+
+/**
+ * Totals of batch processing. Times of stages are summed over all files, so
+ * they count overlapping reads and writes many times. With asynchronous I/O,
+ * busy times are wall times with any read or write in flight.
+ */
+struct batch_stats {
+    size_t files;               // files processed successfully
+    size_t failed;              // files which couldn't be read, processed or written
+    size_t cached;              // files written from the cache
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t pixels;            // pixels of source images
+    double seconds;             // wall time of the whole batch
+    const char* io;             // name of I/O backend
+    double read_seconds;
+    double compute_seconds;
+    double write_seconds;
+    double read_busy_seconds;
+    double write_busy_seconds;
+};
+
+
+/**
+ * Processes many files concurrently
+ *
+ * Files are read, run through the pipeline and written by three groups of
+ * threads connected with bounded queues, so reading of one file, processing
+ * of another and writing of third one overlap. With asynchronous I/O, one
+ * thread submits reads of many files at once and workers decode them from
+ * memory, results are encoded to memory and written the same way. If the
+ * backend is not available, files are read and written directly.
+ * With a cache, workers look up results of the same pixels and operations
+ * and write them without running the pipeline and encoding, new results
+ * are encoded by workers and stored.
+ * Result of `input.bmp` is
+ * written to `output_dir/input.bmp`, or to `input.out.bmp` if no directory
+ * is given.
+ *
+ * @param paths paths of input files
+ * @param count number of input files
+ * @param options options of processing
+ * @param stats totals of processing, filled on return
+ * @return `true` if all files were processed, `false` otherwise
+ */
+bool batch_run(const char* const* paths, size_t count, const struct batch_options* options, struct batch_stats* stats);
+
+
+/**
+ * Reads headers of many files concurrently
+ *
+ * Every file is checked by `bmp_probe()`, pixels are not read. Opening of
+ * files dominates, so there are more threads than CPUs by default.
+ *
+ * @param paths paths of files
+ * @param count number of files
+ * @param threads number of threads, 0 for `BATCH_PROBE_THREADS` per CPU
+ * @param headers headers of files in the order of paths
+ * @param valid whether file of the same index has a valid header
+ * @return number of valid files
+ */
+size_t batch_probe(const char* const* paths, size_t count, size_t threads, struct bmp_header* headers, bool* valid);
+
+
+/**
+ * Prints totals and throughput of batch processing
+ *
+ * @param stream opened output stream
+ * @param stats totals of processing
+ */
+void batch_print_stats(FILE* stream, const struct batch_stats* stats);
+
+#endif
@@ -0,0 +1,810 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <glob.h>
+#include <unistd.h>
+#include "bmp.h"
+#include "transformations.h"
+#include "filter.h"
+#include "color.h"
+#include "cache.h"
+#include "threadpool.h"
+#include "simd.h"
+
+// Pixels processed by every measurement, small images are repeated
+#define WORK_PIXELS (1 << 24)
+
+// Runs of every operation in the ops suite, before and after measuring
+#define WARMUP_RUNS 3
+#define MIN_RUNS 10
+#define MAX_RUNS 500
+
+// Slowdown of median reported by compare, in percent
+#define REGRESSION_PERCENT 10.0
+
+
+/**
+ * Creates 24-bit image filled with pseudo random pixels.
+ */
+static struct bmp_image* create_image(uint32_t width, uint32_t height) {
+
+    struct bmp_image *image = create_bmp_image(width, height);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    uint32_t seed = width * 31 + height;
+    for (size_t h = 0; h < height; h++) {
+        uint8_t *bytes = (uint8_t*) bmp_row(image, h);
+        for (size_t index = 0; index < (size_t) width * sizeof(struct pixel); index++) {
+            seed = seed * 1103515245 + 12345;
+            bytes[index] = seed >> 16;
+        }
+    }
+
+    return image;
+}
+
+/**
+ * Rotation by walking the result row by row, as it was done before tiling.
+ */
+static struct bmp_image* naive_rotate_right(const struct bmp_image* image) {
+
+    size_t new_width = image->header->height;
+    size_t new_height = image->header->width;
+    struct bmp_image *newImage = create_bmp_image(new_width, new_height);
+
+    for (size_t h = 0; h < new_height; h++) {
+        for (size_t w = 0; w < new_width; w++) {
+            bmp_row(newImage, new_height - 1 - h)[w] = bmp_row(image, w)[h];
+        }
+    }
+    return newImage;
+}
+
+static struct bmp_image* naive_rotate_left(const struct bmp_image* image) {
+
+    size_t new_width = image->header->height;
+    size_t new_height = image->header->width;
+    struct bmp_image *newImage = create_bmp_image(new_width, new_height);
+
+    for (size_t h = 0; h < new_height; h++) {
+        for (size_t w = 0; w < new_width; w++) {
+            bmp_row(newImage, h)[new_width - 1 - w] = bmp_row(image, w)[h];
+        }
+    }
+    return newImage;
+}
+
+static struct bmp_image* naive_rotate_180(const struct bmp_image* image) {
+
+    size_t width = image->header->width;
+    size_t height = image->header->height;
+    struct bmp_image *newImage = create_bmp_image(width, height);
+
+    for (size_t h = 0; h < height; h++) {
+        for (size_t w = 0; w < width; w++) {
+            bmp_row(newImage, h)[w] = bmp_row(image, height - 1 - h)[width - 1 - w];
+        }
+    }
+    return newImage;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Runs transformation enough times to process `WORK_PIXELS` and returns
+ * throughput in megapixels per second. Result of the last run is kept.
+ */
+static double measure(struct bmp_image* (*transform)(const struct bmp_image*), const struct bmp_image* image, struct bmp_image** result) {
+
+    size_t pxcount = (size_t) image->header->width * image->header->height;
+    size_t repeat = WORK_PIXELS / pxcount;
+    if (repeat < 1) {
+        repeat = 1;
+    }
+
+    double start = now();
+    for (size_t run = 0; run < repeat; run++) {
+        free_bmp_image(*result);
+        *result = transform(image);
+    }
+    double elapsed = now() - start;
+
+    return (double) pxcount * repeat / elapsed / 1e6;
+}
+
+static bool same_image(const struct bmp_image* a, const struct bmp_image* b) {
+    if (a == NULL || b == NULL || a->header->width != b->header->width || a->header->height != b->header->height) {
+        return false;
+    }
+
+    for (size_t h = 0; h < a->header->height; h++) {
+        if (memcmp(bmp_row(a, h), bmp_row(b, h), (size_t) a->header->width * sizeof(struct pixel)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool compare(const char* name, struct bmp_image* (*naive)(const struct bmp_image*), struct bmp_image* (*tiled)(const struct bmp_image*), const struct bmp_image* image) {
+
+    struct bmp_image *naiveResult = NULL;
+    struct bmp_image *tiledResult = NULL;
+
+    double naiveSpeed = measure(naive, image, &naiveResult);
+    double tiledSpeed = measure(tiled, image, &tiledResult);
+    bool same = same_image(naiveResult, tiledResult);
+
+    printf("%-12s %6u x %-6u %10.1f %10.1f %7.2fx %s\n", name, image->header->width, image->header->height,
+           naiveSpeed, tiledSpeed, tiledSpeed / naiveSpeed, same ? "" : "MISMATCH");
+
+    free_bmp_image(naiveResult);
+    free_bmp_image(tiledResult);
+
+    return same;
+}
+
+/**
+ * Compares tiled rotations with the row-major loops on images with sides
+ * up to `limit`.
+ */
+static bool bench_rotate(uint32_t limit) {
+
+    const uint32_t sizes[][2] = {
+        { 1, 1 }, { 2, 1 }, { 3, 2 }, { 4, 4 },
+        { 64, 64 }, { 255, 257 }, { 1024, 1024 }, { 1920, 1080 },
+        { 4096, 4096 }, { 8192, 8192 }, { 16384, 16384 }
+    };
+
+    printf("%-12s %15s %10s %10s %8s\n", "operation", "size", "naive Mp/s", "tiled Mp/s", "speedup");
+
+    bool ok = true;
+    for (size_t index = 0; index < sizeof(sizes) / sizeof(sizes[0]); index++) {
+        if (sizes[index][0] > limit || sizes[index][1] > limit) {
+            continue;
+        }
+
+        struct bmp_image *image = create_image(sizes[index][0], sizes[index][1]);
+        if (image == NULL) {
+            fprintf(stderr, "Error: Not enough memory for %u x %u image.\n", sizes[index][0], sizes[index][1]);
+            break;
+        }
+
+        ok = compare("rotate_right", naive_rotate_right, rotate_right, image) && ok;
+        ok = compare("rotate_left", naive_rotate_left, rotate_left, image) && ok;
+        ok = compare("rotate_180", naive_rotate_180, rotate_180, image) && ok;
+        free_bmp_image(image);
+    }
+
+    return ok;
+}
+
+static struct bmp_image* bench_flip_horizontally(const struct bmp_image* image) {
+    return flip_horizontally(image);
+}
+
+static struct bmp_image* bench_flip_vertically(const struct bmp_image* image) {
+    return flip_vertically(image);
+}
+
+static struct bmp_image* bench_crop(const struct bmp_image* image) {
+    return crop(image, image->header->height / 4, image->header->width / 4, image->header->height / 2, image->header->width / 2);
+}
+
+static struct bmp_image* bench_scale(const struct bmp_image* image) {
+    return scale(image, 0.7f);
+}
+
+static struct bmp_image* bench_bilinear(const struct bmp_image* image) {
+    return resample(image, 1.3f, SCALE_BILINEAR);
+}
+
+static struct bmp_image* bench_area(const struct bmp_image* image) {
+    return resample(image, 0.3f, SCALE_AREA);
+}
+
+static struct bmp_image* bench_extract(const struct bmp_image* image) {
+    return extract(image, "rg");
+}
+
+/**
+ * Measures throughput of transformations on 4096 x 4096 image with pools
+ * from 1 up to `limit` threads.
+ */
+static bool bench_threads(size_t limit) {
+
+    const struct {
+        const char* name;
+        struct bmp_image* (*transform)(const struct bmp_image*);
+    } operations[] = {
+        { "flip_h", bench_flip_horizontally },
+        { "flip_v", bench_flip_vertically },
+        { "rotate_right", rotate_right },
+        { "rotate_left", rotate_left },
+        { "rotate_180", rotate_180 },
+        { "crop", bench_crop },
+        { "scale", bench_scale },
+        { "bilinear", bench_bilinear },
+        { "area", bench_area },
+        { "extract", bench_extract }
+    };
+    size_t count = sizeof(operations) / sizeof(operations[0]);
+
+    struct bmp_image *image = create_image(4096, 4096);
+    if (image == NULL) {
+        fprintf(stderr, "Error: Not enough memory for 4096 x 4096 image.\n");
+        return false;
+    }
+
+    // Serial results to compare with
+    struct bmp_image **serial = (struct bmp_image**) calloc(count, sizeof(struct bmp_image*));
+    for (size_t op = 0; op < count; op++) {
+        serial[op] = operations[op].transform(image);
+    }
+
+    printf("%-8s", "threads");
+    for (size_t op = 0; op < count; op++) {
+        printf(" %12s", operations[op].name);
+    }
+    printf("   (Mp/s)\n");
+
+    bool ok = true;
+    // Powers of two and the limit itself
+    for (size_t size = 1; size <= limit; size = size < limit && size * 2 > limit ? limit : size * 2) {
+        struct thread_pool *pool = thread_pool_create(size);
+        set_thread_pool(pool);
+
+        printf("%-8zu", size);
+        for (size_t op = 0; op < count; op++) {
+            struct bmp_image *result = NULL;
+            double speed = measure(operations[op].transform, image, &result);
+            bool same = same_image(serial[op], result);
+            ok = ok && same;
+            printf(" %11.1f%s", speed, same ? " " : "!");
+            free_bmp_image(result);
+        }
+        printf("\n");
+
+        set_thread_pool(NULL);
+        thread_pool_free(pool);
+    }
+
+    for (size_t op = 0; op < count; op++) {
+        free_bmp_image(serial[op]);
+    }
+    free(serial);
+    free_bmp_image(image);
+
+    if (!ok) {
+        printf("Results marked with ! differ from serial execution.\n");
+    }
+    return ok;
+}
+
+/**
+ * Table lookup with a plain loop, as it was done before the vector kernel.
+ */
+static void naive_lookup(uint8_t* dest, const uint8_t* src, size_t count, const uint8_t* table) {
+    for (size_t index = 0; index < count; index++) {
+        dest[index] = table[src[index]];
+    }
+}
+
+/**
+ * Looks up all rows of image enough times to process `WORK_PIXELS` bytes
+ * and returns throughput in megabytes per second.
+ */
+static double measure_lookup(void (*lookup)(uint8_t*, const uint8_t*, size_t, const uint8_t*), const struct bmp_image* image, uint8_t* dest, const uint8_t* table) {
+
+    size_t rowSize = (size_t) image->header->width * image->pixel_size;
+    size_t bytes = rowSize * image->header->height;
+    size_t repeat = bytes > 0 && WORK_PIXELS / bytes > 0 ? WORK_PIXELS / bytes : 1;
+
+    double start = now();
+    for (size_t run = 0; run < repeat; run++) {
+        for (size_t h = 0; h < image->header->height; h++) {
+            lookup(dest + h * rowSize, (const uint8_t*) bmp_row(image, h), rowSize, table);
+        }
+    }
+    double elapsed = now() - start;
+
+    return (double) bytes * repeat / elapsed / 1e6;
+}
+
+/**
+ * Compares `lookup_bytes()` with the plain loop on rows of the assets.
+ */
+static bool bench_lookup(const char* pattern) {
+
+    glob_t files = { 0 };
+    if (glob(pattern, 0, NULL, &files) != 0) {
+        fprintf(stderr, "Error: No files match '%s'.\n", pattern);
+        return false;
+    }
+
+    // Curve of brightness adjustment, the same table for every channel
+    uint8_t table[256];
+    for (size_t index = 0; index < 256; index++) {
+        table[index] = 255 * pow(index / 255.0, 0.8);
+    }
+
+    printf("%-32s %15s %10s %10s %8s\n", "file", "size", "naive MB/s", "simd MB/s", "speedup");
+
+    bool ok = true;
+    double naiveTotal = 0;
+    double simdTotal = 0;
+    size_t measured = 0;
+    for (size_t index = 0; index < files.gl_pathc; index++) {
+        FILE *stream = fopen(files.gl_pathv[index], "rb");
+        struct bmp_image *image = stream != NULL ? read_bmp(stream) : NULL;
+        if (stream != NULL) {
+            fclose(stream);
+        }
+        if (image == NULL) {
+            continue;
+        }
+
+        size_t bytes = (size_t) image->header->width * image->pixel_size * image->header->height;
+        uint8_t *naive = (uint8_t*) malloc(bytes + 1);
+        uint8_t *simd = (uint8_t*) malloc(bytes + 1);
+        if (naive == NULL || simd == NULL) {
+            free(naive);
+            free(simd);
+            free_bmp_image(image);
+            fprintf(stderr, "Error: Not enough memory for '%s'.\n", files.gl_pathv[index]);
+            ok = false;
+            break;
+        }
+
+        double naiveSpeed = measure_lookup(naive_lookup, image, naive, table);
+        double simdSpeed = measure_lookup(lookup_bytes, image, simd, table);
+        bool same = memcmp(naive, simd, bytes) == 0;
+        ok = ok && same;
+        naiveTotal += naiveSpeed;
+        simdTotal += simdSpeed;
+        measured++;
+
+        printf("%-32s %6u x %-6u %10.1f %10.1f %7.2fx %s\n", files.gl_pathv[index], image->header->width, image->header->height,
+               naiveSpeed, simdSpeed, simdSpeed / naiveSpeed, same ? "" : "MISMATCH");
+
+        free(naive);
+        free(simd);
+        free_bmp_image(image);
+    }
+
+    if (measured > 0) {
+        printf("%-32s %15s %10.1f %10.1f %7.2fx\n", "mean", "", naiveTotal / measured, simdTotal / measured, simdTotal / naiveTotal);
+    }
+
+    globfree(&files);
+    return ok;
+}
+
+/**
+ * Image and buffers shared by runs of one operation in the ops suite.
+ */
+struct op_context {
+    const struct bmp_image* image;
+    struct bmp_image* copy;     // fresh copy for in-place operations
+    struct bmp_image* result;   // freed after the run is measured
+    char* file;                 // image encoded as BMP file
+    size_t file_size;
+    FILE* stream;               // memory stream of `file_size` bytes for writing
+};
+
+/**
+ * Operation measured by the ops suite.
+ */
+struct op_bench {
+    const char* name;
+    bool (*run)(struct op_context*);
+    bool inplace;               // runs on `copy`, which is made before every run
+};
+
+static bool op_read(struct op_context* ctx) {
+    ctx->result = read_bmp_memory(ctx->file, ctx->file_size);
+    return ctx->result != NULL;
+}
+
+static bool op_write(struct op_context* ctx) {
+    rewind(ctx->stream);
+    return write_bmp(ctx->stream, ctx->image) && fflush(ctx->stream) == 0;
+}
+
+static bool op_histogram(struct op_context* ctx) {
+    struct bmp_histogram histogram;
+    return bmp_histogram(ctx->image, &histogram);
+}
+
+static bool op_hash(struct op_context* ctx) {
+    return bmp_hash(ctx->image) != 0;
+}
+
+/**
+ * Contrast and gamma share one table for all channels, gray threshold
+ * looks up channels of every pixel.
+ */
+static bool op_adjust_colors(struct op_context* ctx) {
+    struct bmp_lut lut;
+    lut_identity(&lut);
+    lut_brightness_contrast(&lut, 10, 1.2f);
+    lut_gamma(&lut, 1.4f);
+    ctx->result = adjust_colors(ctx->image, &lut);
+    return ctx->result != NULL;
+}
+
+static bool op_adjust_gray(struct op_context* ctx) {
+    struct bmp_lut lut;
+    lut_identity(&lut);
+    lut_grayscale(&lut);
+    lut_threshold(&lut, 128);
+    ctx->result = adjust_colors(ctx->image, &lut);
+    return ctx->result != NULL;
+}
+
+// Kernel of 5 x 5 binomial blur
+static const float binomial[] = { 0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f };
+
+#define OP_COPY(name, call) \
+    static bool op_##name(struct op_context* ctx) { \
+        const struct bmp_image *image = ctx->image; \
+        ctx->result = call; \
+        return ctx->result != NULL; \
+    }
+
+#define OP_INPLACE(name, call) \
+    static bool op_##name(struct op_context* ctx) { \
+        struct bmp_image *image = ctx->copy; \
+        return call; \
+    }
+
+OP_COPY(flip_horizontally, flip_horizontally(image))
+OP_COPY(flip_vertically, flip_vertically(image))
+OP_COPY(rotate_right, rotate_right(image))
+OP_COPY(rotate_left, rotate_left(image))
+OP_COPY(rotate_180, rotate_180(image))
+OP_COPY(scale, scale(image, 0.7f))
+OP_COPY(resample_bilinear, resample(image, 1.3f, SCALE_BILINEAR))
+OP_COPY(resample_area, resample(image, 0.3f, SCALE_AREA))
+OP_COPY(crop, crop(image, image->header->height / 4, image->header->width / 4, image->header->height / 2, image->header->width / 2))
+OP_COPY(crop_view, crop_view(image, image->header->height / 4, image->header->width / 4, image->header->height / 2, image->header->width / 2))
+OP_COPY(extract, extract(image, "rg"))
+OP_COPY(rotate_nearest, rotate(image, 30, SCALE_NEAREST))
+OP_COPY(rotate_bilinear, rotate(image, 30, SCALE_BILINEAR))
+OP_COPY(box_blur, box_blur(image, 8))
+OP_COPY(gaussian_blur, gaussian_blur(image, 3.0f))
+OP_COPY(unsharp_mask, unsharp_mask(image, 1.5f, 0.8f, 2))
+OP_COPY(convolve, convolve(image, binomial, 5, binomial, 5))
+OP_INPLACE(flip_horizontally_inplace, flip_horizontally_inplace(image))
+OP_INPLACE(flip_vertically_inplace, flip_vertically_inplace(image))
+OP_INPLACE(rotate_right_inplace, rotate_right_inplace(image))
+OP_INPLACE(rotate_left_inplace, rotate_left_inplace(image))
+OP_INPLACE(rotate_180_inplace, rotate_180_inplace(image))
+OP_INPLACE(crop_inplace, crop_inplace(image, image->header->height / 4, image->header->width / 4, image->header->height / 2, image->header->width / 2))
+OP_INPLACE(extract_inplace, extract_inplace(image, "rg"))
+
+static const struct op_bench op_benches[] = {
+    { "read_bmp", op_read, false },
+    { "write_bmp", op_write, false },
+    { "flip_horizontally", op_flip_horizontally, false },
+    { "flip_vertically", op_flip_vertically, false },
+    { "rotate_right", op_rotate_right, false },
+    { "rotate_left", op_rotate_left, false },
+    { "rotate_180", op_rotate_180, false },
+    { "scale", op_scale, false },
+    { "resample_bilinear", op_resample_bilinear, false },
+    { "resample_area", op_resample_area, false },
+    { "crop", op_crop, false },
+    { "crop_view", op_crop_view, false },
+    { "extract", op_extract, false },
+    { "rotate_nearest", op_rotate_nearest, false },
+    { "rotate_bilinear", op_rotate_bilinear, false },
+    { "box_blur", op_box_blur, false },
+    { "gaussian_blur", op_gaussian_blur, false },
+    { "unsharp_mask", op_unsharp_mask, false },
+    { "convolve", op_convolve, false },
+    { "histogram", op_histogram, false },
+    { "adjust_colors", op_adjust_colors, false },
+    { "adjust_gray", op_adjust_gray, false },
+    { "hash", op_hash, false },
+    { "flip_horizontally_inplace", op_flip_horizontally_inplace, true },
+    { "flip_vertically_inplace", op_flip_vertically_inplace, true },
+    { "rotate_right_inplace", op_rotate_right_inplace, true },
+    { "rotate_left_inplace", op_rotate_left_inplace, true },
+    { "rotate_180_inplace", op_rotate_180_inplace, true },
+    { "crop_inplace", op_crop_inplace, true },
+    { "extract_inplace", op_extract_inplace, true }
+};
+
+static struct bmp_image* copy_image(const struct bmp_image* image) {
+
+    struct bmp_image *copy = create_bmp_image_like(image, image->header->width, image->header->height);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    size_t length = (size_t) image->header->width * image->pixel_size;
+    for (size_t h = 0; h < image->header->height; h++) {
+        memcpy(bmp_row(copy, h), bmp_row(image, h), length);
+    }
+    return copy;
+}
+
+static int compare_seconds(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Times one run, setup of in-place copy and freeing of result are not
+ * counted. Returns negative time if the operation failed.
+ */
+static double time_op(const struct op_bench* op, struct op_context* ctx) {
+
+    if (op->inplace) {
+        ctx->copy = copy_image(ctx->image);
+        if (ctx->copy == NULL) {
+            return -1;
+        }
+    }
+
+    double start = now();
+    bool ok = op->run(ctx);
+    double elapsed = now() - start;
+
+    free_bmp_image(ctx->result);
+    free_bmp_image(ctx->copy);
+    ctx->result = NULL;
+    ctx->copy = NULL;
+
+    return ok ? elapsed : -1;
+}
+
+/**
+ * Runs operation after warmup enough times to process `WORK_PIXELS`, within
+ * `MIN_RUNS` and `MAX_RUNS`, and prints its statistics as a line of table
+ * and as an object of JSON. Operations which can't run on the image (for
+ * example in-place rotation of rectangle) are skipped.
+ */
+static bool bench_op(const struct op_bench* op, struct op_context* ctx, FILE* json, bool* first) {
+
+    const struct bmp_image *image = ctx->image;
+    size_t pxcount = (size_t) image->header->width * image->header->height;
+    size_t runs = WORK_PIXELS / pxcount;
+    runs = runs < MIN_RUNS ? MIN_RUNS : runs > MAX_RUNS ? MAX_RUNS : runs;
+
+    for (size_t run = 0; run < WARMUP_RUNS; run++) {
+        if (time_op(op, ctx) < 0) {
+            return true;
+        }
+    }
+
+    double *samples = (double*) malloc(runs * sizeof(double));
+    if (samples == NULL) {
+        return false;
+    }
+    for (size_t run = 0; run < runs; run++) {
+        samples[run] = time_op(op, ctx);
+        if (samples[run] < 0) {
+            free(samples);
+            return false;
+        }
+    }
+
+    qsort(samples, runs, sizeof(double), compare_seconds);
+    double min = samples[0];
+    double median = samples[runs / 2];
+    double p99 = samples[(runs * 99 + 99) / 100 - 1];
+    double mbs = image->header->size / median / 1e6;
+    free(samples);
+
+    printf("%-26s %6u x %-6u %6zu %10.3f %10.3f %10.3f %10.1f\n", op->name, image->header->width, image->header->height,
+           runs, min * 1e3, median * 1e3, p99 * 1e3, mbs);
+
+    if (json != NULL) {
+        fprintf(json, "%s    {\"op\": \"%s\", \"width\": %u, \"height\": %u, \"runs\": %zu, \"min_ms\": %.6f, \"median_ms\": %.6f, \"p99_ms\": %.6f, \"mb_s\": %.3f}",
+                *first ? "" : ",\n", op->name, image->header->width, image->header->height, runs, min * 1e3, median * 1e3, p99 * 1e3, mbs);
+        *first = false;
+    }
+
+    return true;
+}
+
+/**
+ * Measures `read_bmp()`, `write_bmp()` and every transformation on
+ * generated images with sides up to `limit`. Results are written as JSON
+ * to `path`, if it's given.
+ */
+static bool bench_ops(uint32_t limit, const char* path) {
+
+    const uint32_t sizes[][2] = {
+        { 64, 64 }, { 512, 512 }, { 1920, 1080 }, { 4096, 4096 }
+    };
+
+    FILE *json = NULL;
+    if (path != NULL) {
+        json = fopen(path, "w");
+        if (json == NULL) {
+            fprintf(stderr, "Error: Can't create '%s'.\n", path);
+            return false;
+        }
+        fprintf(json, "{\n  \"suite\": \"ops\",\n  \"results\": [\n");
+    }
+
+    printf("%-26s %15s %6s %10s %10s %10s %10s\n", "operation", "size", "runs", "min ms", "median ms", "p99 ms", "MB/s");
+
+    bool ok = true;
+    bool first = true;
+    for (size_t index = 0; index < sizeof(sizes) / sizeof(sizes[0]) && ok; index++) {
+        if (sizes[index][0] > limit || sizes[index][1] > limit) {
+            continue;
+        }
+
+        struct op_context ctx = { 0 };
+        struct bmp_image *image = create_image(sizes[index][0], sizes[index][1]);
+        ctx.image = image;
+
+        // Encoded once for reading, written over again into the same buffer
+        FILE *stream = image != NULL ? open_memstream(&ctx.file, &ctx.file_size) : NULL;
+        bool encoded = stream != NULL && write_bmp(stream, image);
+        encoded = stream != NULL && fclose(stream) == 0 && encoded;
+        char *buffer = encoded ? (char*) malloc(ctx.file_size) : NULL;
+        ctx.stream = buffer != NULL ? fmemopen(buffer, ctx.file_size, "wb") : NULL;
+
+        if (ctx.stream == NULL) {
+            fprintf(stderr, "Error: Not enough memory for %u x %u image.\n", sizes[index][0], sizes[index][1]);
+            ok = false;
+        }
+
+        for (size_t op = 0; op < sizeof(op_benches) / sizeof(op_benches[0]) && ok; op++) {
+            ok = bench_op(&op_benches[op], &ctx, json, &first);
+        }
+
+        if (ctx.stream != NULL) {
+            fclose(ctx.stream);
+        }
+        free(buffer);
+        free(ctx.file);
+        free_bmp_image(image);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        ok = fclose(json) == 0 && ok;
+    }
+
+    return ok;
+}
+
+/**
+ * Result of one operation loaded from JSON of the ops suite.
+ */
+struct op_result {
+    char op[64];
+    uint32_t width;
+    uint32_t height;
+    double median_ms;
+};
+
+/**
+ * Loads results written by `bench_ops()`, one object per line. Returns
+ * number of results or -1 if the file can't be read.
+ */
+static long load_results(const char* path, struct op_result** results) {
+
+    FILE *stream = fopen(path, "r");
+    if (stream == NULL) {
+        fprintf(stderr, "Error: Can't open '%s'.\n", path);
+        return -1;
+    }
+
+    long count = 0;
+    size_t capacity = 0;
+    *results = NULL;
+    char line[512];
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        struct op_result result;
+        const char *object = strstr(line, "{\"op\":");
+        if (object == NULL || sscanf(object, "{\"op\": \"%63[^\"]\", \"width\": %u, \"height\": %u, \"runs\": %*u, \"min_ms\": %*f, \"median_ms\": %lf",
+                                     result.op, &result.width, &result.height, &result.median_ms) != 4) {
+            continue;
+        }
+
+        if ((size_t) count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            struct op_result *grown = (struct op_result*) realloc(*results, capacity * sizeof(struct op_result));
+            if (grown == NULL) {
+                break;
+            }
+            *results = grown;
+        }
+        (*results)[count++] = result;
+    }
+
+    fclose(stream);
+    return count;
+}
+
+/**
+ * Compares medians of two runs of the ops suite and flags operations
+ * slower by more than `percent`. Returns `false` if there is any.
+ */
+static bool bench_compare(const char* base_path, const char* new_path, double percent) {
+
+    struct op_result *base, *current;
+    long base_count = load_results(base_path, &base);
+    long new_count = load_results(new_path, &current);
+    if (base_count < 0 || new_count < 0) {
+        free(base_count >= 0 ? base : NULL);
+        free(new_count >= 0 ? current : NULL);
+        return false;
+    }
+
+    printf("%-26s %15s %10s %10s %8s\n", "operation", "size", "base ms", "new ms", "change");
+
+    size_t regressions = 0;
+    for (long index = 0; index < new_count; index++) {
+        const struct op_result *result = &current[index];
+        const struct op_result *old = NULL;
+        for (long other = 0; other < base_count && old == NULL; other++) {
+            if (strcmp(base[other].op, result->op) == 0 && base[other].width == result->width && base[other].height == result->height) {
+                old = &base[other];
+            }
+        }
+        if (old == NULL || old->median_ms <= 0) {
+            continue;
+        }
+
+        double change = (result->median_ms / old->median_ms - 1) * 100;
+        bool regressed = change > percent;
+        regressions += regressed;
+        printf("%-26s %6u x %-6u %10.3f %10.3f %+7.1f%% %s\n", result->op, result->width, result->height,
+               old->median_ms, result->median_ms, change, regressed ? "REGRESSION" : "");
+    }
+
+    printf("%zu regressions over %.1f%%\n", regressions, percent);
+
+    free(base);
+    free(current);
+    return regressions == 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (argc > 1 && strcmp(argv[1], "compare") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s compare BASE.json NEW.json [PERCENT]\n", argv[0]);
+            return 1;
+        }
+        return bench_compare(argv[2], argv[3], argc > 4 ? atof(argv[4]) : REGRESSION_PERCENT) ? 0 : 1;
+    }
+
+    // Suite and its limit, all suites run by default
+    const char *suite = argc > 1 ? argv[1] : "all";
+    long limit = argc > 2 ? atol(argv[2]) : 0;
+
+    bool ok = true;
+    if (strcmp(suite, "rotate") == 0 || strcmp(suite, "all") == 0) {
+        ok = bench_rotate(limit > 0 ? (uint32_t) limit : 16384) && ok;
+    }
+    if (strcmp(suite, "threads") == 0 || strcmp(suite, "all") == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        ok = bench_threads(limit > 0 ? (size_t) limit : (size_t) (cpus > 0 ? cpus : 1)) && ok;
+    }
+    if (strcmp(suite, "ops") == 0 || strcmp(suite, "all") == 0) {
+        ok = bench_ops(limit > 0 ? (uint32_t) limit : 4096, argc > 3 ? argv[3] : NULL) && ok;
+    }
+    if (strcmp(suite, "lookup") == 0 || strcmp(suite, "all") == 0) {
+        ok = bench_lookup(strcmp(suite, "lookup") == 0 && argc > 2 ? argv[2] : "assets/*.bmp") && ok;
+    }
+
+    return ok ? 0 : 1;
+}
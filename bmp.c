@@ -1,58 +1,238 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "bmp.h"
+#include "alloc.h"
+#include "rle.h"
+#include "stats.h"
+
+// Slots of hash table of colors, twice the largest palette
+#define COLOR_SLOTS 512
+
+/**
+ * Position and width of one channel of 32-bit pixel.
+ */
+struct channel {
+    uint32_t mask;
+    uint32_t shift;
+    uint32_t bits;
+};
+
+/**
+ * Describes how pixels are stored in the file and converted to the memory
+ * layout of the image.
+ */
+struct pixel_format {
+    size_t file_stride;         // size of padded row in the file
+    bool unpack;                // 1/4 bpp indices are unpacked to bytes
+    bool convert;               // 32-bit pixels with other than BGRA masks
+    bool rle;                   // 4/8 bpp indices are compressed
+    struct channel channels[4]; // blue, green, red, alpha
+};
+
+/**
+ * Checks that bits per pixel and compression are supported together.
+ */
+static bool supported_format(uint16_t bpp, uint32_t compression) {
+    switch (bpp) {
+        case 1:
+        case 24:
+            return compression == BI_RGB;
+        case 4:
+            return compression == BI_RGB || compression == BI_RLE4;
+        case 8:
+            return compression == BI_RGB || compression == BI_RLE8;
+        case 32:
+            return compression == BI_RGB || compression == BI_BITFIELDS;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Checks header read from the file. Returns `false` if it is not a BMP file
+ * or the format is not supported. Reserved fields are cleared, so they are
+ * not copied to written files.
+ */
+static bool check_header(struct bmp_header* header) {
+
+    header->reserved1 = 0;
+    header->reserved2 = 0;
+    if (header->type != 0x4d42) {
+        return false;
+    }
+
+    // Check format, images stored from the top (negative height) are not supported
+    if (header->dib_size < DIB_SIZE || header->offset < 14 + header->dib_size) {
+        return false;
+    }
+    if ((int32_t) header->width < 0 || (int32_t) header->height < 0) {
+        return false;
+    }
+
+    return supported_format(header->bpp, header->compression);
+}
+
+/**
+ * Reads header from the stream into `newH` at once. Returns `false` if the
+ * stream is not a BMP file or the format is not supported.
+ */
+static bool load_header(FILE* stream, struct bmp_header* newH) {
+
+    // Go to start, fields are stored as in the file
+    fseek(stream, 0, SEEK_SET);
+    if (fread(newH, sizeof(struct bmp_header), 1, stream) != 1) {
+        return false;
+    }
+    BMP_STAT_READ(sizeof(struct bmp_header));
+
+    return check_header(newH);
+}
 
 struct bmp_header* read_bmp_header(FILE* stream) {
-    
+
+    BMP_STAT_SCOPE(BMP_STAT_READ_BMP_HEADER);
+
     // Check stream
     if (stream == NULL){
         return NULL;
     }
 
-    // Go to start
-    fseek(stream, 0, SEEK_SET);
-
     // New header calloc
     struct bmp_header *newH = (struct bmp_header*) calloc(1,sizeof(struct bmp_header));
-
-    // Read and check file field
-    size_t ret = fread(&newH->type, 2, 1, stream);
-
-    // Check corr
-    if (ret < 1) {
-         free(newH);
-         return NULL;
+    if (newH == NULL) {
+        return NULL;
     }
+    BMP_STAT_ALLOCATED(sizeof(struct bmp_header));
 
-    // Check val
-    if (newH->type != 0x4d42) {
+    if (!load_header(stream, newH)) {
         free(newH);
         return NULL;
     }
 
-    // Reading file size
-    fread(&newH->size, 4, 1, stream);
+    return newH;
+}
+
+/**
+ * Checks that file of `dataEnd` bytes matches the header and all rows of
+ * pixels are there.
+ */
+static bool valid_size(const struct bmp_header* header, size_t dataEnd) {
+
+    if (dataEnd != header->size || dataEnd < header->offset) {
+        return false;
+    }
+
+    // Size of compressed pixels is known only after decoding, which clips runs to the image
+    if (header->compression == BI_RLE8 || header->compression == BI_RLE4) {
+        return (uint64_t) header->width * header->height <= RLE_MAX_PIXELS;
+    }
 
-    // Reading h/w
-    fseek(stream,18,SEEK_SET);
-    fread(&newH->width, 4, 1, stream);
-    fread(&newH->height, 4, 1, stream);
+    return dataEnd - header->offset >= bmp_stride(header->width, header->bpp) * header->height;
+}
 
-    // Read X/Ypm
-    fseek(stream,38,SEEK_SET);
-    fread(&newH->x_ppm, 4, 1, stream);
-    fread(&newH->y_ppm, 4, 1, stream);
+bool bmp_check_size(FILE* stream, const struct bmp_header* header) {
 
-    // Writing constant data
-    newH->offset = 0x36;
-    newH->dib_size = 0x28;
-    newH->planes = 0x01;
-    newH->bpp = 0x18;
-    newH->image_size = newH->size - 54;
+    // Check data size
+    fseek(stream, 0, SEEK_END);
+    size_t dataEnd = ftell(stream);
 
-    return newH;
+    fseek(stream, header->offset, SEEK_SET);
+    return valid_size(header, dataEnd);
+}
+
+bool bmp_probe(const char* path, struct bmp_header* header) {
+
+    BMP_STAT_SCOPE(BMP_STAT_PROBE);
+
+    if (path == NULL || header == NULL) {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    // One read of the header, size of the file is known without reading it
+    struct stat st;
+    bool ok = pread(fd, header, sizeof(struct bmp_header), 0) == (ssize_t) sizeof(struct bmp_header) && fstat(fd, &st) == 0;
+    close(fd);
+    if (!ok) {
+        return false;
+    }
+    BMP_STAT_READ(sizeof(struct bmp_header));
+
+    return check_header(header) && valid_size(header, st.st_size);
+}
+
+/**
+ * Reads pixels of 24-bit image from the current position of the stream into
+ * `pxarr` without padding.
+ */
+static bool load_pixels(FILE* stream, const struct bmp_header* header, struct pixel* pxarr) {
+
+    // Calculate row sizes
+    size_t rowSize = (size_t) header->width * sizeof(struct pixel);
+    size_t strideSize = bmp_stride(header->width, BPP);
+    if (rowSize == 0 || header->height == 0) {
+        return true;
+    }
+
+    // No padding, rows are already packed as `struct pixel`
+    if (rowSize == strideSize) {
+        BMP_STAT_READ(rowSize * header->height);
+        return fread(pxarr, rowSize, header->height, stream) == header->height;
+    }
+
+    // Read padded rows in large chunks and drop the padding
+    size_t chunkRows = IO_CHUNK_SIZE / strideSize;
+    if (chunkRows < 1) {
+        chunkRows = 1;
+    }
+    if (chunkRows > header->height) {
+        chunkRows = header->height;
+    }
+
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    uint8_t *chunk = (uint8_t*) bmp_buffer_alloc(allocator, chunkRows * strideSize);
+    if (chunk == NULL) {
+        return false;
+    }
+
+    uint8_t *dest = (uint8_t*) pxarr;
+    size_t h = 0;
+    while (h < header->height) {
+        size_t rows = header->height - h;
+        if (rows > chunkRows) {
+            rows = chunkRows;
+        }
+
+        if (fread(chunk, strideSize, rows, stream) != rows) {
+            bmp_buffer_free(allocator, chunk);
+            return false;
+        }
+        BMP_STAT_READ(strideSize * rows);
+
+        for (size_t r = 0; r < rows; r++) {
+            memcpy(dest, chunk + r * strideSize, rowSize);
+            dest += rowSize;
+        }
+        h += rows;
+    }
+    bmp_buffer_free(allocator, chunk);
+
+    return true;
 }
 
 struct pixel* read_data(FILE* stream, const struct bmp_header* header) {
-    
+
+    BMP_STAT_SCOPE(BMP_STAT_READ_DATA);
+
     // Check header
     if (header == NULL) {
         return NULL;
@@ -63,117 +243,776 @@ struct pixel* read_data(FILE* stream, const struct bmp_header* header) {
         return NULL;
     }
 
+    // Only 24-bit pixels can be returned as `struct pixel`
+    if (header->bpp != BPP || header->compression != BI_RGB) {
+        return NULL;
+    }
+
     // Check data size
-    fseek(stream, 0, SEEK_END);
-    size_t dataEnd = ftell(stream);
+    if (!bmp_check_size(stream, header)) {
+        return NULL;
+    }
+
+    // Create pixel structure
+    size_t pxcount = (size_t) header->width * header->height;
+    struct pixel *pxarr = (struct pixel*) calloc(pxcount, sizeof(struct pixel));
+    BMP_STAT_ALLOCATED(pxcount * sizeof(struct pixel));
+    if (pxarr == NULL || pxcount == 0) {
+        return pxarr;
+    }
+    BMP_STAT_PIXELS(pxcount);
+
+    if (!load_pixels(stream, header, pxarr)) {
+        free(pxarr);
+        return NULL;
+    }
+
+    return pxarr;
+}
+
+/**
+ * Number of colors in palette of the image, 0 for images without palette.
+ */
+static uint32_t palette_colors(const struct bmp_header* header) {
 
+    if (header->bpp > 8) {
+        return 0;
+    }
+
+    uint32_t colors = header->num_colors;
+    if (colors == 0 || colors > (1u << header->bpp)) {
+        colors = 1u << header->bpp;
+    }
+
+    // Palette can't reach into pixels
+    uint32_t space = (header->offset - 14 - header->dib_size) / sizeof(struct bmp_color);
+    return colors < space ? colors : space;
+}
+
+/**
+ * Finds position of channel in 32-bit pixel, empty mask gives no bits.
+ */
+static struct channel make_channel(uint32_t mask) {
+    struct channel channel = { .mask = mask };
+    if (mask != 0) {
+        channel.shift = __builtin_ctz(mask);
+        channel.bits = __builtin_popcount(mask);
+    }
+    return channel;
+}
+
+/**
+ * Finds out how pixels of the file are converted to the memory layout.
+ * Channel masks of `BI_BITFIELDS` images follow the 40 bytes of the header.
+ */
+static bool load_format(FILE* stream, const struct bmp_header* header, struct pixel_format* format) {
+
+    format->file_stride = bmp_stride(header->width, header->bpp);
+    format->rle = header->compression == BI_RLE8 || header->compression == BI_RLE4;
+    format->unpack = header->bpp < 8 && !format->rle;
+    format->convert = false;
+
+    if (header->compression != BI_BITFIELDS) {
+        return true;
+    }
+
+    uint32_t masks[4] = { 0 };
     fseek(stream, 54, SEEK_SET);
-    size_t dataStart = ftell(stream);
+    if (fread(masks, 4, 3, stream) != 3) {
+        return false;
+    }
+
+    // Alpha mask is only part of larger headers
+    if (header->dib_size >= 56 && fread(&masks[3], 4, 1, stream) != 1) {
+        return false;
+    }
+
+    format->channels[0] = make_channel(masks[2]);
+    format->channels[1] = make_channel(masks[1]);
+    format->channels[2] = make_channel(masks[0]);
+    format->channels[3] = make_channel(masks[3]);
+
+    // BGRA order is kept as it is
+    format->convert = masks[0] != 0x00FF0000 || masks[1] != 0x0000FF00 || masks[2] != 0x000000FF
+        || (masks[3] != 0 && masks[3] != 0xFF000000);
+
+    return true;
+}
+
+/**
+ * Scales value of channel to 8 bits. Missing alpha channel is opaque.
+ */
+static uint8_t channel_value(uint32_t value, const struct channel* channel, bool alpha) {
+
+    if (channel->bits == 0) {
+        return alpha ? 0xFF : 0x00;
+    }
+
+    value = (value & channel->mask) >> channel->shift;
+    if (channel->bits >= 8) {
+        return value >> (channel->bits - 8);
+    }
+    return value * 0xFF / ((1u << channel->bits) - 1);
+}
+
+/**
+ * Converts row of the file to the memory layout of the image.
+ */
+static void convert_row(uint8_t* dest, const uint8_t* src, size_t width, uint16_t bpp, const struct pixel_format* format) {
+
+    // Indices are stored from the highest bits
+    if (format->unpack) {
+        size_t perByte = 8 / bpp;
+        uint8_t mask = (1 << bpp) - 1;
+        for (size_t w = 0; w < width; w++) {
+            size_t shift = 8 - bpp - (w % perByte) * bpp;
+            dest[w] = (src[w / perByte] >> shift) & mask;
+        }
+        return;
+    }
+
+    if (format->convert) {
+        for (size_t w = 0; w < width; w++) {
+            uint32_t value = src[w * 4] | src[w * 4 + 1] << 8 | src[w * 4 + 2] << 16 | (uint32_t) src[w * 4 + 3] << 24;
+            for (size_t c = 0; c < 4; c++) {
+                dest[w * 4 + c] = channel_value(value, &format->channels[c], c == 3);
+            }
+        }
+        return;
+    }
 
-    if (dataEnd - dataStart != header->size - 54) {
+    memcpy(dest, src, width * bmp_pixel_size(bpp));
+}
+
+/**
+ * Converts row of the image to the layout of the file, padding is zero.
+ */
+static void pack_row(uint8_t* dest, const uint8_t* src, size_t width, uint16_t bpp, size_t file_stride) {
+
+    memset(dest, 0, file_stride);
+
+    if (bpp < 8) {
+        size_t perByte = 8 / bpp;
+        uint8_t mask = (1 << bpp) - 1;
+        for (size_t w = 0; w < width; w++) {
+            size_t shift = 8 - bpp - (w % perByte) * bpp;
+            dest[w / perByte] |= (src[w] & mask) << shift;
+        }
+        return;
+    }
+
+    memcpy(dest, src, width * bmp_pixel_size(bpp));
+}
+
+/**
+ * Allocates image structure followed by palette of `colors` colors and
+ * `size` bytes of pixels in one block from the allocator or from the system
+ * if allocator is `NULL`.
+ */
+static struct bmp_image* alloc_image(struct bmp_allocator* allocator, size_t colors, size_t size) {
+
+    // Pixels start at the next aligned address after the palette
+    size_t paletteOffset = sizeof(struct bmp_image);
+    size_t offset = (paletteOffset + colors * sizeof(struct bmp_color) + BMP_ALIGNMENT - 1) / BMP_ALIGNMENT * BMP_ALIGNMENT;
+
+    struct bmp_image *image = (struct bmp_image*) bmp_buffer_alloc(allocator, offset + size);
+    if (image == NULL) {
         return NULL;
     }
 
-    // Create pixel structure
-    size_t pxcount = header->width * header->height;
-    struct pixel *pxarr = (struct pixel*) calloc(pxcount, sizeof(struct pixel));
+    memset(image, 0, sizeof(struct bmp_image));
+    image->header = &image->info;
+    image->data = (struct pixel*) ((uint8_t*) image + offset);
+    image->allocator = allocator;
+    if (colors > 0) {
+        image->palette = (struct bmp_color*) ((uint8_t*) image + paletteOffset);
+        image->colors = colors;
+    }
+
+    return image;
+}
+
+/**
+ * Fills header of image of given size and format.
+ */
+static void make_header(struct bmp_header* header, uint32_t width, uint32_t height, uint16_t bpp, uint32_t colors) {
+    header->type = TYPE;
+    header->width = width;
+    header->height = height;
+    header->image_size = bmp_stride(width, bpp) * height;
+    header->offset = OFFSET + colors * sizeof(struct bmp_color);
+    header->size = header->image_size + header->offset;
+    header->dib_size = DIB_SIZE;
+    header->planes = PLANES;
+    header->bpp = bpp;
+    header->num_colors = colors;
+}
 
-    // Calculate padding
-    short paddingAmount = ((header->width * 24 + 31) / 32) * 4 - header->width * 3;
+/**
+ * Creates image of given format, padding of rows is zero.
+ */
+static struct bmp_image* new_image(uint32_t width, uint32_t height, uint16_t bpp, const struct bmp_color* palette, uint32_t colors) {
+
+    size_t pixelSize = bmp_pixel_size(bpp);
+    size_t stride = bmp_stride(width, pixelSize * 8);
+    struct bmp_image *newImage = alloc_image(bmp_get_allocator(), colors, stride * height);
+    if (newImage == NULL) {
+        return NULL;
+    }
+
+    make_header(&newImage->info, width, height, bpp, colors);
+    newImage->stride = stride;
+    newImage->pixel_size = pixelSize;
+    if (colors > 0) {
+        memcpy(newImage->palette, palette, colors * sizeof(struct bmp_color));
+    }
 
-    // Read pixel data
-    long index;
-    
-    for (size_t h = 0; h < header->height; h++) {
-        for (size_t w = 0; w < header->width; w++) {
-            index = (h * header->width) + w;
-            fread(&pxarr[index].blue, 1, 1, stream);
-            fread(&pxarr[index].green, 1, 1, stream);
-            fread(&pxarr[index].red, 1, 1, stream);
+    // Padding of rows is written as it is, so it has to be zero
+    size_t rowSize = (size_t) width * pixelSize;
+    if (stride != rowSize) {
+        for (size_t h = 0; h < height; h++) {
+            memset((uint8_t*) bmp_row(newImage, h) + rowSize, 0, stride - rowSize);
         }
-        fseek(stream, paddingAmount, SEEK_CUR);
     }
 
-    return pxarr;
+    return newImage;
 }
 
-struct bmp_image* read_bmp(FILE* stream) {
-    
+struct bmp_image* create_bmp_image(uint32_t width, uint32_t height) {
+    return new_image(width, height, BPP, NULL, 0);
+}
+
+struct bmp_image* create_bmp_image_like(const struct bmp_image* image, uint32_t width, uint32_t height) {
+
+    if (image == NULL) {
+        return NULL;
+    }
+
+    return new_image(width, height, image->info.bpp, image->palette, image->colors);
+}
+
+struct bmp_image* create_bmp_view(const struct bmp_image* image, uint32_t row, uint32_t column, uint32_t width, uint32_t height) {
+
+    if (image == NULL) {
+        return NULL;
+    }
+
+    struct bmp_image *view = alloc_image(bmp_get_allocator(), 0, 0);
+    if (view == NULL) {
+        return NULL;
+    }
+
+    make_header(&view->info, width, height, image->info.bpp, image->colors);
+    view->parent = image;
+    view->stride = image->stride;
+    view->pixel_size = image->pixel_size;
+    view->palette = image->palette;
+    view->colors = image->colors;
+    view->data = (struct pixel*) ((uint8_t*) bmp_row(image, row) + column * image->pixel_size);
+
+    return view;
+}
+
+/**
+ * Reads palette and pixels of image described by `header` from the stream.
+ */
+static struct bmp_image* load_image(FILE* stream, const struct bmp_header* header) {
+
+    struct pixel_format format = { 0 };
+    if (!load_format(stream, header, &format)) {
+        return NULL;
+    }
+
     // Create image
-    struct bmp_image *newImage = (struct bmp_image*) malloc(sizeof(struct bmp_image));
+    uint32_t colors = palette_colors(header);
+    size_t pixelSize = bmp_pixel_size(header->bpp);
+    size_t stride = bmp_stride(header->width, pixelSize * 8);
+    struct bmp_image *newImage = alloc_image(bmp_get_allocator(), colors, stride * header->height);
+    if (newImage == NULL) {
+        return NULL;
+    }
+    newImage->info = *header;
+    newImage->stride = stride;
+    newImage->pixel_size = pixelSize;
+
+    // Palette follows DIB header
+    fseek(stream, 14 + header->dib_size, SEEK_SET);
+    if (colors > 0 && fread(newImage->palette, sizeof(struct bmp_color), colors, stream) != colors) {
+        free_bmp_image(newImage);
+        return NULL;
+    }
+    BMP_STAT_READ(colors * sizeof(struct bmp_color));
+    BMP_STAT_PIXELS((uint64_t) header->width * header->height);
+
+    fseek(stream, header->offset, SEEK_SET);
+    size_t height = header->height;
+
+    // Compressed pixels take the rest of the file
+    if (format.rle) {
+        size_t size = header->size - header->offset;
+        if (header->image_size != 0 && header->image_size < size) {
+            size = header->image_size;
+        }
+        if (!rle_decode(stream, size, header->bpp, newImage)) {
+            free_bmp_image(newImage);
+            return NULL;
+        }
+        return newImage;
+    }
+
+    if (stride * height == 0) {
+        return newImage;
+    }
+
+    // Rows are kept as they are stored, so all of them are read at once
+    if (!format.unpack && !format.convert) {
+        if (fread(newImage->data, stride, height, stream) != height) {
+            free_bmp_image(newImage);
+            return NULL;
+        }
+        BMP_STAT_READ(stride * height);
+        return newImage;
+    }
+
+    // Other rows are read in large chunks and converted
+    size_t chunkRows = IO_CHUNK_SIZE / format.file_stride;
+    if (chunkRows < 1) {
+        chunkRows = 1;
+    }
+    if (chunkRows > height) {
+        chunkRows = height;
+    }
+
+    uint8_t *chunk = (uint8_t*) bmp_buffer_alloc(newImage->allocator, chunkRows * format.file_stride);
+    if (chunk == NULL) {
+        free_bmp_image(newImage);
+        return NULL;
+    }
+
+    size_t rowSize = header->width * pixelSize;
+    size_t h = 0;
+    while (h < height) {
+        size_t rows = height - h;
+        if (rows > chunkRows) {
+            rows = chunkRows;
+        }
+
+        if (fread(chunk, format.file_stride, rows, stream) != rows) {
+            bmp_buffer_free(newImage->allocator, chunk);
+            free_bmp_image(newImage);
+            return NULL;
+        }
+        BMP_STAT_READ(format.file_stride * rows);
+
+        for (size_t r = 0; r < rows; r++) {
+            uint8_t *row = (uint8_t*) bmp_row(newImage, h + r);
+            convert_row(row, chunk + r * format.file_stride, header->width, header->bpp, &format);
+            memset(row + rowSize, 0, stride - rowSize);
+        }
+        h += rows;
+    }
+    bmp_buffer_free(newImage->allocator, chunk);
+
+    return newImage;
+}
+
+struct bmp_image* read_bmp(FILE* stream) {
+
+    BMP_STAT_SCOPE(BMP_STAT_READ_BMP);
 
     // Load header
-    newImage->header = read_bmp_header(stream);
-    if (newImage->header == NULL) {
+    struct bmp_header header = { 0 };
+    if (stream == NULL || !load_header(stream, &header)) {
         fprintf(stderr, "Error: This is not a BMP file.\n");
-        free_bmp_image(newImage);
         return NULL;
     }
 
-    // Load data
-    newImage->data = read_data(stream, newImage->header);
-    if (newImage->data == NULL) {
+    // Check data size
+    if (!bmp_check_size(stream, &header)) {
         fprintf(stderr, "Error: Corrupted BMP file.\n");
-        free_bmp_image(newImage);
         return NULL;
     }
-    
+
+    struct bmp_image *newImage = load_image(stream, &header);
+    if (newImage == NULL) {
+        fprintf(stderr, "Error: Corrupted BMP file.\n");
+        return NULL;
+    }
+
+    return newImage;
+}
+
+struct bmp_image* read_bmp_memory(const void* data, size_t size) {
+
+    if (data == NULL || size == 0) {
+        fprintf(stderr, "Error: This is not a BMP file.\n");
+        return NULL;
+    }
+
+    // Buffer is only read, stream doesn't copy it
+    FILE *stream = fmemopen((void*) data, size, "rb");
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    struct bmp_image *newImage = read_bmp(stream);
+    fclose(stream);
+
+    return newImage;
+}
+
+struct bmp_image* read_bmp_mmap(const char* path) {
+
+    BMP_STAT_SCOPE(BMP_STAT_READ_BMP_MMAP);
+
+    // Check path
+    if (path == NULL) {
+        return NULL;
+    }
+
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    // Load header
+    struct bmp_header header = { 0 };
+    if (!load_header(stream, &header)) {
+        fprintf(stderr, "Error: This is not a BMP file.\n");
+        fclose(stream);
+        return NULL;
+    }
+
+    // Check data size, pixels have to be inside of the file
+    struct pixel_format format = { 0 };
+    struct stat st;
+    if (!bmp_check_size(stream, &header) || !load_format(stream, &header, &format) || fstat(fileno(stream), &st) != 0) {
+        fprintf(stderr, "Error: Corrupted BMP file.\n");
+        fclose(stream);
+        return NULL;
+    }
+
+    // Pixels which have to be converted and images without pixels are read
+    if (format.unpack || format.convert || format.rle || format.file_stride * header.height == 0) {
+        struct bmp_image *newImage = load_image(stream, &header);
+        fclose(stream);
+        if (newImage == NULL) {
+            fprintf(stderr, "Error: Corrupted BMP file.\n");
+        }
+        return newImage;
+    }
+
+    // Map whole file, rows are used with their padding where they are stored
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(stream), 0);
+    fclose(stream);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map BMP file.\n");
+        return NULL;
+    }
+
+    struct bmp_image *newImage = alloc_image(bmp_get_allocator(), 0, 0);
+    if (newImage == NULL) {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    newImage->info = header;
+    newImage->stride = format.file_stride;
+    newImage->pixel_size = bmp_pixel_size(header.bpp);
+    newImage->mapping = mapping;
+    newImage->mapping_size = st.st_size;
+    newImage->data = (struct pixel*) ((uint8_t*) mapping + header.offset);
+
+    // Mapped pixels are read later by whoever uses them
+    BMP_STAT_READ(st.st_size - sizeof(struct bmp_header));
+    BMP_STAT_PIXELS((uint64_t) header.width * header.height);
+
+    // Palette is stored as `struct bmp_color` in the file too
+    newImage->colors = palette_colors(&header);
+    if (newImage->colors > 0) {
+        newImage->palette = (struct bmp_color*) ((uint8_t*) mapping + 14 + header.dib_size);
+    }
+
     return newImage;
 }
 
+/**
+ * Writes header of the image stored with given format followed by palette.
+ * Compressed images give size of their pixels. The header is also stored
+ * to `header`.
+ */
+static bool write_header(FILE* stream, const struct bmp_image* image, uint16_t bpp, const struct bmp_color* palette, uint32_t colors, uint32_t compression, size_t size, struct bmp_header* header) {
+
+    *header = image->info;
+    make_header(header, image->info.width, image->info.height, bpp, colors);
+    header->compression = compression;
+    if (compression != BI_RGB) {
+        header->image_size = size;
+        header->size = header->offset + size;
+    }
+    if (header->important_colors > colors) {
+        header->important_colors = 0;
+    }
+
+    if (fwrite(header, sizeof(struct bmp_header), 1, stream) != 1) {
+        return false;
+    }
+    BMP_STAT_WRITTEN(sizeof(struct bmp_header) + colors * sizeof(struct bmp_color));
+    BMP_STAT_PIXELS((uint64_t) header->width * header->height);
+    return colors == 0 || fwrite(palette, sizeof(struct bmp_color), colors, stream) == colors;
+}
+
 bool write_bmp(FILE* stream, const struct bmp_image* image) {
-    
+
+    BMP_STAT_SCOPE(BMP_STAT_WRITE_BMP);
+
     // Check stream
     if (stream == NULL || image == NULL){
         return false;
     }
-    
-    // Write header
-    fwrite(&image->header->type, 2, 1, stream);
-    fwrite(&image->header->size, 4, 1, stream);
-    fwrite(&image->header->reserved1, 2, 1, stream);
-    fwrite(&image->header->reserved2, 2, 1, stream);
-    fwrite(&image->header->offset, 4, 1, stream);
-    fwrite(&image->header->dib_size, 4, 1, stream);
-    fwrite(&image->header->width, 4, 1, stream);
-    fwrite(&image->header->height, 4, 1, stream);
-    fwrite(&image->header->planes, 2, 1, stream);
-    fwrite(&image->header->bpp, 2, 1, stream);
-    fwrite(&image->header->compression, 4, 1, stream);
-    fwrite(&image->header->image_size, 4, 1, stream);
-    fwrite(&image->header->x_ppm, 4, 1, stream);
-    fwrite(&image->header->y_ppm, 4, 1, stream);
-    fwrite(&image->header->num_colors, 4, 1, stream);
-    fwrite(&image->header->important_colors, 4, 1, stream);
-
-
-    // Calculate padding
-    short paddingAmount = ((image->header->width * 24 + 31) / 32) * 4 - image->header->width * 3;
-    
-    // Write data
-    long index;
-    for (size_t h = 0; h < image->header->height; h++) {
-        for (size_t w = 0; w < image->header->width; w++) {
-            index = (h * image->header->width) + w;
-            fwrite(&image->data[index].blue, 1, 1, stream);
-            fwrite(&image->data[index].green, 1, 1, stream);
-            fwrite(&image->data[index].red, 1, 1, stream);
-        }
-        fwrite(PADDING_CHAR, 1, paddingAmount, stream);
-    }
-    
+
+    // Header describes pixels as they are written
+    struct bmp_header header;
+    if (!write_header(stream, image, image->info.bpp, image->palette, image->colors, BI_RGB, 0, &header)) {
+        return false;
+    }
+
+    // Calculate row sizes
+    size_t rowSize = (size_t) header.width * image->pixel_size;
+    size_t strideSize = bmp_stride(header.width, header.bpp);
+    size_t height = header.height;
+    if (rowSize == 0 || height == 0) {
+        return true;
+    }
+
+    // Rows are stored as in the file, pixels can be written as they are.
+    // Padding of view rows holds pixels of the parent, unless there is none.
+    bool padded = image->parent == NULL || rowSize == strideSize;
+    if (image->stride == strideSize && image->pixel_size * 8 == header.bpp && padded) {
+        BMP_STAT_WRITTEN(strideSize * height);
+        return fwrite(image->data, strideSize, height, stream) == height;
+    }
+
+    // Build padded rows in a chunk buffer and flush it in one write
+    size_t chunkRows = IO_CHUNK_SIZE / strideSize;
+    if (chunkRows < 1) {
+        chunkRows = 1;
+    }
+    if (chunkRows > height) {
+        chunkRows = height;
+    }
+
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    uint8_t *chunk = (uint8_t*) bmp_buffer_alloc(allocator, chunkRows * strideSize);
+    if (chunk == NULL) {
+        return false;
+    }
+
+    size_t h = 0;
+    while (h < height) {
+        size_t rows = height - h;
+        if (rows > chunkRows) {
+            rows = chunkRows;
+        }
+
+        for (size_t r = 0; r < rows; r++) {
+            pack_row(chunk + r * strideSize, (const uint8_t*) bmp_row(image, h + r), header.width, header.bpp, strideSize);
+        }
+
+        if (fwrite(chunk, strideSize, rows, stream) != rows) {
+            bmp_buffer_free(allocator, chunk);
+            return false;
+        }
+        BMP_STAT_WRITTEN(strideSize * rows);
+        h += rows;
+    }
+    bmp_buffer_free(allocator, chunk);
+
+    return true;
+}
+
+/**
+ * Palette of 24-bit image with hash table of its colors.
+ */
+struct color_table {
+    struct bmp_color colors[256];
+    uint32_t count;
+    uint32_t keys[COLOR_SLOTS];     // color + 1, 0 is free slot
+    uint8_t indices[COLOR_SLOTS];
+};
+
+/**
+ * Finds index of color in the table, new colors are added if `add` is set.
+ * Returns -1 if the color is not there or the palette is full.
+ */
+static int find_color(struct color_table* table, const struct pixel* pixel, bool add) {
+
+    uint32_t key = ((uint32_t) pixel->red << 16 | pixel->green << 8 | pixel->blue) + 1;
+    size_t slot = (key * 2654435761u) >> 23;
+
+    while (table->keys[slot] != 0) {
+        if (table->keys[slot] == key) {
+            return table->indices[slot];
+        }
+        slot = (slot + 1) % COLOR_SLOTS;
+    }
+
+    if (!add || table->count == 256) {
+        return -1;
+    }
+
+    struct bmp_color color = { pixel->blue, pixel->green, pixel->red, 0 };
+    table->colors[table->count] = color;
+    table->keys[slot] = key;
+    table->indices[slot] = table->count;
+    return table->count++;
+}
+
+/**
+ * Collects colors of 24-bit image. Returns `false` if there are more than
+ * 256 of them.
+ */
+static bool build_palette(const struct bmp_image* image, struct color_table* table) {
+
+    memset(table, 0, sizeof(struct color_table));
+
+    for (size_t h = 0; h < image->info.height; h++) {
+        const struct pixel *row = bmp_row(image, h);
+        for (size_t w = 0; w < image->info.width; w++) {
+            // Neighbours often share color
+            if (w > 0 && memcmp(&row[w], &row[w - 1], sizeof(struct pixel)) == 0) {
+                continue;
+            }
+            if (find_color(table, &row[w], true) < 0) {
+                return false;
+            }
+        }
+    }
+
     return true;
 }
 
+/**
+ * Returns row of palette indices, 24-bit rows are looked up in the table.
+ */
+static const uint8_t* index_row(const struct bmp_image* image, size_t h, struct color_table* table, uint8_t* buffer) {
+
+    if (image->pixel_size == 1) {
+        return (const uint8_t*) bmp_row(image, h);
+    }
+
+    const struct pixel *row = bmp_row(image, h);
+    for (size_t w = 0; w < image->info.width; w++) {
+        buffer[w] = w > 0 && memcmp(&row[w], &row[w - 1], sizeof(struct pixel)) == 0 ? buffer[w - 1] : find_color(table, &row[w], false);
+    }
+    return buffer;
+}
+
+bool write_bmp_rle(FILE* stream, const struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_WRITE_BMP_RLE);
+
+    // Check stream
+    if (stream == NULL || image == NULL) {
+        return false;
+    }
+
+    size_t width = image->info.width;
+    size_t height = image->info.height;
+    if (width == 0 || height == 0) {
+        return write_bmp(stream, image);
+    }
+
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    struct color_table *table = NULL;
+    const struct bmp_color *palette = image->palette;
+    uint32_t colors = image->colors;
+    uint16_t bpp = image->info.bpp;
+
+    // Palette images are compressed as they are, 24-bit images only without loss of colors
+    if (image->pixel_size == 3) {
+        table = (struct color_table*) bmp_buffer_alloc(allocator, sizeof(struct color_table));
+        if (table == NULL || !build_palette(image, table)) {
+            bmp_buffer_free(allocator, table);
+            return write_bmp(stream, image);
+        }
+        palette = table->colors;
+        colors = table->count;
+        bpp = 8;
+    }
+    else if (image->pixel_size != 1 || (bpp != 8 && bpp != 4)) {
+        return write_bmp(stream, image);
+    }
+
+    uint8_t *buffer = (uint8_t*) bmp_buffer_alloc(allocator, width + 1);
+    if (buffer == NULL) {
+        bmp_buffer_free(allocator, table);
+        return false;
+    }
+
+    // Size of compressed pixels, both depths are tried for at most 16 colors
+    bool tryRle4 = table != NULL && colors <= 16;
+    size_t size = 0;
+    size_t size4 = 0;
+    for (size_t h = 0; h < height; h++) {
+        const uint8_t *row = index_row(image, h, table, buffer);
+        size += rle_encode_row(NULL, row, width, bpp, h + 1 == height);
+        if (tryRle4) {
+            size4 += rle_encode_row(NULL, row, width, 4, h + 1 == height);
+        }
+    }
+    if (tryRle4 && size4 < size) {
+        bpp = 4;
+        size = size4;
+    }
+
+    // Compression doesn't pay off
+    size_t plainSize = bmp_stride(width, image->info.bpp) * height + image->colors * sizeof(struct bmp_color);
+    if (size + colors * sizeof(struct bmp_color) >= plainSize) {
+        bmp_buffer_free(allocator, buffer);
+        bmp_buffer_free(allocator, table);
+        return write_bmp(stream, image);
+    }
+
+    struct bmp_header header;
+    uint32_t compression = bpp == 8 ? BI_RLE8 : BI_RLE4;
+    bool result = write_header(stream, image, bpp, palette, colors, compression, size, &header);
+
+    // Encoded rows are collected in a chunk buffer and flushed in one write
+    size_t capacity = rle_row_limit(width) > IO_CHUNK_SIZE ? rle_row_limit(width) : IO_CHUNK_SIZE;
+    uint8_t *chunk = result ? (uint8_t*) bmp_buffer_alloc(allocator, capacity) : NULL;
+    result = chunk != NULL;
+
+    size_t used = 0;
+    for (size_t h = 0; h < height && result; h++) {
+        if (capacity - used < rle_row_limit(width)) {
+            result = fwrite(chunk, 1, used, stream) == used;
+            BMP_STAT_WRITTEN(used);
+            used = 0;
+        }
+        used += rle_encode_row(chunk + used, index_row(image, h, table, buffer), width, bpp, h + 1 == height);
+    }
+    if (result && used > 0) {
+        result = fwrite(chunk, 1, used, stream) == used;
+        BMP_STAT_WRITTEN(used);
+    }
+
+    bmp_buffer_free(allocator, chunk);
+    bmp_buffer_free(allocator, buffer);
+    bmp_buffer_free(allocator, table);
+
+    return result;
+}
+
 void free_bmp_image(struct bmp_image* image) {
     if (image != NULL) {
-        if (image->header != NULL) {
-            free(image->header);
-        }
 
-        if (image->data != NULL) {
-            free(image->data);
+        // Mapped pixels belong to the mapping
+        if (image->mapping != NULL) {
+            munmap(image->mapping, image->mapping_size);
         }
-        free(image);
+
+        // Structure and pixels are one block
+        bmp_buffer_free(image->allocator, image);
     }
 }
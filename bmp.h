@@ -9,6 +9,9 @@
 
 #define PADDING_CHAR "\0"
 
+// Size of the buffer used for bulk reads and writes of pixel rows
+#define IO_CHUNK_SIZE (1 << 20)
+
 // Constants
 #define OFFSET 0x36
 #define DIB_SIZE 0x28
@@ -19,6 +22,12 @@
 #define G 0x67
 #define B 0x62
 
+// Compression types
+#define BI_RGB 0x00
+#define BI_RLE8 0x01
+#define BI_RLE4 0x02
+#define BI_BITFIELDS 0x03
+
 /**
  * Structure contains information about the type, size, layout, dimensions
  * and color format of a BMP file. Size of structure is 54 bytes.
@@ -33,7 +42,7 @@ struct bmp_header{
     uint32_t width;             // width in pixels
     uint32_t height;            // height in pixels
     uint16_t planes;            // 1
-    uint16_t bpp;               // bits per pixel (1/4/8/24)
+    uint16_t bpp;               // bits per pixel (1/4/8/24/32)
     uint32_t compression;       // compression type (0/1/2) 0
     uint32_t image_size;        // size of picture in bytes, 0
     uint32_t x_ppm;             // X Pixels per meter (0)
@@ -55,23 +64,138 @@ struct pixel {
 } __attribute__((__packed__));
 
 
+/**
+ * Color of palette of images with up to 8 bits per pixel, stored the same
+ * way in the file.
+ */
+struct bmp_color {
+    uint8_t blue;
+    uint8_t green;
+    uint8_t red;
+    uint8_t reserved;
+} __attribute__((__packed__));
+
+
 /**
  * Structure describes the BMP file format, which consists from two parts:
  * 1. the header (metadata)
  * 2. the data (pixels)
+ * The structure, its header and pixels are allocated as one aligned block.
+ * Rows of pixels are `stride` bytes apart and stored as in the file, from
+ * the bottom, with padding to 4 bytes. Views (`parent` is not `NULL`) have
+ * no pixels of their own and address a rectangle of the parent image.
+ *
+ * `info.bpp` is the format of the file. In memory, pixels of 24-bit images
+ * are `struct pixel`, 32-bit images keep BGRA order and 1/4/8-bit images
+ * store one palette index per byte.
  */
 struct bmp_image {
-    struct bmp_header* header;
-    struct pixel* data;         // nr. of pixels is `width` * `height`
+    struct bmp_header* header;  // points to `info`, kept for compatibility
+    struct pixel* data;         // first row, use `bmp_row()` to get the others
+    size_t stride;              // distance of rows in bytes
+    size_t pixel_size;          // bytes per pixel in memory (1, 3 or 4)
+    struct bmp_color* palette;  // colors of palette images or `NULL`
+    uint32_t colors;            // number of colors of the palette
+    struct bmp_header info;     // the header
+    const struct bmp_image* parent;   // image the view borrows pixels from or `NULL`
+    void* mapping;              // file mapping `data` points into or `NULL`
+    size_t mapping_size;        // size of the mapping in bytes
+    struct bmp_allocator* allocator;  // allocator of the image or `NULL` for `malloc()`
 };
 
 
+struct bmp_allocator;
+
+
+/**
+ * Returns size of padded row in bytes
+ *
+ * @param width width of the image in pixels
+ * @param bpp bits per pixel
+ * @return size of the row with padding to 4 bytes
+ */
+static inline size_t bmp_stride(size_t width, size_t bpp) {
+    return ((width * bpp + 31) / 32) * 4;
+}
+
+
+/**
+ * Returns size of pixel in memory
+ *
+ * @param bpp bits per pixel of the file
+ * @return number of bytes per pixel, palette indices take one byte
+ */
+static inline size_t bmp_pixel_size(size_t bpp) {
+    return bpp <= 8 ? 1 : bpp / 8;
+}
+
+
+/**
+ * Returns row of the image
+ *
+ * @param image the image
+ * @param row index of the row as it is stored, 0 is the bottom row
+ * @return the first pixel of the row, other than 24-bit rows have to be cast
+ */
+static inline struct pixel* bmp_row(const struct bmp_image* image, size_t row) {
+    return (struct pixel*) ((uint8_t*) image->data + row * image->stride);
+}
+
+
+/**
+ * Creates a new 24-bit BMP image
+ *
+ * Allocates the image with complete header for given dimensions from the
+ * current allocator of the thread (see `bmp_set_allocator()`). Pixels are
+ * not initialized, padding of rows is zero.
+ *
+ * @param width width of the image in pixels
+ * @param height height of the image in pixels
+ * @return reference to the created image or `NULL` if there is not enough memory
+ */
+struct bmp_image* create_bmp_image(uint32_t width, uint32_t height);
+
+
+/**
+ * Creates a new BMP image of the same format as other image
+ *
+ * Same as `create_bmp_image()`, but the image has bits per pixel and
+ * palette of `image`.
+ *
+ * @param image the image which format is used
+ * @param width width of the image in pixels
+ * @param height height of the image in pixels
+ * @return reference to the created image or `NULL` if there is no image (NULL given) or not enough memory
+ */
+struct bmp_image* create_bmp_image_like(const struct bmp_image* image, uint32_t width, uint32_t height);
+
+
+/**
+ * Creates a view of rectangle of the image
+ *
+ * The view shares pixels with the image, nothing is copied. It can be used
+ * everywhere a read-only image is expected and must be freed before the
+ * image. Coordinates are given as the pixels are stored, `row` 0 is the
+ * bottom row. Area is not checked.
+ *
+ * @param image the parent image
+ * @param row the bottom row of the rectangle
+ * @param column the left column of the rectangle
+ * @param width width of the rectangle in pixels
+ * @param height height of the rectangle in pixels
+ * @return reference to the view or `NULL` if there is not enough memory
+ */
+struct bmp_image* create_bmp_view(const struct bmp_image* image, uint32_t row, uint32_t column, uint32_t width, uint32_t height);
+
+
 /**
  * Loads a BMP file from an input stream
  *
- * Creates BMP structure from data comming from an opened stream. If stream
- * is `NULL` or is corrupted (not a BMP file), function returns `NULL`
- * and prints error message to standard error output.
+ * Creates BMP structure from data comming from an opened stream. Images
+ * with 1, 4, 8 (palette), 24 and 32 (`BI_RGB` or `BI_BITFIELDS`) bits per
+ * pixel are supported, 4-bit and 8-bit images also with `BI_RLE4` and
+ * `BI_RLE8` compression. If stream is `NULL` or is corrupted (not a BMP file),
+ * function returns `NULL` and prints error message to standard error output.
  *
  * @param stream opened stream, where the image data are located
  * @return reference to the `bmp_image` structure of the created image or `NULL` if `stream` is `NULL`
@@ -79,11 +203,40 @@ struct bmp_image {
 struct bmp_image* read_bmp(FILE* stream);
 
 
+/**
+ * Loads a BMP file from memory
+ *
+ * Same as `read_bmp()` for whole file already loaded into `data`, for
+ * example by asynchronous I/O. The buffer is not used by the image and can
+ * be freed right after the call.
+ *
+ * @param data contents of the file
+ * @param size size of the file in bytes
+ * @return reference to the `bmp_image` structure of the loaded image or `NULL` if data are corrupted
+ */
+struct bmp_image* read_bmp_memory(const void* data, size_t size);
+
+
+/**
+ * Loads a BMP file by mapping it into memory
+ *
+ * Maps the file at `path` read-only and creates BMP structure whose pixels
+ * point directly into the mapping, so no pixel buffer is allocated or copied.
+ * The image must not be modified and is released with `free_bmp_image()`,
+ * which unmaps the file.
+ *
+ * @param path path to the BMP file
+ * @return reference to the `bmp_image` structure of the loaded image or `NULL` if file can't be opened or is corrupted
+ */
+struct bmp_image* read_bmp_mmap(const char* path);
+
+
 /**
  * Writes a BMP file to an output stream
  *
- * Function writes BMP image to opened stream. If stream is not open
- * (is `NULL`) or image is `NULL`, function returns `false`.
+ * Function writes BMP image to opened stream in its format with 40 bytes
+ * long DIB header. 32-bit images are written as `BI_RGB`. If stream is not
+ * open (is `NULL`) or image is `NULL`, function returns `false`.
  *
  * @param stream opened stream, where the image will be written
  * @param image the image to write
@@ -92,12 +245,28 @@ struct bmp_image* read_bmp(FILE* stream);
 bool write_bmp(FILE* stream, const struct bmp_image* image);
 
 
+/**
+ * Writes a BMP file to an output stream with RLE compression
+ *
+ * 8-bit and 4-bit images are written with `BI_RLE8` or `BI_RLE4` compression.
+ * 24-bit images with at most 256 colors are written as 8-bit (or 4-bit with
+ * at most 16 colors) compressed images with palette, so no color is lost.
+ * Compression is used only if the file gets smaller, otherwise and for other
+ * images this is the same as `write_bmp()`.
+ *
+ * @param stream opened stream, where the image will be written
+ * @param image the image to write
+ * @return `true`, if BMP image was saved successfully, `false` otherwise.
+ */
+bool write_bmp_rle(FILE* stream, const struct bmp_image* image);
+
+
 /**
  * Reads BMP header from input stream
  *
  * Reads and returns BMP header from opened input stream. The header is located
- * at it's beginning. If the stream is not opened or it is corrupted, function
- * returns `NULL`.
+ * at it's beginning and it's read at once. If the stream is not opened, it is corrupted or the format
+ * is not supported, function returns `NULL`.
  *
  * @param stream opened stream, where the image data are located
  * @return `bmp_header` structure or `NULL`, if stream is not open or broken
@@ -105,11 +274,40 @@ bool write_bmp(FILE* stream, const struct bmp_image* image);
 struct bmp_header* read_bmp_header(FILE* stream);
 
 
+/**
+ * Reads and checks BMP header of file without reading pixels
+ *
+ * The header is read at once and checked against size of the file the same
+ * way as by `read_bmp()`, so files which pass are not truncated and have a
+ * supported format. Pixels are not checked, compressed pixels can still be
+ * corrupted.
+ *
+ * @param path path of the file
+ * @param header where the header is stored
+ * @return `true` if the file has a valid header, `false` if there is no path or header (NULL given), file can't be read or it is not a valid BMP file
+ */
+bool bmp_probe(const char* path, struct bmp_header* header);
+
+
+/**
+ * Checks size of the file
+ *
+ * Checks that size of the stream matches the header and all rows of pixels
+ * are there, then moves to the start of pixels.
+ *
+ * @param stream opened stream of the file
+ * @param header the header read from the stream
+ * @return `true` if all pixels are in the stream, `false` otherwise
+ */
+bool bmp_check_size(FILE* stream, const struct bmp_header* header);
+
+
 /**
  * Read the pixels
  *
- * Reads the data (pixels) from stream representing the image. If the stream
- * is not open or header is not provided, returns `NULL`.
+ * Reads the data (pixels) from stream representing 24-bit image. Rows are
+ * returned without padding. If the stream is not open, header is not
+ * provided or the image has other format, returns `NULL`.
  *
  * @param stream opened stream, where the image data are located
  * @param header the BMP header structure
@@ -121,7 +319,9 @@ struct pixel* read_data(FILE* stream, const struct bmp_header* header);
 /**
  * Free the BMP image from the memory
  *
- * Function frees the allocated memory for the BMP image.
+ * Function frees the allocated memory for the BMP image. Images loaded
+ * with `read_bmp_mmap()` are also unmapped, images created with an allocator
+ * are returned to its pool. Freeing a view doesn't touch its parent.
  *
  * @param image the BMP image object
  */
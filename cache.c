@@ -0,0 +1,412 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "stats.h"
+
+// Buckets of new cache, the table doubles when there are more entries
+#define CACHE_BUCKETS 64
+
+// Primes of the hash
+#define PRIME_1 0x9E3779B185EBCA87ULL
+#define PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME_3 0x165667B19E3779F9ULL
+
+struct cache_entry {
+    struct bmp_cache_key key;
+    struct cache_entry* next;   // next entry of the bucket
+    struct cache_entry* newer;
+    struct cache_entry* older;
+    size_t size;
+    uint8_t data[];
+};
+
+static inline uint64_t rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t load64(const uint8_t* data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hash_round(uint64_t lane, uint64_t value) {
+    return rotl(lane + value * PRIME_2, 31) * PRIME_1;
+}
+
+/**
+ * Spreads every bit of the hash over all bits.
+ */
+static inline uint64_t avalanche(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    hash ^= hash >> 29;
+    hash *= PRIME_3;
+    return hash ^ (hash >> 32);
+}
+
+uint64_t bmp_hash_bytes(const void* data, size_t size, uint64_t seed) {
+
+    const uint8_t *bytes = (const uint8_t*) data;
+    uint64_t hash = seed + PRIME_3 + size;
+    size_t index = 0;
+
+    // Four independent lanes keep multipliers busy
+    if (size >= 32) {
+        uint64_t lanes[4] = { seed + PRIME_1 + PRIME_2, seed + PRIME_2, seed, seed - PRIME_1 };
+        for (; index + 32 <= size; index += 32) {
+            lanes[0] = hash_round(lanes[0], load64(bytes + index));
+            lanes[1] = hash_round(lanes[1], load64(bytes + index + 8));
+            lanes[2] = hash_round(lanes[2], load64(bytes + index + 16));
+            lanes[3] = hash_round(lanes[3], load64(bytes + index + 24));
+        }
+        hash += rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+    }
+
+    for (; index + 8 <= size; index += 8) {
+        hash = rotl(hash ^ hash_round(0, load64(bytes + index)), 27) * PRIME_1 + PRIME_3;
+    }
+
+    // Last bytes padded with zeros
+    if (index < size) {
+        uint64_t last = 0;
+        memcpy(&last, bytes + index, size - index);
+        hash = rotl(hash ^ hash_round(0, last), 27) * PRIME_1 + PRIME_3;
+    }
+
+    return avalanche(hash);
+}
+
+uint64_t bmp_hash(const struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_HASH);
+
+    if (image == NULL)
+        return 0;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    // Results get new headers, only these fields of the source make it into them
+    uint32_t fields[] = { image->info.width, image->info.height, image->info.bpp, image->colors };
+    uint64_t hash = bmp_hash_bytes(fields, sizeof(fields), 0);
+
+    size_t rowSize = (size_t) image->info.width * image->pixel_size;
+    for (size_t h = 0; h < image->info.height; h++) {
+        hash = bmp_hash_bytes(bmp_row(image, h), rowSize, hash);
+    }
+
+    if (image->colors > 0) {
+        hash = bmp_hash_bytes(image->palette, image->colors * sizeof(struct bmp_color), hash);
+    }
+
+    return hash;
+}
+
+struct bmp_cache* bmp_cache_create(size_t limit, const char* directory) {
+
+    struct bmp_cache *cache = (struct bmp_cache*) calloc(1, sizeof(struct bmp_cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->buckets = (struct cache_entry**) calloc(CACHE_BUCKETS, sizeof(struct cache_entry*));
+    cache->directory = directory != NULL ? strdup(directory) : NULL;
+    if (cache->buckets == NULL || (directory != NULL && cache->directory == NULL)) {
+        free(cache->buckets);
+        free(cache->directory);
+        free(cache);
+        return NULL;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->bucket_count = CACHE_BUCKETS;
+    cache->limit = limit;
+
+    return cache;
+}
+
+void bmp_cache_free(struct bmp_cache* cache) {
+    if (cache != NULL) {
+        struct cache_entry *entry = cache->newest;
+        while (entry != NULL) {
+            struct cache_entry *older = entry->older;
+            free(entry);
+            entry = older;
+        }
+
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->buckets);
+        free(cache->directory);
+        free(cache);
+    }
+}
+
+static inline size_t bucket_of(const struct bmp_cache* cache, const struct bmp_cache_key* key) {
+    return avalanche(key->image ^ rotl(key->ops, 32)) & (cache->bucket_count - 1);
+}
+
+static inline bool same_key(const struct bmp_cache_key* a, const struct bmp_cache_key* b) {
+    return a->image == b->image && a->ops == b->ops;
+}
+
+static struct cache_entry** find_entry(struct bmp_cache* cache, const struct bmp_cache_key* key) {
+    struct cache_entry **link = &cache->buckets[bucket_of(cache, key)];
+    while (*link != NULL && !same_key(&(*link)->key, key)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void unlink_entry(struct bmp_cache* cache, struct cache_entry* entry) {
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+}
+
+static void push_newest(struct bmp_cache* cache, struct cache_entry* entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest != NULL)
+        cache->newest->newer = entry;
+    else
+        cache->oldest = entry;
+    cache->newest = entry;
+}
+
+/**
+ * Doubles the table. If there is not enough memory, the table is kept and
+ * buckets just get longer.
+ */
+static void grow_table(struct bmp_cache* cache) {
+
+    size_t count = cache->bucket_count * 2;
+    struct cache_entry **buckets = (struct cache_entry**) calloc(count, sizeof(struct cache_entry*));
+    if (buckets == NULL) {
+        return;
+    }
+
+    struct cache_entry **old = cache->buckets;
+    size_t oldCount = cache->bucket_count;
+    cache->buckets = buckets;
+    cache->bucket_count = count;
+
+    for (size_t bucket = 0; bucket < oldCount; bucket++) {
+        struct cache_entry *entry = old[bucket];
+        while (entry != NULL) {
+            struct cache_entry *next = entry->next;
+            size_t index = bucket_of(cache, &entry->key);
+            entry->next = buckets[index];
+            buckets[index] = entry;
+            entry = next;
+        }
+    }
+
+    free(old);
+}
+
+/**
+ * Drops least recently used entries until results fit the limit.
+ */
+static void evict(struct bmp_cache* cache) {
+    while (cache->stats.bytes > cache->limit && cache->oldest != NULL) {
+        struct cache_entry *entry = cache->oldest;
+        *find_entry(cache, &entry->key) = entry->next;
+        unlink_entry(cache, entry);
+        cache->stats.bytes -= entry->size;
+        cache->stats.entries--;
+        cache->stats.evictions++;
+        free(entry);
+    }
+}
+
+/**
+ * Stores result in memory, the lock has to be held.
+ */
+static bool put_memory(struct bmp_cache* cache, const struct bmp_cache_key* key, const uint8_t* data, size_t size) {
+
+    if (size > cache->limit) {
+        return false;
+    }
+
+    // Same key has the same result, it only becomes the newest
+    struct cache_entry **link = find_entry(cache, key);
+    if (*link != NULL) {
+        unlink_entry(cache, *link);
+        push_newest(cache, *link);
+        return true;
+    }
+
+    struct cache_entry *entry = (struct cache_entry*) malloc(sizeof(struct cache_entry) + size);
+    if (entry == NULL) {
+        return false;
+    }
+    entry->key = *key;
+    entry->size = size;
+    memcpy(entry->data, data, size);
+
+    entry->next = *link;
+    *link = entry;
+    push_newest(cache, entry);
+    cache->stats.bytes += size;
+    cache->stats.entries++;
+
+    evict(cache);
+    if (cache->stats.entries > cache->bucket_count) {
+        grow_table(cache);
+    }
+
+    return true;
+}
+
+/**
+ * Path of file of the disk tier, `suffix` is appended to the name.
+ */
+static char* disk_path(const struct bmp_cache* cache, const struct bmp_cache_key* key, const char* suffix) {
+
+    size_t length = strlen(cache->directory) + strlen(suffix) + 40;
+    char *path = (char*) malloc(length);
+    if (path != NULL) {
+        snprintf(path, length, "%s/%016llx%016llx%s", cache->directory,
+            (unsigned long long) key->image, (unsigned long long) key->ops, suffix);
+    }
+    return path;
+}
+
+/**
+ * Reads whole file of the disk tier.
+ */
+static uint8_t* read_disk(const struct bmp_cache* cache, const struct bmp_cache_key* key, size_t* size) {
+
+    char *path = disk_path(cache, key, ".bmp");
+    FILE *stream = path != NULL ? fopen(path, "rb") : NULL;
+    free(path);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    uint8_t *data = NULL;
+    long length = -1;
+    if (fseek(stream, 0, SEEK_END) == 0 && (length = ftell(stream)) > 0 && fseek(stream, 0, SEEK_SET) == 0) {
+        data = (uint8_t*) malloc(length);
+    }
+    if (data != NULL && fread(data, 1, length, stream) != (size_t) length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(stream);
+
+    *size = data != NULL ? (size_t) length : 0;
+    return data;
+}
+
+/**
+ * Writes file of the disk tier under temporary name and renames it.
+ */
+static bool write_disk(const struct bmp_cache* cache, const struct bmp_cache_key* key, const uint8_t* data, size_t size) {
+
+    char *path = disk_path(cache, key, ".bmp");
+    char *temporary = disk_path(cache, key, ".XXXXXX");
+    int fd = temporary != NULL ? mkstemp(temporary) : -1;
+    if (path == NULL || fd < 0) {
+        free(path);
+        free(temporary);
+        return false;
+    }
+
+    // Files are shared by processes, `mkstemp()` makes them private
+    fchmod(fd, 0644);
+    FILE *stream = fdopen(fd, "wb");
+    bool ok = stream != NULL && fwrite(data, 1, size, stream) == size;
+    if (stream != NULL) {
+        ok = fclose(stream) == 0 && ok;
+    }
+    else {
+        close(fd);
+    }
+
+    ok = ok && rename(temporary, path) == 0;
+    if (!ok) {
+        unlink(temporary);
+    }
+
+    free(path);
+    free(temporary);
+    return ok;
+}
+
+uint8_t* bmp_cache_get(struct bmp_cache* cache, const struct bmp_cache_key* key, size_t* size) {
+
+    if (cache == NULL || key == NULL || size == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct cache_entry *entry = *find_entry(cache, key);
+    uint8_t *data = NULL;
+    if (entry != NULL) {
+        data = (uint8_t*) malloc(entry->size);
+        if (data != NULL) {
+            memcpy(data, entry->data, entry->size);
+            *size = entry->size;
+            unlink_entry(cache, entry);
+            push_newest(cache, entry);
+            cache->stats.hits++;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (entry != NULL) {
+        return data;
+    }
+
+    // File is read without the lock, other threads can use memory meanwhile
+    data = cache->directory != NULL ? read_disk(cache, key, size) : NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if (data != NULL) {
+        put_memory(cache, key, data, *size);
+        cache->stats.disk_hits++;
+    }
+    else {
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return data;
+}
+
+bool bmp_cache_put(struct bmp_cache* cache, const struct bmp_cache_key* key, const uint8_t* data, size_t size) {
+
+    if (cache == NULL || key == NULL || data == NULL || size == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    bool ok = put_memory(cache, key, data, size);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (cache->directory != NULL) {
+        ok = write_disk(cache, key, data, size) || ok;
+    }
+
+    return ok;
+}
+
+void bmp_cache_get_stats(struct bmp_cache* cache, struct bmp_cache_stats* stats) {
+    if (cache != NULL && stats != NULL) {
+        pthread_mutex_lock(&cache->lock);
+        *stats = cache->stats;
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
@@ -0,0 +1,139 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <pthread.h>
+#include "bmp.h"
+
+
+/**
+ * Key of cached result. It consists of hash of the source image and hash of
+ * everything else, which changes the result (operations, output format).
+ */
+struct bmp_cache_key {
+    uint64_t image;
+    uint64_t ops;
+};
+
+
+/**
+ * Counters of the cache.
+ */
+struct bmp_cache_stats {
+    uint64_t hits;              // results found in memory
+    uint64_t disk_hits;         // results found only on disk
+    uint64_t misses;
+    uint64_t evictions;         // results dropped from memory
+    size_t entries;             // results in memory
+    size_t bytes;               // size of results in memory
+};
+
+
+/**
+ * Stored result, newest results are at the front of the list.
+ */
+struct cache_entry;
+
+
+/**
+ * Structure describes cache of encoded results. The memory tier keeps
+ * results up to the size limit and drops the least recently used ones, the
+ * optional disk tier keeps one file of every result in a directory, it
+ * survives the process and can be shared by processes. Results are kept as
+ * bytes of BMP file, so a hit can be written as it is. The cache can be
+ * shared by threads.
+ */
+struct bmp_cache {
+    pthread_mutex_t lock;
+    struct cache_entry** buckets;   // hash table of entries
+    size_t bucket_count;            // power of two
+    struct cache_entry* newest;
+    struct cache_entry* oldest;
+    size_t limit;                   // size of results kept in memory
+    char* directory;                // directory of the disk tier or `NULL`
+    struct bmp_cache_stats stats;
+};
+
+
+/**
+ * Creates cache
+ *
+ * @param limit maximal size of results kept in memory in bytes, 0 keeps results only on disk
+ * @param directory existing directory of the disk tier or `NULL` to keep results only in memory
+ * @return the cache or `NULL` if there is not enough memory
+ */
+struct bmp_cache* bmp_cache_create(size_t limit, const char* directory);
+
+
+/**
+ * Frees the cache and all results in memory, files of the disk tier are kept
+ *
+ * @param cache the cache
+ */
+void bmp_cache_free(struct bmp_cache* cache);
+
+
+/**
+ * Looks up result
+ *
+ * Results found on disk are moved to memory.
+ *
+ * @param cache the cache
+ * @param key the key of result
+ * @param size where size of result in bytes is stored
+ * @return copy of result, which has to be freed with `free()`, or `NULL` if there is no such result or there is not enough memory
+ */
+uint8_t* bmp_cache_get(struct bmp_cache* cache, const struct bmp_cache_key* key, size_t* size);
+
+
+/**
+ * Stores result
+ *
+ * Results larger than the memory limit are stored only on disk. Files of
+ * the disk tier are written under temporary names and renamed, so other
+ * processes never read a partial result.
+ *
+ * @param cache the cache
+ * @param key the key of result
+ * @param data bytes of result
+ * @param size size of result in bytes
+ * @return `true` if result was stored in any tier, `false` otherwise
+ */
+bool bmp_cache_put(struct bmp_cache* cache, const struct bmp_cache_key* key, const uint8_t* data, size_t size);
+
+
+/**
+ * Returns counters of the cache
+ *
+ * @param cache the cache
+ * @param stats where counters are stored
+ */
+void bmp_cache_get_stats(struct bmp_cache* cache, struct bmp_cache_stats* stats);
+
+
+/**
+ * Computes 64-bit hash of bytes
+ *
+ * Non-cryptographic hash reading 32 bytes per step. Calls can be chained by
+ * passing the previous hash as `seed`.
+ *
+ * @param data the bytes
+ * @param size number of bytes
+ * @param seed the seed
+ * @return the hash
+ */
+uint64_t bmp_hash_bytes(const void* data, size_t size, uint64_t seed);
+
+
+/**
+ * Computes hash of image
+ *
+ * The hash covers size, bits per pixel, pixels and palette, so images with
+ * the same hash produce the same results. Padding of rows is not hashed, so
+ * views have the same hash as their copies.
+ *
+ * @param image the image
+ * @return the hash or 0 if there is no image (NULL given)
+ */
+uint64_t bmp_hash(const struct bmp_image* image);
+
+#endif
@@ -0,0 +1,421 @@
+#include <string.h>
+#include <math.h>
+#include "color.h"
+#include "transformations.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "alloc.h"
+#include "stats.h"
+#include "bands.h"
+
+// Weights of BT.601 luma with 8 fractional bits, in order of channels
+#define GRAY_BLUE 29
+#define GRAY_GREEN 150
+#define GRAY_RED 77
+
+/**
+ * Counts of one histogram, palette images count indices in the first channel.
+ */
+typedef uint64_t channel_counts[CHANNELS][256];
+
+/**
+ * Arguments of band kernels, which work on bands <start, end) of
+ * `BAND_ROWS` rows.
+ */
+struct color_band {
+    const struct bmp_image* image;
+    struct bmp_image* newImage;
+    channel_counts* counts;             // histogram of every band, a task uses one of its first band
+    const struct bmp_lut* lut;
+    bool shared;                        // all channels have the same table
+};
+
+/**
+ * Kernels below are written for pixels of `size` bytes and inlined with
+ * constant size, so every format gets its own specialized loop.
+ */
+#define SPECIALIZED static inline __attribute__((always_inline))
+
+static void band_rows(const struct bmp_image* image, size_t start, size_t end, size_t* first, size_t* last) {
+    band_range(image->info.height, BAND_ROWS, start, end, first, last);
+}
+
+static size_t bands(const struct bmp_image* image) {
+    return band_count(image->info.height, BAND_ROWS);
+}
+
+/**
+ * Counts pixels of bands into histogram of the first band, so tasks never
+ * share counters.
+ */
+SPECIALIZED void count_rows_of(const struct color_band* band, size_t start, size_t end, size_t size) {
+    uint64_t (*counts)[256] = band->counts[start];
+    size_t width = band->image->info.width;
+
+    size_t first, last;
+    band_rows(band->image, start, end, &first, &last);
+    for (size_t h = first; h < last; h++) {
+        const uint8_t *row = (const uint8_t*) bmp_row(band->image, h);
+        for (size_t w = 0; w < width; w++) {
+            const uint8_t *pixel = row + w * size;
+            counts[CHANNEL_BLUE][pixel[0]]++;
+            if (size > 1) {
+                counts[CHANNEL_GREEN][pixel[1]]++;
+                counts[CHANNEL_RED][pixel[2]]++;
+            }
+        }
+    }
+}
+
+static void count_rows(void* arg, size_t start, size_t end) {
+    const struct color_band *band = (const struct color_band*) arg;
+
+    switch (band->image->pixel_size) {
+        case 1:
+            count_rows_of(band, start, end, 1);
+            break;
+        case 4:
+            count_rows_of(band, start, end, 4);
+            break;
+        default:
+            count_rows_of(band, start, end, 3);
+    }
+}
+
+/**
+ * Looks up channels of pixels in tables, after turning them gray if it's
+ * set. Rows of 24-bit images with the same table for all channels are
+ * looked up as bytes by the vector kernel.
+ */
+SPECIALIZED void adjust_rows_of(const struct color_band* band, size_t start, size_t end, size_t size) {
+    const struct bmp_lut *lut = band->lut;
+    size_t width = band->image->info.width;
+
+    size_t first, last;
+    band_rows(band->image, start, end, &first, &last);
+    for (size_t h = first; h < last; h++) {
+        const uint8_t *source = (const uint8_t*) bmp_row(band->image, h);
+        uint8_t *dest = (uint8_t*) bmp_row(band->newImage, h);
+
+        if (band->shared && !lut->grayscale && size == 3) {
+            lookup_bytes(dest, source, width * size, lut->tables[0]);
+            continue;
+        }
+
+        for (size_t w = 0; w < width; w++) {
+            const uint8_t *pixel = source + w * size;
+            uint8_t blue = pixel[0];
+            uint8_t green = pixel[1];
+            uint8_t red = pixel[2];
+            if (lut->grayscale) {
+                blue = green = red = (GRAY_BLUE * blue + GRAY_GREEN * green + GRAY_RED * red + 128) >> 8;
+            }
+            dest[w * size] = lut->tables[CHANNEL_BLUE][blue];
+            dest[w * size + 1] = lut->tables[CHANNEL_GREEN][green];
+            dest[w * size + 2] = lut->tables[CHANNEL_RED][red];
+            if (size == 4) {
+                dest[w * size + 3] = pixel[3];
+            }
+        }
+    }
+}
+
+static void adjust_rows(void* arg, size_t start, size_t end) {
+    const struct color_band *band = (const struct color_band*) arg;
+
+    if (band->image->pixel_size == 4)
+        adjust_rows_of(band, start, end, 4);
+    else
+        adjust_rows_of(band, start, end, 3);
+}
+
+/**
+ * Copies indices of palette image, colors are adjusted in the palette.
+ */
+static void copy_rows(void* arg, size_t start, size_t end) {
+    const struct color_band *band = (const struct color_band*) arg;
+    size_t rowSize = band->image->info.width;
+
+    size_t first, last;
+    band_rows(band->image, start, end, &first, &last);
+    for (size_t h = first; h < last; h++) {
+        memcpy(bmp_row(band->newImage, h), bmp_row(band->image, h), rowSize);
+    }
+}
+
+static void adjust_palette(struct bmp_image* image, const struct bmp_lut* lut) {
+    for (size_t index = 0; index < image->colors; index++) {
+        struct bmp_color *color = &image->palette[index];
+        if (lut->grayscale) {
+            color->blue = color->green = color->red = (GRAY_BLUE * color->blue + GRAY_GREEN * color->green + GRAY_RED * color->red + 128) >> 8;
+        }
+        color->blue = lut->tables[CHANNEL_BLUE][color->blue];
+        color->green = lut->tables[CHANNEL_GREEN][color->green];
+        color->red = lut->tables[CHANNEL_RED][color->red];
+    }
+}
+
+static bool same_tables(const struct bmp_lut* lut) {
+    return memcmp(lut->tables[0], lut->tables[1], 256) == 0 && memcmp(lut->tables[0], lut->tables[2], 256) == 0;
+}
+
+/**
+ * Adds counts of palette indices to counts of their colors, indices out of
+ * the palette are black.
+ */
+static void count_palette(const struct bmp_image* image, const uint64_t* indices, struct bmp_histogram* histogram) {
+    for (size_t index = 0; index < 256; index++) {
+        struct bmp_color color = { 0, 0, 0, 0 };
+        if (index < image->colors) {
+            color = image->palette[index];
+        }
+        histogram->counts[CHANNEL_BLUE][color.blue] += indices[index];
+        histogram->counts[CHANNEL_GREEN][color.green] += indices[index];
+        histogram->counts[CHANNEL_RED][color.red] += indices[index];
+    }
+}
+
+bool bmp_histogram(const struct bmp_image* image, struct bmp_histogram* histogram) {
+
+    BMP_STAT_SCOPE(BMP_STAT_HISTOGRAM);
+
+    if (image == NULL || histogram == NULL)
+        return false;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    memset(histogram, 0, sizeof(struct bmp_histogram));
+    histogram->pixels = (uint64_t) image->info.width * image->info.height;
+
+    // Histogram of every band, the ones of tasks are added at the end
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    size_t count = bands(image);
+    channel_counts *counts = (channel_counts*) bmp_buffer_alloc(allocator, (count + 1) * sizeof(channel_counts));
+    if (counts == NULL)
+        return false;
+    memset(counts, 0, (count + 1) * sizeof(channel_counts));
+
+    struct color_band band = { .image = image, .counts = counts };
+    thread_pool_run(get_thread_pool(), count, count_rows, &band);
+
+    uint64_t indices[256] = { 0 };
+    for (size_t slot = 0; slot < count; slot++) {
+        for (size_t value = 0; value < 256; value++) {
+            if (image->pixel_size == 1) {
+                indices[value] += counts[slot][0][value];
+                continue;
+            }
+            for (size_t channel = 0; channel < CHANNELS; channel++) {
+                histogram->counts[channel][value] += counts[slot][channel][value];
+            }
+        }
+    }
+    bmp_buffer_free(allocator, counts);
+
+    if (image->pixel_size == 1)
+        count_palette(image, indices, histogram);
+
+    // Statistics of every channel
+    for (size_t channel = 0; channel < CHANNELS && histogram->pixels > 0; channel++) {
+        const uint64_t *values = histogram->counts[channel];
+        uint64_t sum = 0;
+        size_t min = 255, max = 0;
+        for (size_t value = 0; value < 256; value++) {
+            if (values[value] == 0)
+                continue;
+            min = value < min ? value : min;
+            max = value;
+            sum += values[value] * value;
+        }
+        histogram->min[channel] = min;
+        histogram->max[channel] = max;
+        histogram->mean[channel] = (double) sum / histogram->pixels;
+    }
+
+    return true;
+}
+
+/**
+ * Maps current outputs of every table.
+ */
+static void map_tables(struct bmp_lut* lut, const uint8_t map[CHANNELS][256]) {
+    for (size_t channel = 0; channel < CHANNELS; channel++) {
+        for (size_t value = 0; value < 256; value++) {
+            lut->tables[channel][value] = map[channel][lut->tables[channel][value]];
+        }
+    }
+}
+
+static uint8_t round_byte(double value) {
+    return value < 0 ? 0 : value > 255 ? 255 : lround(value);
+}
+
+void lut_identity(struct bmp_lut* lut) {
+
+    if (lut == NULL)
+        return;
+
+    for (size_t channel = 0; channel < CHANNELS; channel++) {
+        for (size_t value = 0; value < 256; value++) {
+            lut->tables[channel][value] = value;
+        }
+    }
+    lut->grayscale = false;
+}
+
+bool lut_brightness_contrast(struct bmp_lut* lut, int brightness, float contrast) {
+
+    if (lut == NULL || brightness < -255 || brightness > 255 || !(contrast >= 0) || !isfinite(contrast))
+        return false;
+
+    uint8_t map[CHANNELS][256];
+    for (size_t value = 0; value < 256; value++) {
+        map[0][value] = map[1][value] = map[2][value] = round_byte((value - 127.5) * contrast + 127.5 + brightness);
+    }
+    map_tables(lut, map);
+
+    return true;
+}
+
+bool lut_gamma(struct bmp_lut* lut, float gamma) {
+
+    if (lut == NULL || !(gamma > 0) || !isfinite(gamma))
+        return false;
+
+    uint8_t map[CHANNELS][256];
+    for (size_t value = 0; value < 256; value++) {
+        map[0][value] = map[1][value] = map[2][value] = round_byte(255 * pow(value / 255.0, 1 / gamma));
+    }
+    map_tables(lut, map);
+
+    return true;
+}
+
+bool lut_levels(struct bmp_lut* lut, const uint8_t black[CHANNELS], const uint8_t white[CHANNELS], float gamma) {
+
+    if (lut == NULL || black == NULL || white == NULL || !(gamma > 0) || !isfinite(gamma))
+        return false;
+
+    for (size_t channel = 0; channel < CHANNELS; channel++) {
+        if (white[channel] <= black[channel])
+            return false;
+    }
+
+    uint8_t map[CHANNELS][256];
+    for (size_t channel = 0; channel < CHANNELS; channel++) {
+        for (size_t value = 0; value < 256; value++) {
+            double level = ((double) value - black[channel]) / (white[channel] - black[channel]);
+            level = level < 0 ? 0 : level > 1 ? 1 : level;
+            map[channel][value] = round_byte(255 * pow(level, 1 / gamma));
+        }
+    }
+    map_tables(lut, map);
+
+    return true;
+}
+
+bool lut_auto_levels(struct bmp_lut* lut, const struct bmp_histogram* histogram, float clip) {
+
+    if (lut == NULL || histogram == NULL || !(clip >= 0 && clip < 0.5f))
+        return false;
+
+    uint8_t black[CHANNELS];
+    uint8_t white[CHANNELS];
+    uint64_t clipped = clip * histogram->pixels;
+
+    // The darkest and the brightest value with more than clipped pixels beyond them
+    for (size_t channel = 0; channel < CHANNELS; channel++) {
+        const uint64_t *counts = histogram->counts[channel];
+        size_t low = 0, high = 255;
+        uint64_t below = counts[low], above = counts[high];
+        while (below <= clipped && low < 255)
+            below += counts[++low];
+        while (above <= clipped && high > 0)
+            above += counts[--high];
+
+        black[channel] = low < high ? low : 0;
+        white[channel] = low < high ? high : 255;
+    }
+
+    return lut_levels(lut, black, white, 1.0f);
+}
+
+void lut_invert(struct bmp_lut* lut) {
+
+    if (lut == NULL)
+        return;
+
+    uint8_t map[CHANNELS][256];
+    for (size_t value = 0; value < 256; value++) {
+        map[0][value] = map[1][value] = map[2][value] = 255 - value;
+    }
+    map_tables(lut, map);
+}
+
+void lut_threshold(struct bmp_lut* lut, uint8_t level) {
+
+    if (lut == NULL)
+        return;
+
+    uint8_t map[CHANNELS][256];
+    for (size_t value = 0; value < 256; value++) {
+        map[0][value] = map[1][value] = map[2][value] = value >= level ? 255 : 0;
+    }
+    map_tables(lut, map);
+}
+
+void lut_grayscale(struct bmp_lut* lut) {
+
+    if (lut == NULL)
+        return;
+
+    lut->grayscale = true;
+}
+
+struct bmp_image* adjust_colors(const struct bmp_image* image, const struct bmp_lut* lut) {
+
+    BMP_STAT_SCOPE(BMP_STAT_ADJUST_COLORS);
+
+    if (image == NULL || lut == NULL)
+        return NULL;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    // Alloc
+    struct bmp_image *newImage = create_bmp_image_like(image, image->info.width, image->info.height);
+    if (newImage == NULL)
+        return NULL;
+
+    struct color_band band = { .image = image, .newImage = newImage, .lut = lut, .shared = same_tables(lut) };
+
+    // Indices are kept, colors are adjusted in the palette
+    if (image->pixel_size == 1) {
+        thread_pool_run(get_thread_pool(), bands(image), copy_rows, &band);
+        adjust_palette(newImage, lut);
+        return newImage;
+    }
+
+    thread_pool_run(get_thread_pool(), bands(image), adjust_rows, &band);
+
+    return newImage;
+}
+
+bool adjust_colors_inplace(struct bmp_image* image, const struct bmp_lut* lut) {
+
+    BMP_STAT_SCOPE(BMP_STAT_ADJUST_COLORS_INPLACE);
+
+    if (image == NULL || lut == NULL || image->mapping != NULL || image->parent != NULL)
+        return false;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    if (image->pixel_size == 1) {
+        adjust_palette(image, lut);
+        return true;
+    }
+
+    struct color_band band = { .image = image, .newImage = image, .lut = lut, .shared = same_tables(lut) };
+    thread_pool_run(get_thread_pool(), bands(image), adjust_rows, &band);
+
+    return true;
+}
@@ -0,0 +1,163 @@
+#ifndef _COLOR_H
+#define _COLOR_H
+
+#include "bmp.h"
+
+// Channels of histograms and tables, in order of bytes of pixel
+#define CHANNEL_BLUE 0
+#define CHANNEL_GREEN 1
+#define CHANNEL_RED 2
+#define CHANNELS 3
+
+
+/**
+ * Structure contains histogram of every color channel and statistics
+ * computed from it. Alpha of 32-bit images is not counted, colors of
+ * palette images are counted for every pixel.
+ */
+struct bmp_histogram {
+    uint64_t counts[CHANNELS][256];
+    uint64_t pixels;
+    uint8_t min[CHANNELS];
+    uint8_t max[CHANNELS];
+    double mean[CHANNELS];
+};
+
+
+/**
+ * Structure describes color adjustment applied in a single pass. Pixels
+ * are turned to gray first if `grayscale` is set, then every channel is
+ * looked up in its table. Functions adjusting the tables below map the
+ * current outputs, so they can be chained in order.
+ */
+struct bmp_lut {
+    uint8_t tables[CHANNELS][256];
+    bool grayscale;
+};
+
+
+/**
+ * Computes histogram of image
+ *
+ * Bands of rows are counted by threads of the pool set by
+ * `set_thread_pool()` into their own histograms, which are added together
+ * at the end.
+ *
+ * @param image the image
+ * @param histogram where histogram and statistics are stored
+ * @return `true` if histogram was computed, `false` if there is no image or histogram (NULL given) or memory couldn't be allocated
+ */
+bool bmp_histogram(const struct bmp_image* image, struct bmp_histogram* histogram);
+
+
+/**
+ * Sets adjustment which keeps every color.
+ *
+ * @param lut the adjustment
+ */
+void lut_identity(struct bmp_lut* lut);
+
+
+/**
+ * Adds brightness and contrast change.
+ *
+ * Values are stretched around the middle gray by `contrast` and moved by
+ * `brightness`.
+ * @param lut the adjustment
+ * @param brightness the change of brightness in the range <-255, 255>
+ * @param contrast the contrast factor, 1 keeps contrast, contrast >= 0
+ * @return `true` if the adjustment was added, `false` if there is no adjustment (NULL given) or value is out of range
+ */
+bool lut_brightness_contrast(struct bmp_lut* lut, int brightness, float contrast);
+
+
+/**
+ * Adds gamma correction.
+ *
+ * Value `v` becomes `255 * (v / 255) ^ (1 / gamma)`, gamma > 1 brightens dark colors.
+ * @param lut the adjustment
+ * @param gamma the gamma, gamma > 0
+ * @return `true` if the adjustment was added, `false` if there is no adjustment (NULL given) or gamma is not valid
+ */
+bool lut_gamma(struct bmp_lut* lut, float gamma);
+
+
+/**
+ * Adds levels of every channel.
+ *
+ * Values of channel `c` from `black[c]` to `white[c]` are stretched to the
+ * whole range with gamma correction, values outside of it become 0 or 255.
+ * @param lut the adjustment
+ * @param black the darkest value of every channel
+ * @param white the brightest value of every channel, white[c] > black[c]
+ * @param gamma the gamma, same as in `lut_gamma()`
+ * @return `true` if the adjustment was added, `false` if there is no adjustment (NULL given) or levels are not valid
+ */
+bool lut_levels(struct bmp_lut* lut, const uint8_t black[CHANNELS], const uint8_t white[CHANNELS], float gamma);
+
+
+/**
+ * Adds levels stretching the histogram.
+ *
+ * Darkest and brightest `clip` fraction of pixels of every channel are
+ * clipped to 0 and 255, the rest is stretched by `lut_levels()`. Channels
+ * with a single value are kept.
+ * @param lut the adjustment
+ * @param histogram the histogram of the image
+ * @param clip the fraction of clipped pixels at each end in the range <0, 0.5)
+ * @return `true` if the adjustment was added, `false` if there is no adjustment or histogram (NULL given) or clip is not valid
+ */
+bool lut_auto_levels(struct bmp_lut* lut, const struct bmp_histogram* histogram, float clip);
+
+
+/**
+ * Adds inversion of colors.
+ *
+ * @param lut the adjustment
+ */
+void lut_invert(struct bmp_lut* lut);
+
+
+/**
+ * Adds threshold, values from `level` up become 255, lower values 0.
+ *
+ * @param lut the adjustment
+ * @param level the lowest value which becomes 255
+ */
+void lut_threshold(struct bmp_lut* lut, uint8_t level);
+
+
+/**
+ * Turns colors to gray before the tables are applied.
+ *
+ * Gray is weighted sum of channels with weights of ITU-R BT.601 luma.
+ * @param lut the adjustment
+ */
+void lut_grayscale(struct bmp_lut* lut);
+
+
+/**
+ * Adjusts colors of image.
+ *
+ * Creates copy of image with colors changed by the adjustment. Palette
+ * images keep their pixels and only colors of the palette are changed.
+ * Alpha of 32-bit images is kept.
+ * @arg image the image
+ * @arg lut the adjustment
+ * @return the adjusted copy of image or NULL, if there is no image or adjustment (NULL given)
+ */
+struct bmp_image* adjust_colors(const struct bmp_image* image, const struct bmp_lut* lut);
+
+
+/**
+ * Adjusts colors of image in place.
+ *
+ * Same as `adjust_colors()`, but changes the given image. Images loaded with
+ * `read_bmp_mmap()` and views are read-only.
+ * @arg image the image
+ * @arg lut the adjustment
+ * @return `true` if image was adjusted, `false` if there is no image or adjustment (NULL given) or image is read-only
+ */
+bool adjust_colors_inplace(struct bmp_image* image, const struct bmp_lut* lut);
+
+#endif
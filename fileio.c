@@ -0,0 +1,603 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "fileio.h"
+#include "alloc.h"
+
+// First size of read buffer, it doubles while the file doesn't fit
+#define READ_BUFFER_SIZE (256 << 10)
+
+// Largest transfer of one call
+#define MAX_TRANSFER (1u << 30)
+
+// Stages of request
+#define STAGE_OPEN 0
+#define STAGE_TRANSFER 1
+#define STAGE_CLOSE 2
+
+/**
+ * Submission and completion rings shared with the kernel.
+ */
+struct uring {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;         // queued entries not passed to the kernel yet
+};
+
+struct bmp_io {
+    enum bmp_io_backend backend;    // `BMP_IO_URING` or `BMP_IO_THREADS`
+    size_t depth;
+    struct bmp_allocator* allocator;
+    size_t pending;             // submitted and not returned, used by the owner only
+    struct bmp_io_request* waiting;     // not started yet, oldest first
+    struct bmp_io_request* waiting_tail;
+    struct bmp_io_request* finished;    // not returned yet
+
+    // io_uring
+    struct uring ring;
+    size_t running;             // requests with open file
+
+    // threads, lists above are guarded by the lock
+    pthread_t* threads;
+    size_t thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // request waiting or stop
+    pthread_cond_t done;        // request finished
+    bool stop;
+};
+
+static void push_waiting(struct bmp_io* io, struct bmp_io_request* request) {
+    request->next = NULL;
+    if (io->waiting_tail != NULL) {
+        io->waiting_tail->next = request;
+    }
+    else {
+        io->waiting = request;
+    }
+    io->waiting_tail = request;
+}
+
+static struct bmp_io_request* pop_waiting(struct bmp_io* io) {
+    struct bmp_io_request *request = io->waiting;
+    if (request != NULL) {
+        io->waiting = request->next;
+        if (io->waiting == NULL) {
+            io->waiting_tail = NULL;
+        }
+    }
+    return request;
+}
+
+/**
+ * Makes read buffer twice as large, keeps bytes already read.
+ */
+static bool grow_buffer(struct bmp_io* io, struct bmp_io_request* request) {
+
+    size_t capacity = request->capacity > 0 ? request->capacity * 2 : READ_BUFFER_SIZE;
+    uint8_t *data = (uint8_t*) bmp_buffer_alloc(io->allocator, capacity);
+    if (data == NULL) {
+        return false;
+    }
+
+    if (request->done > 0) {
+        memcpy(data, request->data, request->done);
+    }
+    bmp_buffer_free(io->allocator, request->data);
+    request->data = data;
+    request->capacity = capacity;
+
+    return true;
+}
+
+/**
+ * Sets result of finished request, failed reads have no buffer.
+ */
+static void finish_request(struct bmp_io* io, struct bmp_io_request* request) {
+    if (request->op == BMP_IO_READ) {
+        request->size = request->done;
+        if (request->error != 0) {
+            bmp_buffer_free(io->allocator, request->data);
+            request->data = NULL;
+            request->size = 0;
+        }
+    }
+}
+
+/**
+ * Runs whole request with blocking calls.
+ */
+static void run_request(struct bmp_io* io, struct bmp_io_request* request) {
+
+    bool read = request->op == BMP_IO_READ;
+    request->fd = read ? open(request->path, O_RDONLY | O_CLOEXEC) : open(request->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (request->fd < 0) {
+        request->error = errno;
+        finish_request(io, request);
+        return;
+    }
+
+    while (true) {
+        if (read && request->done == request->capacity && !grow_buffer(io, request)) {
+            request->error = ENOMEM;
+            break;
+        }
+
+        size_t length = read ? request->capacity - request->done : request->size - request->done;
+        if (!read && length == 0) {
+            break;
+        }
+
+        ssize_t result = read ? pread(request->fd, request->data + request->done, length, request->done) : pwrite(request->fd, request->data + request->done, length, request->done);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            request->error = errno;
+            break;
+        }
+        if (result == 0) {
+            // End of file, nothing written is an error
+            if (!read) {
+                request->error = EIO;
+            }
+            break;
+        }
+        request->done += result;
+    }
+
+    if (close(request->fd) != 0 && request->error == 0 && !read) {
+        request->error = errno;
+    }
+    finish_request(io, request);
+}
+
+static void* io_thread(void* arg) {
+
+    struct bmp_io *io = (struct bmp_io*) arg;
+
+    pthread_mutex_lock(&io->lock);
+    while (true) {
+        while (io->waiting == NULL && !io->stop) {
+            pthread_cond_wait(&io->work, &io->lock);
+        }
+        struct bmp_io_request *request = pop_waiting(io);
+        if (request == NULL) {
+            break;
+        }
+        pthread_mutex_unlock(&io->lock);
+
+        run_request(io, request);
+
+        pthread_mutex_lock(&io->lock);
+        request->next = io->finished;
+        io->finished = request;
+        pthread_cond_signal(&io->done);
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    return NULL;
+}
+
+static bool threads_create(struct bmp_io* io) {
+
+    io->threads = (pthread_t*) calloc(io->depth, sizeof(pthread_t));
+    if (io->threads == NULL) {
+        return false;
+    }
+
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->work, NULL);
+    pthread_cond_init(&io->done, NULL);
+
+    while (io->thread_count < io->depth && pthread_create(&io->threads[io->thread_count], NULL, io_thread, io) == 0) {
+        io->thread_count++;
+    }
+
+    return io->thread_count > 0;
+}
+
+static void threads_free(struct bmp_io* io) {
+
+    pthread_mutex_lock(&io->lock);
+    io->stop = true;
+    pthread_cond_broadcast(&io->work);
+    pthread_mutex_unlock(&io->lock);
+
+    for (size_t index = 0; index < io->thread_count; index++) {
+        pthread_join(io->threads[index], NULL);
+    }
+
+    free(io->threads);
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->work);
+    pthread_cond_destroy(&io->done);
+}
+
+static void uring_free(struct uring* ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+
+/**
+ * Sets up rings with raw system calls. Kernels without file operations
+ * (older than 5.6) are refused.
+ */
+static bool uring_setup(struct uring* ring, unsigned entries) {
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(struct uring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        return false;
+    }
+
+    // Both rings can share one mapping
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_free(ring);
+        return false;
+    }
+
+    ring->cq_ring = single ? ring->sq_ring : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+        ring->cq_ring = NULL;
+        uring_free(ring);
+        return false;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_free(ring);
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t*) ring->sq_ring;
+    uint8_t *cq = (uint8_t*) ring->cq_ring;
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return true;
+}
+
+/**
+ * Copies entry to the submission ring and publishes it to the kernel.
+ */
+static void uring_queue(struct uring* ring, const struct io_uring_sqe* sqe) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    ring->sqes[index] = *sqe;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+/**
+ * Submits queued entries and waits for at least one completion.
+ */
+static bool uring_enter(struct uring* ring) {
+    while (true) {
+        int result = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result >= 0) {
+            ring->to_submit -= result;
+            return true;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Queues the operation of the current stage of request.
+ */
+static void uring_start(struct bmp_io* io, struct bmp_io_request* request) {
+
+    bool read = request->op == BMP_IO_READ;
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.user_data = (uint64_t) (uintptr_t) request;
+
+    switch (request->stage) {
+        case STAGE_OPEN:
+            sqe.opcode = IORING_OP_OPENAT;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = (uint64_t) (uintptr_t) request->path;
+            sqe.open_flags = read ? O_RDONLY | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            sqe.len = read ? 0 : 0644;
+            break;
+
+        case STAGE_TRANSFER: {
+            size_t length = read ? request->capacity - request->done : request->size - request->done;
+            sqe.opcode = read ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe.fd = request->fd;
+            sqe.addr = (uint64_t) (uintptr_t) (request->data + request->done);
+            sqe.len = length < MAX_TRANSFER ? length : MAX_TRANSFER;
+            sqe.off = request->done;
+            break;
+        }
+
+        default:
+            sqe.opcode = IORING_OP_CLOSE;
+            sqe.fd = request->fd;
+    }
+
+    uring_queue(&io->ring, &sqe);
+}
+
+static void uring_finish(struct bmp_io* io, struct bmp_io_request* request) {
+    finish_request(io, request);
+    io->running--;
+    request->next = io->finished;
+    io->finished = request;
+}
+
+/**
+ * Moves request to the next stage after its operation completed with
+ * `result`.
+ */
+static void uring_complete(struct bmp_io* io, struct bmp_io_request* request, int result) {
+
+    bool read = request->op == BMP_IO_READ;
+
+    switch (request->stage) {
+        case STAGE_OPEN:
+            if (result < 0) {
+                request->error = -result;
+                uring_finish(io, request);
+                return;
+            }
+            request->fd = result;
+            request->stage = STAGE_TRANSFER;
+            if (read && !grow_buffer(io, request)) {
+                request->error = ENOMEM;
+                request->stage = STAGE_CLOSE;
+            }
+            if (!read && request->size == 0) {
+                request->stage = STAGE_CLOSE;
+            }
+            break;
+
+        case STAGE_TRANSFER:
+            if (result == -EINTR || result == -EAGAIN) {
+                break;
+            }
+            if (result < 0) {
+                request->error = -result;
+                request->stage = STAGE_CLOSE;
+                break;
+            }
+            request->done += result;
+
+            // Short read of regular file ends at the end of the file
+            if (read && request->done == request->capacity && result > 0) {
+                if (!grow_buffer(io, request)) {
+                    request->error = ENOMEM;
+                    request->stage = STAGE_CLOSE;
+                }
+            }
+            else if (read || request->done == request->size) {
+                request->stage = STAGE_CLOSE;
+            }
+            else if (result == 0) {
+                request->error = EIO;
+                request->stage = STAGE_CLOSE;
+            }
+            break;
+
+        default:
+            if (result < 0 && request->error == 0 && !read) {
+                request->error = -result;
+            }
+            uring_finish(io, request);
+            return;
+    }
+
+    uring_start(io, request);
+}
+
+static void uring_reap(struct bmp_io* io) {
+
+    struct uring *ring = &io->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct bmp_io_request *request = (struct bmp_io_request*) (uintptr_t) cqe->user_data;
+        int result = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        uring_complete(io, request, result);
+    }
+}
+
+/**
+ * Starts waiting requests while there is room for them and waits until
+ * some request finishes. Returns `false` if nothing is running.
+ */
+static bool uring_progress(struct bmp_io* io) {
+
+    while (io->running < io->depth && io->waiting != NULL) {
+        struct bmp_io_request *request = pop_waiting(io);
+        io->running++;
+        uring_start(io, request);
+    }
+
+    if (io->running == 0) {
+        return false;
+    }
+
+    if (!uring_enter(&io->ring)) {
+        return false;
+    }
+    uring_reap(io);
+
+    return true;
+}
+
+struct bmp_io* bmp_io_create(enum bmp_io_backend backend, size_t depth, struct bmp_allocator* allocator) {
+
+    struct bmp_io *io = (struct bmp_io*) calloc(1, sizeof(struct bmp_io));
+    if (io == NULL) {
+        return NULL;
+    }
+    io->depth = depth > 0 ? depth : 1;
+    io->allocator = allocator;
+
+    // Every running request has at most one entry in the ring
+    if (backend != BMP_IO_THREADS && uring_setup(&io->ring, io->depth)) {
+        io->backend = BMP_IO_URING;
+        return io;
+    }
+
+    if (backend != BMP_IO_URING && threads_create(io)) {
+        io->backend = BMP_IO_THREADS;
+        return io;
+    }
+
+    if (io->threads != NULL) {
+        threads_free(io);
+    }
+    free(io);
+    return NULL;
+}
+
+void bmp_io_free(struct bmp_io* io) {
+
+    if (io == NULL) {
+        return;
+    }
+
+    if (io->backend == BMP_IO_URING) {
+        // Files must be closed and the kernel must be done with buffers
+        io->waiting = NULL;
+        while (io->running > 0 && uring_progress(io)) {
+        }
+        uring_free(&io->ring);
+    }
+    else {
+        threads_free(io);
+    }
+
+    // Buffers of requests which were not returned
+    for (struct bmp_io_request *request = io->finished; request != NULL; request = request->next) {
+        if (request->op == BMP_IO_READ) {
+            bmp_buffer_free(io->allocator, request->data);
+            request->data = NULL;
+        }
+    }
+
+    free(io);
+}
+
+const char* bmp_io_name(const struct bmp_io* io) {
+    return io->backend == BMP_IO_URING ? "io_uring" : "threads";
+}
+
+void bmp_io_submit(struct bmp_io* io, struct bmp_io_request* request) {
+
+    request->fd = -1;
+    request->stage = STAGE_OPEN;
+    request->done = 0;
+    request->error = 0;
+    if (request->op == BMP_IO_READ) {
+        request->data = NULL;
+        request->size = 0;
+        request->capacity = 0;
+    }
+    io->pending++;
+
+    if (io->backend == BMP_IO_URING) {
+        push_waiting(io, request);
+        return;
+    }
+
+    pthread_mutex_lock(&io->lock);
+    push_waiting(io, request);
+    pthread_cond_signal(&io->work);
+    pthread_mutex_unlock(&io->lock);
+}
+
+struct bmp_io_request* bmp_io_wait(struct bmp_io* io) {
+
+    if (io->pending == 0) {
+        return NULL;
+    }
+
+    struct bmp_io_request *request;
+    if (io->backend == BMP_IO_URING) {
+        while (io->finished == NULL) {
+            if (!uring_progress(io)) {
+                return NULL;
+            }
+        }
+        request = io->finished;
+        io->finished = request->next;
+    }
+    else {
+        pthread_mutex_lock(&io->lock);
+        while (io->finished == NULL) {
+            pthread_cond_wait(&io->done, &io->lock);
+        }
+        request = io->finished;
+        io->finished = request->next;
+        pthread_mutex_unlock(&io->lock);
+    }
+
+    io->pending--;
+    request->next = NULL;
+    return request;
+}
+
+size_t bmp_io_pending(const struct bmp_io* io) {
+    return io->pending;
+}
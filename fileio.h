@@ -0,0 +1,121 @@
+#ifndef _FILEIO_H
+#define _FILEIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+struct bmp_allocator;
+
+
+/**
+ * Backends of asynchronous file I/O.
+ */
+enum bmp_io_backend {
+    BMP_IO_AUTO,                // io_uring if the kernel supports it, threads otherwise
+    BMP_IO_URING,               // io_uring only
+    BMP_IO_THREADS              // blocking calls in a group of threads
+};
+
+
+/**
+ * Operations of requests.
+ */
+enum bmp_io_op {
+    BMP_IO_READ,                // reads whole file into buffer
+    BMP_IO_WRITE                // creates or truncates file and writes buffer
+};
+
+
+/**
+ * Structure describes one file read or written asynchronously. The request
+ * belongs to the backend from `bmp_io_submit()` until it's returned by
+ * `bmp_io_wait()`.
+ */
+struct bmp_io_request {
+    enum bmp_io_op op;
+    const char* path;
+    uint8_t* data;              // read: contents of file from the allocator, write: bytes to write
+    size_t size;                // read: size of file, write: number of bytes
+    int error;                  // 0 or `errno` of failed call
+    void* user;                 // data of the caller
+
+    // Used by backend
+    int fd;
+    int stage;
+    size_t done;                // bytes already transferred
+    size_t capacity;            // size of read buffer
+    struct bmp_io_request* next;
+};
+
+
+struct bmp_io;
+
+
+/**
+ * Creates asynchronous I/O backend
+ *
+ * At most `depth` files are open at once, other requests wait. io_uring
+ * backend is used by one thread, the one calling `bmp_io_submit()` and
+ * `bmp_io_wait()`. Thread backend runs `depth` threads.
+ *
+ * @param backend requested backend
+ * @param depth number of files in progress at once
+ * @param allocator allocator of read buffers or `NULL`
+ * @return the backend or `NULL` if it is not available
+ */
+struct bmp_io* bmp_io_create(enum bmp_io_backend backend, size_t depth, struct bmp_allocator* allocator);
+
+
+/**
+ * Frees the backend from the memory
+ *
+ * Requests in progress are waited for, but not returned.
+ *
+ * @param io the backend
+ */
+void bmp_io_free(struct bmp_io* io);
+
+
+/**
+ * Returns name of the backend
+ *
+ * @param io the backend
+ * @return "io_uring" or "threads"
+ */
+const char* bmp_io_name(const struct bmp_io* io);
+
+
+/**
+ * Submits request
+ *
+ * Requests are started in order as soon as there is room for them. Buffer
+ * of read request is allocated by the backend and must be freed with
+ * `bmp_buffer_free()` of the allocator. Buffer of write request must stay
+ * valid until the request is returned.
+ *
+ * @param io the backend
+ * @param request the request, `op` and `path` (and `data` and `size` for writes) are set
+ */
+void bmp_io_submit(struct bmp_io* io, struct bmp_io_request* request);
+
+
+/**
+ * Waits for any submitted request to finish
+ *
+ * @param io the backend
+ * @return finished request or `NULL` if there are no submitted requests or the backend failed
+ */
+struct bmp_io_request* bmp_io_wait(struct bmp_io* io);
+
+
+/**
+ * Returns number of submitted requests, which were not returned yet
+ *
+ * @param io the backend
+ * @return number of requests
+ */
+size_t bmp_io_pending(const struct bmp_io* io);
+
+#endif
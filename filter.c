@@ -0,0 +1,443 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "filter.h"
+#include "transformations.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "alloc.h"
+#include "stats.h"
+#include "bands.h"
+
+// Fixed point weights of convolution, one is `1 << FILTER_BITS`
+#define FILTER_BITS 14
+
+// Averages of box blur are multiplied by reciprocal of the window size with this many fractional bits
+#define RECIPROCAL_BITS 55
+
+/**
+ * Arguments of band kernels, which fill bands <start, end) of `rows` rows
+ * of the result.
+ */
+struct filter_band {
+    const struct bmp_image* image;
+    struct bmp_image* newImage;
+    size_t rows;
+    const int32_t* row_weights;
+    size_t row_size;
+    const int32_t* col_weights;
+    size_t col_size;
+    size_t radius;
+    const struct bmp_image* blurred;
+    int32_t amount;
+    int32_t threshold;
+    struct bmp_allocator* allocator;    // allocator of scratch buffers
+    bool* failed;                       // set by tasks without scratch buffers
+};
+
+/**
+ * Kernels below are written for pixels of `size` bytes and inlined with
+ * constant size, so every format gets its own specialized loop.
+ */
+#define SPECIALIZED static inline __attribute__((always_inline))
+
+static uint8_t clamp_byte(int32_t value) {
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+/**
+ * Rounds fixed point sums to bytes.
+ */
+static void round_sums(uint8_t* dest, const int32_t* sums, size_t count) {
+    for (size_t index = 0; index < count; index++) {
+        dest[index] = clamp_byte((sums[index] + (1 << (FILTER_BITS - 1))) >> FILTER_BITS);
+    }
+}
+
+/**
+ * Converts weights to fixed point. Rounding error is added to the middle
+ * weight, so sum of weights stays the same. Returns `NULL` if kernel is not
+ * valid or sums could overflow.
+ */
+static int32_t* fixed_weights(const float* kernel, size_t size, struct bmp_allocator* allocator) {
+
+    if (kernel == NULL || size % 2 == 0 || size > FILTER_MAX_SIZE)
+        return NULL;
+
+    double sum = 0;
+    double magnitude = 0;
+    for (size_t index = 0; index < size; index++) {
+        if (!isfinite(kernel[index]))
+            return NULL;
+        sum += kernel[index];
+        magnitude += fabs(kernel[index]);
+    }
+    if (magnitude * 256 * (1 << FILTER_BITS) >= INT32_MAX)
+        return NULL;
+
+    int32_t *weights = (int32_t*) bmp_buffer_alloc(allocator, size * sizeof(int32_t));
+    if (weights == NULL)
+        return NULL;
+
+    int64_t total = 0;
+    for (size_t index = 0; index < size; index++) {
+        weights[index] = lround(kernel[index] * (1 << FILTER_BITS));
+        total += weights[index];
+    }
+    weights[size / 2] += llround(sum * (1 << FILTER_BITS)) - total;
+
+    return weights;
+}
+
+/**
+ * Rows of the band of the result, rows of both images are stored from bottom.
+ */
+static void band_rows(const struct filter_band* band, size_t start, size_t end, size_t* first, size_t* last) {
+    band_range(band->newImage->info.height, band->rows, start, end, first, last);
+}
+
+/**
+ * Returns source row `row` rows away from `h`, rows outside of the image are
+ * the nearest edge row.
+ */
+static const uint8_t* clamped_row(const struct bmp_image* image, size_t h, ptrdiff_t row) {
+    ptrdiff_t index = (ptrdiff_t) h + row;
+    ptrdiff_t last = (ptrdiff_t) image->info.height - 1;
+    return (const uint8_t*) bmp_row(image, index < 0 ? 0 : index > last ? last : index);
+}
+
+/**
+ * Separable convolution. Source rows of the window are added to sums with
+ * their weights, which is the same loop for every tap and vectorizes. The
+ * rounded row is padded with copies of its edge pixels, so the horizontal
+ * pass is the same loop over shifted rows.
+ */
+static void convolve_rows(void* arg, size_t start, size_t end) {
+    const struct filter_band *band = (const struct filter_band*) arg;
+    size_t width = band->image->info.width;
+    size_t size = band->image->pixel_size;
+    size_t channels = width * size;
+    size_t pad = band->row_size / 2;
+    size_t rowPad = band->col_size / 2;
+
+    int32_t *sums = (int32_t*) bmp_buffer_alloc(band->allocator, channels * sizeof(int32_t));
+    uint8_t *padded = (uint8_t*) bmp_buffer_alloc(band->allocator, (width + 2 * pad) * size);
+    if (sums == NULL || padded == NULL) {
+        bmp_buffer_free(band->allocator, sums);
+        bmp_buffer_free(band->allocator, padded);
+        band_failed(band->failed);
+        return;
+    }
+
+    size_t first, last;
+    band_rows(band, start, end, &first, &last);
+    for (size_t h = first; h < last; h++) {
+
+        // Rows below the pixel are stored before it
+        memset(sums, 0, channels * sizeof(int32_t));
+        for (size_t tap = 0; tap < band->col_size; tap++) {
+            accumulate_bytes(sums, clamped_row(band->image, h, (ptrdiff_t) rowPad - (ptrdiff_t) tap), channels, band->col_weights[tap]);
+        }
+        round_sums(padded + pad * size, sums, channels);
+        for (size_t w = 0; w < pad; w++) {
+            memcpy(padded + w * size, padded + pad * size, size);
+            memcpy(padded + (pad + width + w) * size, padded + (pad + width - 1) * size, size);
+        }
+
+        memset(sums, 0, channels * sizeof(int32_t));
+        for (size_t tap = 0; tap < band->row_size; tap++) {
+            accumulate_bytes(sums, padded + tap * size, channels, band->row_weights[tap]);
+        }
+        round_sums((uint8_t*) bmp_row(band->newImage, h), sums, channels);
+    }
+
+    bmp_buffer_free(band->allocator, sums);
+    bmp_buffer_free(band->allocator, padded);
+}
+
+SPECIALIZED void box_blur_row_of(uint8_t* dest, const int32_t* sums, size_t width, size_t size, size_t radius) {
+    uint64_t count = (uint64_t) (2 * radius + 1) * (2 * radius + 1);
+    uint64_t reciprocal = (((uint64_t) 1 << RECIPROCAL_BITS) + count - 1) / count;
+    size_t last = width - 1;
+
+    // Sums of columns of the first window, columns left of the row are the first one
+    int32_t window[4];
+    for (size_t channel = 0; channel < size; channel++) {
+        window[channel] = sums[channel] * (int32_t) (radius + 1);
+        for (size_t w = 1; w <= radius; w++) {
+            window[channel] += sums[(w < last ? w : last) * size + channel];
+        }
+    }
+
+    for (size_t w = 0; w < width; w++) {
+        size_t next = w + radius + 1 < last ? w + radius + 1 : last;
+        size_t previous = w > radius ? w - radius : 0;
+        for (size_t channel = 0; channel < size; channel++) {
+            dest[w * size + channel] = ((uint64_t) window[channel] + count / 2) * reciprocal >> RECIPROCAL_BITS;
+            window[channel] += sums[next * size + channel] - sums[previous * size + channel];
+        }
+    }
+}
+
+void box_blur_row(uint8_t* dest, const int32_t* sums, size_t width, size_t size, size_t radius) {
+
+    if (width == 0)
+        return;
+
+    if (size == 4)
+        box_blur_row_of(dest, sums, width, 4, radius);
+    else
+        box_blur_row_of(dest, sums, width, 3, radius);
+}
+
+/**
+ * Box blur. Sums of columns of the window are summed once per band and
+ * updated by the row entering and the row leaving the window.
+ */
+static void box_blur_rows(void* arg, size_t start, size_t end) {
+    const struct filter_band *band = (const struct filter_band*) arg;
+    size_t width = band->image->info.width;
+    size_t size = band->image->pixel_size;
+    size_t channels = width * size;
+    ptrdiff_t radius = band->radius;
+
+    int32_t *sums = (int32_t*) bmp_buffer_alloc(band->allocator, channels * sizeof(int32_t));
+    if (sums == NULL) {
+        band_failed(band->failed);
+        return;
+    }
+
+    size_t first, last;
+    band_rows(band, start, end, &first, &last);
+    memset(sums, 0, channels * sizeof(int32_t));
+    for (ptrdiff_t row = -radius; row <= radius; row++) {
+        accumulate_bytes(sums, clamped_row(band->image, first, row), channels, 1);
+    }
+
+    for (size_t h = first; h < last; h++) {
+        box_blur_row((uint8_t*) bmp_row(band->newImage, h), sums, width, size, radius);
+        accumulate_bytes(sums, clamped_row(band->image, h, radius + 1), channels, 1);
+        accumulate_bytes(sums, clamped_row(band->image, h, -radius), channels, -1);
+    }
+
+    bmp_buffer_free(band->allocator, sums);
+}
+
+/**
+ * Adds scaled difference of the image and its blur, `amount` is fixed
+ * point with 8 fractional bits.
+ */
+static void unsharp_rows(void* arg, size_t start, size_t end) {
+    const struct filter_band *band = (const struct filter_band*) arg;
+    size_t channels = band->image->info.width * band->image->pixel_size;
+
+    size_t first, last;
+    band_rows(band, start, end, &first, &last);
+    for (size_t h = first; h < last; h++) {
+        const uint8_t *source = (const uint8_t*) bmp_row(band->image, h);
+        const uint8_t *blurred = (const uint8_t*) bmp_row(band->blurred, h);
+        uint8_t *dest = (uint8_t*) bmp_row(band->newImage, h);
+        for (size_t index = 0; index < channels; index++) {
+            int32_t difference = source[index] - blurred[index];
+            int32_t sharpened = source[index] + ((difference * band->amount + 128) >> 8);
+            dest[index] = abs(difference) < band->threshold ? source[index] : clamp_byte(sharpened);
+        }
+    }
+}
+
+/**
+ * Converts rows of palette image to 24-bit pixels, indices out of the
+ * palette are black.
+ */
+static void expand_rows(void* arg, size_t start, size_t end) {
+    const struct filter_band *band = (const struct filter_band*) arg;
+
+    size_t first, last;
+    band_rows(band, start, end, &first, &last);
+    expand_palette_rows(band->image, band->newImage, first, last);
+}
+
+/**
+ * Returns 24-bit copy of palette image, other images are returned as they
+ * are. Colors can't be mixed in palette, so filters work on the copy.
+ */
+static const struct bmp_image* direct_colors(const struct bmp_image* image) {
+
+    if (image->pixel_size != 1)
+        return image;
+
+    struct bmp_image *expanded = create_bmp_image(image->info.width, image->info.height);
+    if (expanded == NULL)
+        return NULL;
+
+    struct filter_band band = { .image = image, .newImage = expanded, .rows = BAND_ROWS };
+    thread_pool_run(get_thread_pool(), band_count(image->info.height, BAND_ROWS), expand_rows, &band);
+    return expanded;
+}
+
+static void free_direct_colors(const struct bmp_image* image, const struct bmp_image* source) {
+    if (source != image)
+        free_bmp_image((struct bmp_image*) source);
+}
+
+struct bmp_image* convolve(const struct bmp_image* image, const float* row_kernel, size_t row_size, const float* col_kernel, size_t col_size) {
+
+    BMP_STAT_SCOPE(BMP_STAT_CONVOLVE);
+
+    if (image == NULL)
+        return NULL;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    int32_t *rowWeights = fixed_weights(row_kernel, row_size, allocator);
+    int32_t *colWeights = fixed_weights(col_kernel, col_size, allocator);
+    const struct bmp_image *source = rowWeights != NULL && colWeights != NULL ? direct_colors(image) : NULL;
+    if (source == NULL) {
+        bmp_buffer_free(allocator, rowWeights);
+        bmp_buffer_free(allocator, colWeights);
+        return NULL;
+    }
+
+    // Alloc
+    struct bmp_image *newImage = create_bmp_image_like(source, source->info.width, source->info.height);
+    if (newImage != NULL) {
+        bool failed = false;
+        struct filter_band band = {
+            .image = source,
+            .newImage = newImage,
+            .rows = BAND_ROWS,
+            .row_weights = rowWeights,
+            .row_size = row_size,
+            .col_weights = colWeights,
+            .col_size = col_size,
+            .allocator = newImage->allocator,
+            .failed = &failed
+        };
+        thread_pool_run(get_thread_pool(), band_count(source->info.height, BAND_ROWS), convolve_rows, &band);
+        if (failed) {
+            free_bmp_image(newImage);
+            newImage = NULL;
+        }
+    }
+
+    bmp_buffer_free(allocator, rowWeights);
+    bmp_buffer_free(allocator, colWeights);
+    free_direct_colors(image, source);
+
+    return newImage;
+}
+
+struct bmp_image* box_blur(const struct bmp_image* image, uint32_t radius) {
+
+    BMP_STAT_SCOPE(BMP_STAT_BOX_BLUR);
+
+    if (image == NULL)
+        return NULL;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    if (radius > BOX_MAX_RADIUS)
+        return NULL;
+
+    const struct bmp_image *source = direct_colors(image);
+    if (source == NULL)
+        return NULL;
+
+    // Alloc
+    struct bmp_image *newImage = create_bmp_image_like(source, source->info.width, source->info.height);
+    if (newImage != NULL) {
+
+        // Summing the first window of a band costs as much as its rows, bands are taller than the window
+        size_t rows = 4 * (size_t) radius > BAND_ROWS ? 4 * (size_t) radius : BAND_ROWS;
+        bool failed = false;
+        struct filter_band band = {
+            .image = source,
+            .newImage = newImage,
+            .rows = rows,
+            .radius = radius,
+            .allocator = newImage->allocator,
+            .failed = &failed
+        };
+        thread_pool_run(get_thread_pool(), band_count(source->info.height, rows), box_blur_rows, &band);
+        if (failed) {
+            free_bmp_image(newImage);
+            newImage = NULL;
+        }
+    }
+
+    free_direct_colors(image, source);
+
+    return newImage;
+}
+
+struct bmp_image* gaussian_blur(const struct bmp_image* image, float sigma) {
+
+    BMP_STAT_SCOPE(BMP_STAT_GAUSSIAN_BLUR);
+
+    if (image == NULL)
+        return NULL;
+
+    if (!(sigma > 0) || !isfinite(sigma))
+        return NULL;
+
+    // Widths of three boxes, variance of their sum is the closest to sigma squared
+    double variance = 12.0 * sigma * sigma;
+    int64_t lower = floor(sqrt(variance / 3 + 1));
+    if (lower % 2 == 0)
+        lower--;
+    int64_t lowerBoxes = llround((variance - 3 * lower * lower - 12 * lower - 9) / (-4 * lower - 4));
+
+    struct bmp_image *result = NULL;
+    for (int64_t pass = 0; pass < 3; pass++) {
+        int64_t boxWidth = pass < lowerBoxes ? lower : lower + 2;
+        if (boxWidth / 2 > BOX_MAX_RADIUS) {
+            free_bmp_image(result);
+            return NULL;
+        }
+
+        struct bmp_image *next = box_blur(result != NULL ? result : image, boxWidth / 2);
+        free_bmp_image(result);
+        if (next == NULL)
+            return NULL;
+        result = next;
+    }
+
+    return result;
+}
+
+struct bmp_image* unsharp_mask(const struct bmp_image* image, float sigma, float amount, uint8_t threshold) {
+
+    BMP_STAT_SCOPE(BMP_STAT_UNSHARP_MASK);
+
+    if (image == NULL)
+        return NULL;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    if (!(amount >= 0 && amount <= 100))
+        return NULL;
+
+    const struct bmp_image *source = direct_colors(image);
+    if (source == NULL)
+        return NULL;
+
+    struct bmp_image *blurred = gaussian_blur(source, sigma);
+    struct bmp_image *newImage = blurred != NULL ? create_bmp_image_like(source, source->info.width, source->info.height) : NULL;
+    if (newImage != NULL) {
+        struct filter_band band = {
+            .image = source,
+            .newImage = newImage,
+            .rows = BAND_ROWS,
+            .blurred = blurred,
+            .amount = lroundf(amount * 256),
+            .threshold = threshold
+        };
+        thread_pool_run(get_thread_pool(), band_count(source->info.height, BAND_ROWS), unsharp_rows, &band);
+    }
+
+    free_bmp_image(blurred);
+    free_direct_colors(image, source);
+
+    return newImage;
+}
@@ -0,0 +1,89 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#include "bmp.h"
+
+// Largest radius of box blur, sums of the whole window fit 32 bits
+#define BOX_MAX_RADIUS 1448
+
+// Largest number of taps of convolution kernel
+#define FILTER_MAX_SIZE 255
+
+
+/**
+ * Convolution of image with separable kernel.
+ *
+ * Creates copy of image, every pixel is weighted sum of its neighbours.
+ * Weight `col_kernel[k]` multiplies row `k - col_size / 2` rows below the
+ * pixel, then weight `row_kernel[k]` multiplies column `k - row_size / 2`
+ * columns to the right. Pixels outside of the image are the same as the
+ * nearest edge pixel. Weights are converted to fixed point and the result of
+ * the first pass is rounded to bytes, weights of kernels keeping brightness
+ * sum to 1. Palette images produce 24-bit images.
+ * @arg image the image
+ * @arg row_kernel weights of horizontal pass
+ * @arg row_size number of horizontal weights, odd number in the range <1, FILTER_MAX_SIZE>
+ * @arg col_kernel weights of vertical pass
+ * @arg col_size number of vertical weights, odd number in the range <1, FILTER_MAX_SIZE>
+ * @return the filtered copy of image or NULL, if there is no image (NULL given) or kernel is not valid
+ */
+struct bmp_image* convolve(const struct bmp_image* image, const float* row_kernel, size_t row_size, const float* col_kernel, size_t col_size);
+
+
+/**
+ * Box blur of image.
+ *
+ * Creates copy of image, every pixel is average of square of
+ * `2 * radius + 1` pixels around it, edge pixels are repeated outside of
+ * the image. Sums of the square are updated as it slides, so the time per
+ * pixel doesn't depend on the radius. Palette images produce 24-bit images.
+ * @arg image the image
+ * @arg radius the radius of the square in the range <0, BOX_MAX_RADIUS>
+ * @return the blurred copy of image or NULL, if there is no image (NULL given) or radius is too large
+ */
+struct bmp_image* box_blur(const struct bmp_image* image, uint32_t radius);
+
+
+/**
+ * Gaussian blur of image.
+ *
+ * Approximated by three box blurs, which are as wide as the Gaussian
+ * together. Palette images produce 24-bit images.
+ * @arg image the image
+ * @arg sigma the standard deviation of the Gaussian in pixels, sigma > 0
+ * @return the blurred copy of image or NULL, if there is no image (NULL given) or sigma is not valid
+ */
+struct bmp_image* gaussian_blur(const struct bmp_image* image, float sigma);
+
+
+/**
+ * Sharpen image with unsharp mask.
+ *
+ * Creates copy of image, difference of every pixel and its Gaussian blur
+ * multiplied by `amount` is added to the pixel. Channels, which differ from
+ * the blur less than `threshold`, are kept, so noise of flat areas isn't
+ * sharpened. Palette images produce 24-bit images.
+ * @arg image the image
+ * @arg sigma the standard deviation of the blur in pixels, sigma > 0
+ * @arg amount the strength of sharpening in the range <0, 100>
+ * @arg threshold the smallest sharpened difference
+ * @return the sharpened copy of image or NULL, if there is no image (NULL given) or sigma or amount is not valid
+ */
+struct bmp_image* unsharp_mask(const struct bmp_image* image, float sigma, float amount, uint8_t threshold);
+
+
+/**
+ * Horizontal pass of box blur of one row.
+ *
+ * Averages sums of `2 * radius + 1` rows over `2 * radius + 1` columns.
+ * Used by `box_blur()` and by streaming blur, which keeps only the rows of
+ * the window.
+ * @arg dest `width` pixels of the result
+ * @arg sums sums of columns of the window, one for every channel of `width` pixels
+ * @arg width the width of the row
+ * @arg size the size of pixel in bytes, 3 or 4
+ * @arg radius the radius of the window in the range <0, BOX_MAX_RADIUS>
+ */
+void box_blur_row(uint8_t* dest, const int32_t* sums, size_t width, size_t size, size_t radius);
+
+#endif
@@ -1,28 +1,290 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <unistd.h>
+#include <glob.h>
 #include "bmp.h"
-#include "transformations.h"
-#include "math.h"
+#include "pipeline.h"
+#include "batch.h"
+
+static void usage(FILE* stream) {
+    fprintf(stream,
+        "Usage: bmp [options] -e OPERATIONS FILE...\n"
+        "       bmp [-j N] -p FILE...\n"
+        "\n"
+        "Applies chain of operations to every BMP file. Files can be given as\n"
+        "glob patterns, e.g. 'assets/*.bmp'.\n"
+        "\n"
+        "Operations, separated by commas, applied in order:\n"
+        "  flip-h, flip-v, rotate-right, rotate-left, rotate-180\n"
+        "  crop=Y:X:HEIGHT:WIDTH, scale=FACTOR, extract=[rgb]\n"
+        "\n"
+        "Options:\n"
+        "  -e OPS   operations\n"
+        "  -p       print size and format of files, only headers are read\n"
+        "  -o DIR   directory of results (default: FILE.out.bmp next to FILE)\n"
+        "  -j N     threads processing images (default: number of CPUs),\n"
+        "           with -p threads reading headers (default: 4 per CPU)\n"
+        "  -i N     threads reading and threads writing files (default: 2)\n"
+        "  -q N     images waiting between stages (default: 2 * threads)\n"
+        "  -a IO    read and write whole files asynchronously, IO is auto,\n"
+        "           uring or threads (auto: io_uring if available)\n"
+        "  -d N     files read or written at once with -a (default: 64)\n"
+        "  -c       write RLE compressed files when smaller\n"
+        "  -m MB    keep up to MB of results in memory and write results of\n"
+        "           inputs with the same pixels from it\n"
+        "  -C DIR   keep results in existing directory DIR too, for next runs\n"
+        "  -s       print only totals, no report of every file\n"
+        "  -h       print this help\n");
+}
+
+/**
+ * Reads non-negative number of option. Returns `false` if it's not valid.
+ */
+static bool parse_count(const char* value, size_t* count) {
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || number < 0) {
+        return false;
+    }
+    *count = number;
+    return true;
+}
+
+/**
+ * Reads backend of asynchronous I/O. Returns `false` if it's not known.
+ */
+static bool parse_backend(const char* value, enum bmp_io_backend* backend) {
+    if (strcmp(value, "auto") == 0)
+        *backend = BMP_IO_AUTO;
+    else if (strcmp(value, "uring") == 0)
+        *backend = BMP_IO_URING;
+    else if (strcmp(value, "threads") == 0)
+        *backend = BMP_IO_THREADS;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * Queues one operation given as `name` or `name=arguments`.
+ */
+static bool parse_op(struct pipeline* pipeline, char* op) {
+
+    char *args = strchr(op, '=');
+    if (args != NULL) {
+        *args++ = '\0';
+    }
+
+    if (strcmp(op, "flip-h") == 0 && args == NULL)
+        return pipeline_flip_horizontally(pipeline);
+    if (strcmp(op, "flip-v") == 0 && args == NULL)
+        return pipeline_flip_vertically(pipeline);
+    if (strcmp(op, "rotate-right") == 0 && args == NULL)
+        return pipeline_rotate_right(pipeline);
+    if (strcmp(op, "rotate-left") == 0 && args == NULL)
+        return pipeline_rotate_left(pipeline);
+    if (strcmp(op, "rotate-180") == 0 && args == NULL)
+        return pipeline_rotate_right(pipeline) && pipeline_rotate_right(pipeline);
+
+    if (strcmp(op, "crop") == 0 && args != NULL) {
+        unsigned int y, x, height, width;
+        char end;
+        if (sscanf(args, "%u:%u:%u:%u%c", &y, &x, &height, &width, &end) != 4)
+            return false;
+        return pipeline_crop(pipeline, y, x, height, width);
+    }
+
+    if (strcmp(op, "scale") == 0 && args != NULL) {
+        float factor;
+        char end;
+        if (sscanf(args, "%f%c", &factor, &end) != 1)
+            return false;
+        return pipeline_scale(pipeline, factor);
+    }
+
+    if (strcmp(op, "extract") == 0 && args != NULL)
+        return pipeline_extract(pipeline, args);
+
+    return false;
+}
+
+static bool parse_ops(struct pipeline* pipeline, const char* ops) {
 
+    char *copy = strdup(ops);
+    if (copy == NULL)
+        return false;
 
-int main (int argc, char *argv[]) {    
-    
-    FILE* stream = fopen("assets/square.4x2.bmp", "rb");
-    struct bmp_image* image = read_bmp(stream);
-    fclose(stream);
+    bool ok = true;
+    char *state;
+    for (char *op = strtok_r(copy, ",", &state); op != NULL && ok; op = strtok_r(NULL, ",", &state)) {
+        ok = parse_op(pipeline, op);
+        if (!ok)
+            fprintf(stderr, "Error: Unknown operation '%s'.\n", op);
+    }
 
-    struct bmp_image* fright = rotate_right(image);
-    //struct bmp_image* fleft = extract(fright, "r");
+    free(copy);
+    return ok;
+}
 
-    FILE *out = fopen("assets/testout.bmp", "wb");
-    write_bmp(out, fright);
-    fclose(out);
-    // int w = 1;
-    // int h = 1;
+static const char* compression_name(uint32_t compression) {
+    switch (compression) {
+        case BI_RLE8:
+            return "RLE8";
+        case BI_RLE4:
+            return "RLE4";
+        case BI_BITFIELDS:
+            return "bitfields";
+        default:
+            return "uncompressed";
+    }
+}
 
-    // printf("%d",((w * 24 + 31) / 32) * 4 * h);
+/**
+ * Prints size and format of every file in the order of paths. Returns
+ * `false` if any file is not valid.
+ */
+static bool probe_files(const char* const* paths, size_t count, size_t threads) {
 
-    return 0;
+    struct bmp_header *headers = (struct bmp_header*) calloc(count, sizeof(struct bmp_header));
+    bool *valid = (bool*) calloc(count, sizeof(bool));
+    if (headers == NULL || valid == NULL) {
+        free(headers);
+        free(valid);
+        fprintf(stderr, "Error: Not enough memory.\n");
+        return false;
+    }
+
+    size_t found = batch_probe(paths, count, threads, headers, valid);
+    for (size_t index = 0; index < count; index++) {
+        if (valid[index])
+            printf("%s: %ux%u, %u-bit, %s, %u B\n", paths[index], headers[index].width, headers[index].height,
+                headers[index].bpp, compression_name(headers[index].compression), headers[index].size);
+        else
+            printf("%s: not a valid BMP file\n", paths[index]);
+    }
+    fprintf(stderr, "files: %zu valid, %zu not valid\n", found, count - found);
+
+    free(headers);
+    free(valid);
+    return found == count;
 }
 
+int main(int argc, char *argv[]) {
+
+    struct pipeline *pipeline = pipeline_create();
+    struct batch_options options = { .pipeline = pipeline, .readers = 2, .writers = 2, .report = stdout };
+    bool hasOps = false;
+    bool probe = false;
+    size_t io = 2;
+    size_t cacheSize = 0;
+    const char *cacheDir = NULL;
 
+    int option;
+    while ((option = getopt(argc, argv, "e:po:j:i:q:a:d:cm:C:sh")) != -1) {
+        bool ok = true;
+        switch (option) {
+            case 'e':
+                ok = parse_ops(pipeline, optarg);
+                hasOps = true;
+                break;
+            case 'p':
+                probe = true;
+                break;
+            case 'o':
+                options.output_dir = optarg;
+                break;
+            case 'j':
+                ok = parse_count(optarg, &options.workers);
+                break;
+            case 'i':
+                ok = parse_count(optarg, &io) && io > 0;
+                options.readers = io;
+                options.writers = io;
+                break;
+            case 'q':
+                ok = parse_count(optarg, &options.queue_depth);
+                break;
+            case 'a':
+                ok = parse_backend(optarg, &options.backend);
+                options.async_io = true;
+                break;
+            case 'd':
+                ok = parse_count(optarg, &options.io_depth);
+                break;
+            case 'c':
+                options.rle = true;
+                break;
+            case 'm':
+                ok = parse_count(optarg, &cacheSize) && cacheSize <= SIZE_MAX >> 20;
+                cacheSize <<= 20;
+                break;
+            case 'C':
+                cacheDir = optarg;
+                break;
+            case 's':
+                options.report = NULL;
+                break;
+            case 'h':
+                usage(stdout);
+                pipeline_free(pipeline);
+                return 0;
+            default:
+                ok = false;
+        }
 
+        if (!ok) {
+            usage(stderr);
+            pipeline_free(pipeline);
+            return 1;
+        }
+    }
 
+    if ((!hasOps && !probe) || optind == argc) {
+        usage(stderr);
+        pipeline_free(pipeline);
+        return 1;
+    }
+
+    // Patterns are expanded, other arguments are used as they are
+    glob_t files = { 0 };
+    int flags = 0;
+    for (int index = optind; index < argc; index++) {
+        int result = glob(argv[index], flags | GLOB_NOCHECK, NULL, &files);
+        if (result != 0) {
+            fprintf(stderr, "Error: Can't expand '%s'.\n", argv[index]);
+            globfree(&files);
+            pipeline_free(pipeline);
+            return 1;
+        }
+        flags = GLOB_APPEND;
+    }
+
+    if (probe) {
+        bool ok = probe_files((const char* const*) files.gl_pathv, files.gl_pathc, options.workers);
+        globfree(&files);
+        pipeline_free(pipeline);
+        return ok ? 0 : 1;
+    }
+
+    // Results are cached only if they are kept somewhere
+    if (cacheSize > 0 || cacheDir != NULL) {
+        options.cache = bmp_cache_create(cacheSize, cacheDir);
+        if (options.cache == NULL) {
+            fprintf(stderr, "Error: Can't create cache.\n");
+            globfree(&files);
+            pipeline_free(pipeline);
+            return 1;
+        }
+    }
+
+    struct batch_stats stats;
+    bool ok = batch_run((const char* const*) files.gl_pathv, files.gl_pathc, &options, &stats);
+    batch_print_stats(stderr, &stats);
+
+    bmp_cache_free(options.cache);
+    globfree(&files);
+    pipeline_free(pipeline);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,427 @@
+#include <string.h>
+#include <math.h>
+#include "pipeline.h"
+#include "transformations.h"
+#include "stats.h"
+#include "cache.h"
+#include "alloc.h"
+
+// Axes of the image
+#define AXIS_X 0
+#define AXIS_Y 1
+
+struct pipeline* pipeline_create(void) {
+    return (struct pipeline*) calloc(1, sizeof(struct pipeline));
+}
+
+void pipeline_free(struct pipeline* pipeline) {
+    if (pipeline != NULL) {
+        free(pipeline->ops);
+        free(pipeline);
+    }
+}
+
+/**
+ * Appends operation to the end of the queue.
+ */
+static bool push_op(struct pipeline* pipeline, const struct pipeline_op* op) {
+
+    if (pipeline == NULL)
+        return false;
+
+    // Grow queue
+    if (pipeline->count == pipeline->capacity) {
+        size_t capacity = pipeline->capacity == 0 ? 8 : pipeline->capacity * 2;
+        struct pipeline_op *ops = (struct pipeline_op*) realloc(pipeline->ops, capacity * sizeof(struct pipeline_op));
+        if (ops == NULL)
+            return false;
+        pipeline->ops = ops;
+        pipeline->capacity = capacity;
+    }
+
+    pipeline->ops[pipeline->count++] = *op;
+    return true;
+}
+
+bool pipeline_flip_horizontally(struct pipeline* pipeline) {
+    struct pipeline_op op = { .type = OP_FLIP_HORIZONTALLY };
+    return push_op(pipeline, &op);
+}
+
+bool pipeline_flip_vertically(struct pipeline* pipeline) {
+    struct pipeline_op op = { .type = OP_FLIP_VERTICALLY };
+    return push_op(pipeline, &op);
+}
+
+bool pipeline_rotate_right(struct pipeline* pipeline) {
+    struct pipeline_op op = { .type = OP_ROTATE_RIGHT };
+    return push_op(pipeline, &op);
+}
+
+bool pipeline_rotate_left(struct pipeline* pipeline) {
+    struct pipeline_op op = { .type = OP_ROTATE_LEFT };
+    return push_op(pipeline, &op);
+}
+
+bool pipeline_crop(struct pipeline* pipeline, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width) {
+
+    // Check crop size
+    if (height < 1 || width < 1)
+        return false;
+
+    struct pipeline_op op = {
+        .type = OP_CROP,
+        .start_y = start_y,
+        .start_x = start_x,
+        .height = height,
+        .width = width
+    };
+    return push_op(pipeline, &op);
+}
+
+bool pipeline_scale(struct pipeline* pipeline, float factor) {
+
+    if (factor <= 0)
+        return false;
+
+    struct pipeline_op op = { .type = OP_SCALE, .factor = factor };
+    return push_op(pipeline, &op);
+}
+
+bool pipeline_extract(struct pipeline* pipeline, const char* colors_to_keep) {
+
+    struct pipeline_op op = { .type = OP_EXTRACT };
+
+    if (!parse_colors(colors_to_keep, &op.mask))
+        return false;
+
+    return push_op(pipeline, &op);
+}
+
+/**
+ * Computes size of image produced by the operation from image of size
+ * `width` x `height`. Returns `false` if operation can't be applied.
+ */
+static bool op_size(const struct pipeline_op* op, uint32_t width, uint32_t height, uint32_t* new_width, uint32_t* new_height) {
+
+    *new_width = width;
+    *new_height = height;
+
+    switch (op->type) {
+        case OP_ROTATE_RIGHT:
+        case OP_ROTATE_LEFT:
+            *new_width = height;
+            *new_height = width;
+            break;
+
+        case OP_CROP:
+            if (op->start_y >= height || op->start_x >= width)
+                return false;
+            if ((size_t) op->start_y + op->height > height || (size_t) op->start_x + op->width > width)
+                return false;
+            *new_width = op->width;
+            *new_height = op->height;
+            break;
+
+        case OP_SCALE:
+            if (op->factor != 1) {
+                size_t source_width = width;
+                size_t source_height = height;
+                *new_width = round(source_width * op->factor);
+                *new_height = round(source_height * op->factor);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return true;
+}
+
+/**
+ * Maps coordinate `value` on `axis` of the operation's result to the
+ * coordinate in its source of size `width` x `height`. Every supported
+ * operation either keeps the axes or swaps them, so coordinates on both
+ * axes are mapped independently.
+ */
+static void op_map(const struct pipeline_op* op, uint32_t width, uint32_t height, uint32_t new_width, uint32_t new_height, int* axis, size_t* value) {
+
+    switch (op->type) {
+        case OP_FLIP_HORIZONTALLY:
+            if (*axis == AXIS_X)
+                *value = width - 1 - *value;
+            break;
+
+        case OP_FLIP_VERTICALLY:
+            if (*axis == AXIS_Y)
+                *value = height - 1 - *value;
+            break;
+
+        // Result (x, y) comes from source (width - 1 - y, x)
+        case OP_ROTATE_RIGHT:
+            if (*axis == AXIS_X) {
+                *axis = AXIS_Y;
+            }
+            else {
+                *axis = AXIS_X;
+                *value = width - 1 - *value;
+            }
+            break;
+
+        // Result (x, y) comes from source (y, height - 1 - x)
+        case OP_ROTATE_LEFT:
+            if (*axis == AXIS_X) {
+                *axis = AXIS_Y;
+                *value = height - 1 - *value;
+            }
+            else {
+                *axis = AXIS_X;
+            }
+            break;
+
+        // Rows are stored from bottom, so the area starts `start_y + height` rows from the top
+        case OP_CROP:
+            if (*axis == AXIS_X)
+                *value += op->start_x;
+            else
+                *value += height - op->start_y - op->height;
+            break;
+
+        case OP_SCALE:
+            if (*axis == AXIS_X)
+                *value = (*value * width) / new_width;
+            else
+                *value = (*value * height) / new_height;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Computes byte offset of source pixel for every coordinate along `axis` of
+ * the result. Offsets of column and row added together give the source pixel.
+ */
+static void map_axis(const struct pipeline* pipeline, const uint32_t* widths, const uint32_t* heights, const struct bmp_image* image, int axis, size_t count, size_t* offsets) {
+
+    for (size_t i = 0; i < count; i++) {
+        int current = axis;
+        size_t value = i;
+
+        // Go from the last operation to the first one
+        for (size_t op = pipeline->count; op > 0; op--) {
+            op_map(&pipeline->ops[op - 1], widths[op - 1], heights[op - 1], widths[op], heights[op], &current, &value);
+        }
+
+        offsets[i] = current == AXIS_X ? value * image->pixel_size : value * image->stride;
+    }
+}
+
+struct bmp_image* pipeline_run(const struct pipeline* pipeline, const struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_PIPELINE_RUN);
+
+    if (pipeline == NULL || image == NULL)
+        return NULL;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    // Size of image after every operation, tables come from the allocator of the thread
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    uint32_t *widths = (uint32_t*) bmp_buffer_alloc(allocator, (pipeline->count + 1) * sizeof(uint32_t));
+    uint32_t *heights = (uint32_t*) bmp_buffer_alloc(allocator, (pipeline->count + 1) * sizeof(uint32_t));
+    if (widths == NULL || heights == NULL) {
+        bmp_buffer_free(allocator, widths);
+        bmp_buffer_free(allocator, heights);
+        return NULL;
+    }
+    widths[0] = image->info.width;
+    heights[0] = image->info.height;
+
+    // Combined channel mask
+    struct pixel mask = { 0xFF, 0xFF, 0xFF };
+
+    for (size_t op = 0; op < pipeline->count; op++) {
+        if (!op_size(&pipeline->ops[op], widths[op], heights[op], &widths[op + 1], &heights[op + 1])) {
+            bmp_buffer_free(allocator, widths);
+            bmp_buffer_free(allocator, heights);
+            return NULL;
+        }
+
+        if (pipeline->ops[op].type == OP_EXTRACT) {
+            mask.blue &= pipeline->ops[op].mask.blue;
+            mask.green &= pipeline->ops[op].mask.green;
+            mask.red &= pipeline->ops[op].mask.red;
+        }
+    }
+
+    size_t width = widths[pipeline->count];
+    size_t height = heights[pipeline->count];
+
+    // Source offsets for every column and row of the result
+    size_t *cols = (size_t*) bmp_buffer_alloc(allocator, (width + 1) * sizeof(size_t));
+    size_t *rows = (size_t*) bmp_buffer_alloc(allocator, (height + 1) * sizeof(size_t));
+    if (cols == NULL || rows == NULL) {
+        bmp_buffer_free(allocator, cols);
+        bmp_buffer_free(allocator, rows);
+        bmp_buffer_free(allocator, widths);
+        bmp_buffer_free(allocator, heights);
+        return NULL;
+    }
+    map_axis(pipeline, widths, heights, image, AXIS_X, width, cols);
+    map_axis(pipeline, widths, heights, image, AXIS_Y, height, rows);
+    bmp_buffer_free(allocator, widths);
+    bmp_buffer_free(allocator, heights);
+
+    // Alloc, every pixel is written
+    struct bmp_image *newImage = create_bmp_image_like(image, width, height);
+    if (newImage == NULL) {
+        bmp_buffer_free(allocator, cols);
+        bmp_buffer_free(allocator, rows);
+        return NULL;
+    }
+
+    size_t size = image->pixel_size;
+    const uint8_t *source = (const uint8_t*) image->data;
+
+    // Palette indices are copied, colors are masked in the palette
+    bool keepAll = size == 1 || (mask.blue == 0xFF && mask.green == 0xFF && mask.red == 0xFF);
+    if (size == 1) {
+        for (size_t index = 0; index < newImage->colors; index++) {
+            newImage->palette[index].blue &= mask.blue;
+            newImage->palette[index].green &= mask.green;
+            newImage->palette[index].red &= mask.red;
+        }
+    }
+
+    // Columns are taken in order, rows can be copied at once
+    bool copyCols = true;
+    for (size_t w = 1; w < width; w++) {
+        if (cols[w] != cols[0] + w * size) {
+            copyCols = false;
+            break;
+        }
+    }
+
+    for (size_t h = 0; h < height; h++) {
+        uint8_t *row = (uint8_t*) bmp_row(newImage, h);
+        const uint8_t *sourceRow = source + rows[h];
+
+        if (keepAll && copyCols) {
+            memcpy(row, sourceRow + cols[0], width * size);
+        }
+        else if (keepAll) {
+            for (size_t w = 0; w < width; w++) {
+                memcpy(row + w * size, sourceRow + cols[w], size);
+            }
+        }
+        else {
+            // Alpha of 32-bit pixels is kept
+            for (size_t w = 0; w < width; w++) {
+                const uint8_t *pixel = sourceRow + cols[w];
+                row[w * size] = pixel[0] & mask.blue;
+                row[w * size + 1] = pixel[1] & mask.green;
+                row[w * size + 2] = pixel[2] & mask.red;
+                if (size == 4)
+                    row[w * size + 3] = pixel[3];
+            }
+        }
+    }
+
+    bmp_buffer_free(allocator, cols);
+    bmp_buffer_free(allocator, rows);
+
+    return newImage;
+}
+
+/**
+ * Orientation of the image as matrix acting on coordinates relative to the
+ * center, { xx, xy, yx, yy }.
+ */
+static void turn(int32_t* orientation, int32_t xx, int32_t xy, int32_t yx, int32_t yy) {
+    int32_t result[4] = {
+        xx * orientation[0] + xy * orientation[2],
+        xx * orientation[1] + xy * orientation[3],
+        yx * orientation[0] + yy * orientation[2],
+        yx * orientation[1] + yy * orientation[3]
+    };
+    memcpy(orientation, result, sizeof(result));
+}
+
+/**
+ * Adds orientation composed from flips and rotations to the hash and resets
+ * it. Chains which end up in the original orientation add nothing.
+ */
+static uint64_t hash_orientation(uint64_t hash, int32_t* orientation) {
+
+    const int32_t identity[4] = { 1, 0, 0, 1 };
+    if (memcmp(orientation, identity, sizeof(identity)) == 0)
+        return hash;
+
+    uint32_t token[5] = { OP_ROTATE_RIGHT };
+    memcpy(token + 1, orientation, sizeof(identity));
+    memcpy(orientation, identity, sizeof(identity));
+    return bmp_hash_bytes(token, sizeof(token), hash);
+}
+
+uint64_t pipeline_hash(const struct pipeline* pipeline) {
+
+    if (pipeline == NULL)
+        return 0;
+
+    uint64_t hash = 0;
+    int32_t orientation[4] = { 1, 0, 0, 1 };
+    struct pixel mask = { 0xFF, 0xFF, 0xFF };
+
+    for (size_t index = 0; index < pipeline->count; index++) {
+        const struct pipeline_op *op = &pipeline->ops[index];
+
+        switch (op->type) {
+            case OP_FLIP_HORIZONTALLY:
+                turn(orientation, -1, 0, 0, 1);
+                break;
+
+            case OP_FLIP_VERTICALLY:
+                turn(orientation, 1, 0, 0, -1);
+                break;
+
+            case OP_ROTATE_RIGHT:
+                turn(orientation, 0, -1, 1, 0);
+                break;
+
+            case OP_ROTATE_LEFT:
+                turn(orientation, 0, 1, -1, 0);
+                break;
+
+            case OP_CROP: {
+                hash = hash_orientation(hash, orientation);
+                uint32_t token[5] = { OP_CROP, op->start_y, op->start_x, op->height, op->width };
+                hash = bmp_hash_bytes(token, sizeof(token), hash);
+                break;
+            }
+
+            // Scaling by 1 keeps the image
+            case OP_SCALE:
+                if (op->factor != 1) {
+                    hash = hash_orientation(hash, orientation);
+                    uint32_t token[2] = { OP_SCALE };
+                    memcpy(token + 1, &op->factor, sizeof(float));
+                    hash = bmp_hash_bytes(token, sizeof(token), hash);
+                }
+                break;
+
+            // Masks are combined by the run wherever they are
+            case OP_EXTRACT:
+                mask.blue &= op->mask.blue;
+                mask.green &= op->mask.green;
+                mask.red &= op->mask.red;
+                break;
+        }
+    }
+
+    hash = hash_orientation(hash, orientation);
+    uint32_t token[2] = { OP_EXTRACT, (uint32_t) mask.blue | (uint32_t) mask.green << 8 | (uint32_t) mask.red << 16 };
+    return bmp_hash_bytes(token, sizeof(token), hash);
+}
@@ -0,0 +1,164 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include "bmp.h"
+
+
+/**
+ * Types of operations, which can be queued in the pipeline.
+ */
+enum pipeline_op_type {
+    OP_FLIP_HORIZONTALLY,
+    OP_FLIP_VERTICALLY,
+    OP_ROTATE_RIGHT,
+    OP_ROTATE_LEFT,
+    OP_CROP,
+    OP_SCALE,
+    OP_EXTRACT
+};
+
+
+/**
+ * Structure describes one queued operation and its arguments.
+ */
+struct pipeline_op {
+    enum pipeline_op_type type;
+    uint32_t start_y;           // crop
+    uint32_t start_x;           // crop
+    uint32_t height;            // crop
+    uint32_t width;             // crop
+    float factor;               // scale
+    struct pixel mask;          // extract, 0xFF for kept channels
+};
+
+
+/**
+ * Structure describes a chain of operations applied to an image in order.
+ *
+ * All geometric operations only move pixels, so the whole chain is composed
+ * into a single lookup of source pixel for every pixel of the result. Running
+ * the pipeline reads the source once and allocates only the result.
+ */
+struct pipeline {
+    struct pipeline_op* ops;
+    size_t count;
+    size_t capacity;
+};
+
+
+/**
+ * Creates empty pipeline
+ *
+ * @return new pipeline, which has to be freed with `pipeline_free()`
+ */
+struct pipeline* pipeline_create(void);
+
+
+/**
+ * Frees the pipeline from the memory
+ *
+ * @param pipeline the pipeline
+ */
+void pipeline_free(struct pipeline* pipeline);
+
+
+/**
+ * Queues horizontal flip, same as `flip_horizontally()`.
+ *
+ * @param pipeline the pipeline
+ * @return `true` if operation was queued, `false` if pipeline is `NULL`
+ */
+bool pipeline_flip_horizontally(struct pipeline* pipeline);
+
+
+/**
+ * Queues vertical flip, same as `flip_vertically()`.
+ *
+ * @param pipeline the pipeline
+ * @return `true` if operation was queued, `false` if pipeline is `NULL`
+ */
+bool pipeline_flip_vertically(struct pipeline* pipeline);
+
+
+/**
+ * Queues rotation by 90 degrees to the right, same as `rotate_right()`.
+ *
+ * @param pipeline the pipeline
+ * @return `true` if operation was queued, `false` if pipeline is `NULL`
+ */
+bool pipeline_rotate_right(struct pipeline* pipeline);
+
+
+/**
+ * Queues rotation by 90 degrees to the left, same as `rotate_left()`.
+ *
+ * @param pipeline the pipeline
+ * @return `true` if operation was queued, `false` if pipeline is `NULL`
+ */
+bool pipeline_rotate_left(struct pipeline* pipeline);
+
+
+/**
+ * Queues crop, same as `crop()`.
+ *
+ * The area is checked against size of the image produced by previous
+ * operations when the pipeline runs.
+ *
+ * @param pipeline the pipeline
+ * @param start_y top-left corner position on y-axis of selected area
+ * @param start_x top-left corner position on x-axis of selected area
+ * @param height the height of selected area in pixels
+ * @param width the width of selected area in pixels
+ * @return `true` if operation was queued, `false` if pipeline is `NULL` or area size is zero
+ */
+bool pipeline_crop(struct pipeline* pipeline, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width);
+
+
+/**
+ * Queues nearest neighbor scaling, same as `scale()`.
+ *
+ * @param pipeline the pipeline
+ * @param factor the ratio of corresponding sides of original and created image
+ * @return `true` if operation was queued, `false` if pipeline is `NULL` or factor value is not valid
+ */
+bool pipeline_scale(struct pipeline* pipeline, float factor);
+
+
+/**
+ * Queues extraction of color channels, same as `extract()`.
+ *
+ * @param pipeline the pipeline
+ * @param colors_to_keep [bgr],b-blue, g-green, r-red
+ * @return `true` if operation was queued, `false` if pipeline is `NULL` or color definition is not valid
+ */
+bool pipeline_extract(struct pipeline* pipeline, const char* colors_to_keep);
+
+
+/**
+ * Runs all queued operations on the image
+ *
+ * Creates new image, which is the same as the result of calling every queued
+ * operation one after another. The pipeline can be run repeatedly.
+ *
+ * @param pipeline the pipeline
+ * @param image the source image
+ * @return the transformed copy of image or `NULL`, if there is no image or pipeline (NULL given) or a crop area is out of range
+ */
+struct bmp_image* pipeline_run(const struct pipeline* pipeline, const struct bmp_image* image);
+
+
+/**
+ * Computes hash of the queued operations
+ *
+ * Pipelines giving the same result for every image have the same hash:
+ * flips and rotations between other operations are composed into a single
+ * orientation, scaling by 1 is skipped and extractions are combined, so for
+ * example two rotations to the right have the same hash as both flips.
+ * Used with `bmp_hash()` as key of cached results.
+ *
+ * @param pipeline the pipeline
+ * @return the hash or 0 if there is no pipeline (NULL given)
+ */
+uint64_t pipeline_hash(const struct pipeline* pipeline);
+
+#endif
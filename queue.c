@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include "queue.h"
+
+struct queue* queue_create(size_t capacity) {
+
+    if (capacity < 1) {
+        capacity = 1;
+    }
+
+    struct queue *queue = (struct queue*) calloc(1, sizeof(struct queue));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue->items = (void**) calloc(capacity, sizeof(void*));
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->capacity = capacity;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+
+    return queue;
+}
+
+void queue_free(struct queue* queue) {
+    if (queue != NULL) {
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->not_empty);
+        pthread_cond_destroy(&queue->not_full);
+        free(queue->items);
+        free(queue);
+    }
+}
+
+bool queue_push(struct queue* queue, void* item) {
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity && !queue->closed) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+
+    return true;
+}
+
+void* queue_pop(struct queue* queue) {
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+
+    // Closed and empty
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return NULL;
+    }
+
+    void *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+void* queue_try_pop(struct queue* queue, bool* closed) {
+
+    pthread_mutex_lock(&queue->lock);
+
+    void *item = NULL;
+    if (queue->count > 0) {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    *closed = queue->count == 0 && queue->closed;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+void queue_close(struct queue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,82 @@
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+
+/**
+ * Structure describes bounded queue of items passed between threads.
+ * Producers wait while the queue is full, consumers while it's empty, so
+ * faster stage can't run too far ahead of slower one.
+ */
+struct queue {
+    void** items;
+    size_t capacity;
+    size_t head;                // index of the oldest item
+    size_t count;               // number of queued items
+    bool closed;                // no more items will be pushed
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;   // item pushed or queue closed
+    pthread_cond_t not_full;    // item popped or queue closed
+};
+
+
+/**
+ * Creates empty queue
+ *
+ * @param capacity largest number of queued items, at least 1
+ * @return the queue or `NULL` if there is not enough memory
+ */
+struct queue* queue_create(size_t capacity);
+
+
+/**
+ * Frees the queue from the memory, queued items are not freed
+ *
+ * @param queue the queue
+ */
+void queue_free(struct queue* queue);
+
+
+/**
+ * Adds item to the end of the queue, waits while the queue is full
+ *
+ * @param queue the queue
+ * @param item the item
+ * @return `true` if item was queued, `false` if the queue is closed
+ */
+bool queue_push(struct queue* queue, void* item);
+
+
+/**
+ * Takes item from the start of the queue, waits while the queue is empty
+ *
+ * @param queue the queue
+ * @return the oldest item or `NULL` if the queue is closed and empty
+ */
+void* queue_pop(struct queue* queue);
+
+
+/**
+ * Takes item from the start of the queue if there is any
+ *
+ * @param queue the queue
+ * @param closed set to `true` if the queue is closed and empty
+ * @return the oldest item or `NULL` if the queue is empty
+ */
+void* queue_try_pop(struct queue* queue, bool* closed);
+
+
+/**
+ * Closes the queue
+ *
+ * Waiting producers and consumers are woken up. Items which are already
+ * queued can still be taken.
+ *
+ * @param queue the queue
+ */
+void queue_close(struct queue* queue);
+
+#endif
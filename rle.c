@@ -0,0 +1,244 @@
+#include <string.h>
+#include "rle.h"
+#include "alloc.h"
+#include "stats.h"
+
+// Escape codes following zero count
+#define RLE_END_OF_LINE 0x00
+#define RLE_END_OF_BITMAP 0x01
+#define RLE_DELTA 0x02
+
+// Longest run or absolute block
+#define RLE_MAX_RUN 255
+
+// Shortest block stored in absolute mode, shorter ones are runs
+#define RLE_MIN_ABSOLUTE 3
+
+/**
+ * Compressed bytes read from the stream in large chunks.
+ */
+struct rle_input {
+    FILE* stream;
+    uint8_t* buffer;
+    size_t capacity;            // size of the buffer
+    size_t length;              // bytes in the buffer
+    size_t position;            // next byte in the buffer
+    size_t remaining;           // bytes left in the stream
+};
+
+static bool next_byte(struct rle_input* input, uint8_t* byte) {
+
+    // Refill the buffer
+    if (input->position == input->length) {
+        if (input->remaining == 0) {
+            return false;
+        }
+        size_t length = input->remaining < input->capacity ? input->remaining : input->capacity;
+        if (fread(input->buffer, 1, length, input->stream) != length) {
+            return false;
+        }
+        BMP_STAT_READ(length);
+        input->remaining -= length;
+        input->length = length;
+        input->position = 0;
+    }
+
+    *byte = input->buffer[input->position++];
+    return true;
+}
+
+/**
+ * Index of `k`-th pixel of run or absolute block. 4-bit pixels alternate
+ * high and low half of `value`.
+ */
+static uint8_t pixel_index(uint8_t value, size_t k, uint16_t bpp) {
+    if (bpp == 8) {
+        return value;
+    }
+    return k % 2 == 0 ? value >> 4 : value & 0x0F;
+}
+
+bool rle_decode(FILE* stream, size_t size, uint16_t bpp, struct bmp_image* image) {
+
+    if (stream == NULL || image == NULL) {
+        return false;
+    }
+
+    size_t width = image->info.width;
+    size_t height = image->info.height;
+
+    // Skipped pixels are the first color of palette
+    memset(image->data, 0, image->stride * height);
+    if (width == 0 || height == 0) {
+        return true;
+    }
+
+    struct rle_input input = { .stream = stream, .remaining = size };
+    input.capacity = size < IO_CHUNK_SIZE ? size : IO_CHUNK_SIZE;
+    input.buffer = (uint8_t*) bmp_buffer_alloc(image->allocator, input.capacity + 1);
+    if (input.buffer == NULL) {
+        return false;
+    }
+
+    bool done = false;
+    size_t x = 0;
+    size_t y = 0;
+    while (!done) {
+        uint8_t count;
+        uint8_t value;
+        if (!next_byte(&input, &count) || !next_byte(&input, &value)) {
+            break;
+        }
+
+        uint8_t *row = (uint8_t*) bmp_row(image, y);
+
+        // Run of the same index or pair of indices
+        if (count > 0) {
+            size_t end = x + count < width ? x + count : width;
+            if (bpp == 8 && x < end) {
+                memset(row + x, value, end - x);
+            }
+            else {
+                for (size_t k = 0; x + k < end; k++) {
+                    row[x + k] = pixel_index(value, k, bpp);
+                }
+            }
+            x += count;
+            continue;
+        }
+
+        switch (value) {
+            case RLE_END_OF_LINE:
+                x = 0;
+                y++;
+                done = y >= height;
+                break;
+
+            case RLE_END_OF_BITMAP:
+                done = true;
+                break;
+
+            case RLE_DELTA: {
+                uint8_t dx;
+                uint8_t dy;
+                if (!next_byte(&input, &dx) || !next_byte(&input, &dy)) {
+                    bmp_buffer_free(image->allocator, input.buffer);
+                    return false;
+                }
+                x += dx;
+                y += dy;
+                done = y >= height;
+                break;
+            }
+
+            // Absolute block of `value` pixels padded to 2 bytes
+            default: {
+                size_t bytes = bpp == 8 ? value : (value + 1) / 2;
+                size_t k = 0;
+                for (size_t index = 0; index < bytes + bytes % 2; index++) {
+                    uint8_t byte;
+                    if (!next_byte(&input, &byte)) {
+                        bmp_buffer_free(image->allocator, input.buffer);
+                        return false;
+                    }
+                    for (size_t half = 0; half < 8 / bpp && k < value && index < bytes; half++, k++) {
+                        if (x + k < width) {
+                            row[x + k] = pixel_index(byte, half, bpp);
+                        }
+                    }
+                }
+                x += value;
+                break;
+            }
+        }
+    }
+
+    bmp_buffer_free(image->allocator, input.buffer);
+
+    // Data ended before end of bitmap
+    return done;
+}
+
+/**
+ * Number of pixels equal to the first one, at most `RLE_MAX_RUN`.
+ */
+static size_t run_length(const uint8_t* src, size_t count) {
+    size_t length = 1;
+    while (length < count && length < RLE_MAX_RUN && src[length] == src[0]) {
+        length++;
+    }
+    return length;
+}
+
+static void put(uint8_t* dest, size_t* size, uint8_t byte) {
+    if (dest != NULL) {
+        dest[*size] = byte;
+    }
+    (*size)++;
+}
+
+/**
+ * Stores run of `count` pixels of `index`.
+ */
+static void put_run(uint8_t* dest, size_t* size, size_t count, uint8_t index, uint16_t bpp) {
+    put(dest, size, count);
+    put(dest, size, bpp == 8 ? index : (index & 0x0F) * 0x11);
+}
+
+size_t rle_encode_row(uint8_t* dest, const uint8_t* src, size_t width, uint16_t bpp, bool last) {
+
+    size_t size = 0;
+    size_t w = 0;
+
+    while (w < width) {
+        size_t run = run_length(src + w, width - w);
+        if (run >= RLE_MIN_ABSOLUTE) {
+            put_run(dest, &size, run, src[w], bpp);
+            w += run;
+            continue;
+        }
+
+        // Pixels up to the next run worth encoding
+        size_t literal = 1;
+        while (w + literal < width && literal < RLE_MAX_RUN && run_length(src + w + literal, width - w - literal) < RLE_MIN_ABSOLUTE) {
+            literal++;
+        }
+
+        // Absolute block needs at least 3 pixels
+        if (literal < RLE_MIN_ABSOLUTE) {
+            for (size_t k = 0; k < literal; ) {
+                size_t short_run = run_length(src + w + k, literal - k);
+                put_run(dest, &size, short_run, src[w + k], bpp);
+                k += short_run;
+            }
+            w += literal;
+            continue;
+        }
+
+        put(dest, &size, 0);
+        put(dest, &size, literal);
+        size_t bytes = 0;
+        if (bpp == 8) {
+            for (size_t k = 0; k < literal; k++) {
+                put(dest, &size, src[w + k]);
+            }
+            bytes = literal;
+        }
+        else {
+            for (size_t k = 0; k < literal; k += 2) {
+                uint8_t low = k + 1 < literal ? src[w + k + 1] & 0x0F : 0;
+                put(dest, &size, (src[w + k] & 0x0F) << 4 | low);
+            }
+            bytes = (literal + 1) / 2;
+        }
+        if (bytes % 2 != 0) {
+            put(dest, &size, 0);
+        }
+        w += literal;
+    }
+
+    put(dest, &size, 0);
+    put(dest, &size, last ? RLE_END_OF_BITMAP : RLE_END_OF_LINE);
+
+    return size;
+}
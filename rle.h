@@ -0,0 +1,55 @@
+#ifndef _RLE_H
+#define _RLE_H
+
+#include "bmp.h"
+
+// Largest number of pixels of compressed files which are read, size of the
+// file doesn't bound them, a flat image is a few bytes
+#define RLE_MAX_PIXELS ((uint64_t) 1 << 28)
+
+
+/**
+ * Decodes RLE compressed pixels
+ *
+ * Reads `size` bytes of `BI_RLE8` (`bpp` 8) or `BI_RLE4` (`bpp` 4) data from
+ * the current position of the stream in large chunks and stores one palette
+ * index per byte to the rows of `image`. Pixels skipped by the data are 0.
+ * Runs reaching out of the image are clipped.
+ *
+ * @param stream opened stream at the first byte of compressed pixels
+ * @param size number of bytes of compressed pixels
+ * @param bpp bits per pixel of the file (4 or 8)
+ * @param image image with 1 byte per pixel, which rows are written
+ * @return `true` if all data were read, `false` if they are truncated or there is not enough memory
+ */
+bool rle_decode(FILE* stream, size_t size, uint16_t bpp, struct bmp_image* image);
+
+
+/**
+ * Encodes one row of palette indices
+ *
+ * Repeated indices are stored as runs, others in absolute mode. The row is
+ * terminated with end of line, the last row with end of bitmap. If `dest` is
+ * `NULL`, only size of the encoded row is computed.
+ *
+ * @param dest buffer for at least `rle_row_limit(width)` bytes or `NULL`
+ * @param src `width` palette indices
+ * @param width number of pixels of the row
+ * @param bpp bits per pixel of the file (4 or 8)
+ * @param last `true` for the last row of the image
+ * @return number of bytes of the encoded row
+ */
+size_t rle_encode_row(uint8_t* dest, const uint8_t* src, size_t width, uint16_t bpp, bool last);
+
+
+/**
+ * Returns the largest size of encoded row
+ *
+ * @param width number of pixels of the row
+ * @return number of bytes `rle_encode_row()` writes at most
+ */
+static inline size_t rle_row_limit(size_t width) {
+    return 2 * width + 4;
+}
+
+#endif
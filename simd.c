@@ -0,0 +1,246 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+// Least common multiple of pixel sizes and size of the widest vector
+#define PATTERN_SIZE 96
+
+// Bytes looked up by one step of the vector kernel
+#define LOOKUP_VECTOR 32
+
+typedef void (*mask_kernel)(uint8_t* dest, const uint8_t* src, size_t size, const uint8_t* pattern);
+typedef void (*reverse_kernel)(struct pixel* dest, const struct pixel* src, size_t count);
+typedef void (*accumulate_kernel)(int32_t* sum, const uint8_t* src, size_t count, int32_t weight);
+typedef void (*lookup_kernel)(uint8_t* dest, const uint8_t* src, size_t count, const uint8_t* table);
+
+static void mask_scalar(uint8_t* dest, const uint8_t* src, size_t size, const uint8_t* pattern) {
+    for (size_t index = 0; index < size; index++) {
+        dest[index] = src[index] & pattern[index % PATTERN_SIZE];
+    }
+}
+
+static void reverse_scalar(struct pixel* dest, const struct pixel* src, size_t count) {
+    for (size_t index = 0; index < count; index++) {
+        dest[index] = src[count - 1 - index];
+    }
+}
+
+static void accumulate_scalar(int32_t* sum, const uint8_t* src, size_t count, int32_t weight) {
+    for (size_t index = 0; index < count; index++) {
+        sum[index] += src[index] * weight;
+    }
+}
+
+static void lookup_scalar(uint8_t* dest, const uint8_t* src, size_t count, const uint8_t* table) {
+    for (size_t index = 0; index < count; index++) {
+        dest[index] = table[src[index]];
+    }
+}
+
+#ifdef SIMD_X86
+
+/**
+ * Masks 48 bytes (16 pixels) at once, pattern repeats every three vectors.
+ */
+__attribute__((target("sse2")))
+static void mask_sse2(uint8_t* dest, const uint8_t* src, size_t size, const uint8_t* pattern) {
+    __m128i mask0 = _mm_loadu_si128((const __m128i*) pattern);
+    __m128i mask1 = _mm_loadu_si128((const __m128i*) (pattern + 16));
+    __m128i mask2 = _mm_loadu_si128((const __m128i*) (pattern + 32));
+
+    size_t index = 0;
+    for (; index + 48 <= size; index += 48) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (src + index));
+        __m128i b = _mm_loadu_si128((const __m128i*) (src + index + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*) (src + index + 32));
+        _mm_storeu_si128((__m128i*) (dest + index), _mm_and_si128(a, mask0));
+        _mm_storeu_si128((__m128i*) (dest + index + 16), _mm_and_si128(b, mask1));
+        _mm_storeu_si128((__m128i*) (dest + index + 32), _mm_and_si128(c, mask2));
+    }
+
+    // Blocks are multiples of pixel sizes, so the pattern continues from start
+    mask_scalar(dest + index, src + index, size - index, pattern);
+}
+
+/**
+ * Masks 96 bytes (32 pixels) at once, pattern repeats every three vectors.
+ */
+__attribute__((target("avx2")))
+static void mask_avx2(uint8_t* dest, const uint8_t* src, size_t size, const uint8_t* pattern) {
+    __m256i mask0 = _mm256_loadu_si256((const __m256i*) pattern);
+    __m256i mask1 = _mm256_loadu_si256((const __m256i*) (pattern + 32));
+    __m256i mask2 = _mm256_loadu_si256((const __m256i*) (pattern + 64));
+
+    size_t index = 0;
+    for (; index + 96 <= size; index += 96) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (src + index));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (src + index + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*) (src + index + 64));
+        _mm256_storeu_si256((__m256i*) (dest + index), _mm256_and_si256(a, mask0));
+        _mm256_storeu_si256((__m256i*) (dest + index + 32), _mm256_and_si256(b, mask1));
+        _mm256_storeu_si256((__m256i*) (dest + index + 64), _mm256_and_si256(c, mask2));
+    }
+
+    mask_sse2(dest + index, src + index, size - index, pattern);
+}
+
+/**
+ * Reverses 5 pixels (15 bytes) with one shuffle. Vector is loaded one byte
+ * before the source pixels and stored with one extra byte after the result
+ * pixels, so both stay inside the buffers while another pixel follows.
+ * The extra byte is overwritten by the next block.
+ */
+__attribute__((target("ssse3")))
+static void reverse_ssse3(struct pixel* dest, const struct pixel* src, size_t count) {
+    const __m128i order = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, 0);
+    const uint8_t *source = (const uint8_t*) src;
+    uint8_t *result = (uint8_t*) dest;
+
+    size_t index = 0;
+    for (; index + 6 <= count; index += 5) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (source + (count - index - 5) * 3 - 1));
+        _mm_storeu_si128((__m128i*) (result + index * 3), _mm_shuffle_epi8(block, order));
+    }
+
+    for (; index < count; index++) {
+        dest[index] = src[count - 1 - index];
+    }
+}
+
+/**
+ * Adds 16 weighted bytes at once, bytes are widened to 32-bit lanes.
+ */
+__attribute__((target("avx2")))
+static void accumulate_avx2(int32_t* sum, const uint8_t* src, size_t count, int32_t weight) {
+    __m256i factor = _mm256_set1_epi32(weight);
+
+    size_t index = 0;
+    for (; index + 16 <= count; index += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) (src + index));
+        __m256i low = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(bytes), factor);
+        __m256i high = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)), factor);
+        __m256i *dest = (__m256i*) (sum + index);
+        _mm256_storeu_si256(dest, _mm256_add_epi32(_mm256_loadu_si256(dest), low));
+        _mm256_storeu_si256(dest + 1, _mm256_add_epi32(_mm256_loadu_si256(dest + 1), high));
+    }
+
+    accumulate_scalar(sum + index, src + index, count - index, weight);
+}
+
+/**
+ * Looks up 32 bytes at once. Every 16 entries of the table are shuffled by
+ * low nibbles of the bytes and kept where the high nibble selects them.
+ */
+__attribute__((target("avx2")))
+static void lookup_avx2(uint8_t* dest, const uint8_t* src, size_t count, const uint8_t* table) {
+    __m256i rows[16];
+    for (size_t row = 0; row < 16; row++) {
+        rows[row] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) (table + row * 16)));
+    }
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    size_t index = 0;
+    for (; index + 32 <= count; index += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*) (src + index));
+        __m256i low = _mm256_and_si256(bytes, nibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+
+        __m256i result = _mm256_setzero_si256();
+        for (int row = 0; row < 16; row++) {
+            __m256i selected = _mm256_cmpeq_epi8(high, _mm256_set1_epi8(row));
+            result = _mm256_or_si256(result, _mm256_and_si256(_mm256_shuffle_epi8(rows[row], low), selected));
+        }
+        _mm256_storeu_si256((__m256i*) (dest + index), result);
+    }
+
+    lookup_scalar(dest + index, src + index, count - index, table);
+}
+
+#endif
+
+static mask_kernel mask_impl = mask_scalar;
+static reverse_kernel reverse_impl = reverse_scalar;
+static accumulate_kernel accumulate_impl = accumulate_scalar;
+static lookup_kernel lookup_impl = lookup_scalar;
+static pthread_once_t dispatch = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the fastest kernels supported by the CPU.
+ */
+static void select_kernels(void) {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    mask_impl = __builtin_cpu_supports("avx2") ? mask_avx2 : mask_sse2;
+    if (__builtin_cpu_supports("ssse3")) {
+        reverse_impl = reverse_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        accumulate_impl = accumulate_avx2;
+        lookup_impl = lookup_avx2;
+    }
+#endif
+}
+
+void mask_pixels(struct pixel* dest, const struct pixel* src, size_t count, struct pixel mask) {
+
+    pthread_once(&dispatch, select_kernels);
+
+    // Mask repeated over the widest vector
+    uint8_t pattern[PATTERN_SIZE];
+    for (size_t index = 0; index < PATTERN_SIZE; index += 3) {
+        pattern[index] = mask.blue;
+        pattern[index + 1] = mask.green;
+        pattern[index + 2] = mask.red;
+    }
+
+    mask_impl((uint8_t*) dest, (const uint8_t*) src, count * sizeof(struct pixel), pattern);
+}
+
+void reverse_pixels(struct pixel* dest, const struct pixel* src, size_t count) {
+
+    pthread_once(&dispatch, select_kernels);
+
+    reverse_impl(dest, src, count);
+}
+
+void mask_bgra(uint8_t* dest, const uint8_t* src, size_t count, struct pixel mask) {
+
+    pthread_once(&dispatch, select_kernels);
+
+    // Mask repeated over the widest vector, alpha is kept
+    uint8_t pattern[PATTERN_SIZE];
+    for (size_t index = 0; index < PATTERN_SIZE; index += 4) {
+        pattern[index] = mask.blue;
+        pattern[index + 1] = mask.green;
+        pattern[index + 2] = mask.red;
+        pattern[index + 3] = 0xFF;
+    }
+
+    mask_impl(dest, src, count * 4, pattern);
+}
+
+void accumulate_bytes(int32_t* sum, const uint8_t* src, size_t count, int32_t weight) {
+
+    pthread_once(&dispatch, select_kernels);
+
+    accumulate_impl(sum, src, count, weight);
+}
+
+void lookup_bytes(uint8_t* dest, const uint8_t* src, size_t count, const uint8_t* table) {
+
+    // Rows shorter than a vector are looked up faster than they are dispatched
+    if (count < LOOKUP_VECTOR) {
+        lookup_scalar(dest, src, count, table);
+        return;
+    }
+
+    pthread_once(&dispatch, select_kernels);
+
+    lookup_impl(dest, src, count, table);
+}
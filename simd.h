@@ -0,0 +1,77 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include "bmp.h"
+
+
+/**
+ * Masks channels of pixels
+ *
+ * Stores `src[i]` with every channel ANDed with the same channel of `mask`
+ * to `dest[i]`. Uses AVX2 or SSE2 kernel when CPU supports it, plain loop
+ * otherwise. Buffers may be the same, but must not overlap otherwise.
+ *
+ * @param dest buffer for `count` pixels
+ * @param src `count` source pixels
+ * @param count number of pixels
+ * @param mask mask applied to every pixel
+ */
+void mask_pixels(struct pixel* dest, const struct pixel* src, size_t count, struct pixel mask);
+
+
+/**
+ * Masks color channels of 32-bit pixels
+ *
+ * Same as `mask_pixels()` for pixels stored as blue, green, red and alpha
+ * bytes. Alpha is kept.
+ *
+ * @param dest buffer for `count` pixels
+ * @param src `count` source pixels
+ * @param count number of pixels
+ * @param mask mask applied to color channels of every pixel
+ */
+void mask_bgra(uint8_t* dest, const uint8_t* src, size_t count, struct pixel mask);
+
+
+/**
+ * Reverses order of pixels
+ *
+ * Stores `src[count - 1 - i]` to `dest[i]`. Uses SSSE3 kernel when CPU
+ * supports it, plain loop otherwise. Buffers must not overlap.
+ *
+ * @param dest buffer for `count` pixels
+ * @param src `count` source pixels
+ * @param count number of pixels
+ */
+void reverse_pixels(struct pixel* dest, const struct pixel* src, size_t count);
+
+
+/**
+ * Adds weighted bytes to sums
+ *
+ * Stores `sum[i] + src[i] * weight` to `sum[i]`. Uses AVX2 kernel when CPU
+ * supports it, plain loop otherwise. Sums must not overflow.
+ *
+ * @param sum `count` sums
+ * @param src `count` bytes
+ * @param count number of sums
+ * @param weight weight of every byte
+ */
+void accumulate_bytes(int32_t* sum, const uint8_t* src, size_t count, int32_t weight);
+
+
+/**
+ * Looks up bytes in table
+ *
+ * Stores `table[src[i]]` to `dest[i]`. Uses AVX2 kernel when CPU supports
+ * it, plain loop otherwise. Buffers may be the same, but must not overlap
+ * otherwise.
+ *
+ * @param dest buffer for `count` bytes
+ * @param src `count` source bytes
+ * @param count number of bytes
+ * @param table 256 entries of the table
+ */
+void lookup_bytes(uint8_t* dest, const uint8_t* src, size_t count, const uint8_t* table);
+
+#endif
@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+static const char* const names[BMP_STAT_COUNT] = {
+    "other",
+    "read_bmp",
+    "read_bmp_mmap",
+    "read_bmp_header",
+    "bmp_probe",
+    "read_data",
+    "write_bmp",
+    "write_bmp_rle",
+    "flip_horizontally",
+    "flip_vertically",
+    "rotate_right",
+    "rotate_left",
+    "rotate_180",
+    "crop",
+    "crop_view",
+    "resample",
+    "extract",
+    "affine",
+    "rotate",
+    "convolve",
+    "box_blur",
+    "gaussian_blur",
+    "unsharp_mask",
+    "bmp_histogram",
+    "adjust_colors",
+    "adjust_colors_inplace",
+    "bmp_hash",
+    "flip_horizontally_inplace",
+    "flip_vertically_inplace",
+    "rotate_right_inplace",
+    "rotate_left_inplace",
+    "rotate_180_inplace",
+    "crop_inplace",
+    "extract_inplace",
+    "pipeline_run"
+};
+
+// Counters of the process, updated atomically by all threads
+static struct bmp_stats totals;
+
+// Operation running in the thread
+static _Thread_local enum bmp_stat_op current = BMP_STAT_OTHER;
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+static void add(uint64_t* counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+struct bmp_stat_scope bmp_stat_enter(enum bmp_stat_op op) {
+    struct bmp_stat_scope scope = { .op = op, .outer = current, .start = now_ns() };
+    current = op;
+    return scope;
+}
+
+void bmp_stat_leave(struct bmp_stat_scope* scope) {
+    struct bmp_op_stats *stats = &totals.ops[scope->op];
+    add(&stats->calls, 1);
+    add(&stats->nanoseconds, now_ns() - scope->start);
+    current = scope->outer;
+}
+
+void bmp_stat_count(enum bmp_stat_counter counter, uint64_t value) {
+    struct bmp_op_stats *stats = &totals.ops[current];
+
+    switch (counter) {
+        case BMP_COUNT_READ:
+            add(&stats->bytes_read, value);
+            break;
+        case BMP_COUNT_WRITTEN:
+            add(&stats->bytes_written, value);
+            break;
+        case BMP_COUNT_ALLOCATED:
+            add(&stats->allocations, 1);
+            add(&stats->bytes_allocated, value);
+            break;
+        case BMP_COUNT_PIXELS:
+            add(&stats->pixels, value);
+            break;
+    }
+}
+
+const char* bmp_stats_name(enum bmp_stat_op op) {
+    return op < BMP_STAT_COUNT ? names[op] : "unknown";
+}
+
+void bmp_stats_get(struct bmp_stats* stats) {
+
+    if (stats == NULL) {
+        return;
+    }
+
+    uint64_t *dest = (uint64_t*) stats;
+    uint64_t *src = (uint64_t*) &totals;
+    for (size_t index = 0; index < sizeof(struct bmp_stats) / sizeof(uint64_t); index++) {
+        dest[index] = __atomic_load_n(&src[index], __ATOMIC_RELAXED);
+    }
+}
+
+void bmp_stats_reset(void) {
+    uint64_t *counters = (uint64_t*) &totals;
+    for (size_t index = 0; index < sizeof(struct bmp_stats) / sizeof(uint64_t); index++) {
+        __atomic_store_n(&counters[index], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void bmp_stats_dump(FILE* stream) {
+
+    if (stream == NULL) {
+        return;
+    }
+
+    struct bmp_stats stats;
+    bmp_stats_get(&stats);
+
+    fprintf(stream, "%-26s %8s %10s %10s %10s %10s %8s %10s %10s\n", "operation", "calls", "total ms", "avg us",
+            "read MB", "written MB", "allocs", "alloc MB", "Mpx");
+
+    for (size_t op = 0; op < BMP_STAT_COUNT; op++) {
+        const struct bmp_op_stats *counters = &stats.ops[op];
+        if (counters->calls == 0 && counters->allocations == 0) {
+            continue;
+        }
+
+        double calls = counters->calls > 0 ? counters->calls : 1;
+        fprintf(stream, "%-26s %8llu %10.3f %10.3f %10.3f %10.3f %8llu %10.3f %10.3f\n", names[op],
+                (unsigned long long) counters->calls, counters->nanoseconds / 1e6, counters->nanoseconds / 1e3 / calls,
+                counters->bytes_read / 1e6, counters->bytes_written / 1e6, (unsigned long long) counters->allocations,
+                counters->bytes_allocated / 1e6, counters->pixels / 1e6);
+    }
+}
+
+#ifdef BMP_STATS
+
+static void dump_at_exit(void) {
+
+    const char *target = getenv("BMP_STATS");
+    if (target == NULL || *target == '\0') {
+        return;
+    }
+
+    if (strcmp(target, "1") == 0 || strcmp(target, "stderr") == 0) {
+        bmp_stats_dump(stderr);
+        return;
+    }
+
+    FILE *stream = fopen(target, "a");
+    if (stream == NULL) {
+        fprintf(stderr, "Error: Can't open '%s' for statistics.\n", target);
+        return;
+    }
+    bmp_stats_dump(stream);
+    fclose(stream);
+}
+
+/**
+ * Registers the dump before `main()` runs, only if it was asked for.
+ */
+__attribute__((constructor)) static void register_dump(void) {
+    const char *target = getenv("BMP_STATS");
+    if (target != NULL && *target != '\0') {
+        atexit(dump_at_exit);
+    }
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/**
+ * Operations measured by the instrumentation. Work done outside of them
+ * (for example allocations of the batch driver) is counted as
+ * `BMP_STAT_OTHER`.
+ */
+enum bmp_stat_op {
+    BMP_STAT_OTHER,
+    BMP_STAT_READ_BMP,
+    BMP_STAT_READ_BMP_MMAP,
+    BMP_STAT_READ_BMP_HEADER,
+    BMP_STAT_PROBE,
+    BMP_STAT_READ_DATA,
+    BMP_STAT_WRITE_BMP,
+    BMP_STAT_WRITE_BMP_RLE,
+    BMP_STAT_FLIP_HORIZONTALLY,
+    BMP_STAT_FLIP_VERTICALLY,
+    BMP_STAT_ROTATE_RIGHT,
+    BMP_STAT_ROTATE_LEFT,
+    BMP_STAT_ROTATE_180,
+    BMP_STAT_CROP,
+    BMP_STAT_CROP_VIEW,
+    BMP_STAT_RESAMPLE,
+    BMP_STAT_EXTRACT,
+    BMP_STAT_AFFINE,
+    BMP_STAT_ROTATE,
+    BMP_STAT_CONVOLVE,
+    BMP_STAT_BOX_BLUR,
+    BMP_STAT_GAUSSIAN_BLUR,
+    BMP_STAT_UNSHARP_MASK,
+    BMP_STAT_HISTOGRAM,
+    BMP_STAT_ADJUST_COLORS,
+    BMP_STAT_ADJUST_COLORS_INPLACE,
+    BMP_STAT_HASH,
+    BMP_STAT_FLIP_HORIZONTALLY_INPLACE,
+    BMP_STAT_FLIP_VERTICALLY_INPLACE,
+    BMP_STAT_ROTATE_RIGHT_INPLACE,
+    BMP_STAT_ROTATE_LEFT_INPLACE,
+    BMP_STAT_ROTATE_180_INPLACE,
+    BMP_STAT_CROP_INPLACE,
+    BMP_STAT_EXTRACT_INPLACE,
+    BMP_STAT_PIPELINE_RUN,
+    BMP_STAT_COUNT
+};
+
+
+/**
+ * Counters of one operation. Time and counters of nested calls (for
+ * example `write_bmp()` called by `write_bmp_rle()`) belong to the nested
+ * operation, time of the outer one includes them.
+ */
+struct bmp_op_stats {
+    uint64_t calls;
+    uint64_t nanoseconds;       // wall time of all calls
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t allocations;       // buffers taken from the allocator or the system
+    uint64_t bytes_allocated;
+    uint64_t pixels;            // pixels of processed images
+};
+
+
+/**
+ * Structure contains counters of all operations of the process.
+ */
+struct bmp_stats {
+    struct bmp_op_stats ops[BMP_STAT_COUNT];
+};
+
+
+/**
+ * Returns name of the operation
+ *
+ * @param op the operation
+ * @return name of the function, "other" for `BMP_STAT_OTHER`
+ */
+const char* bmp_stats_name(enum bmp_stat_op op);
+
+
+/**
+ * Copies current counters
+ *
+ * Counters are updated by all threads, the copy is not a consistent
+ * snapshot while operations run. Without instrumentation (`BMP_STATS` not
+ * defined at compile time) all counters are zero.
+ *
+ * @param stats where counters are copied
+ */
+void bmp_stats_get(struct bmp_stats* stats);
+
+
+/**
+ * Sets all counters to zero
+ */
+void bmp_stats_reset(void);
+
+
+/**
+ * Prints table of operations which were called
+ *
+ * If environment variable `BMP_STATS` is set, the table is printed when the
+ * process exits, to stderr for value "1" or "stderr", otherwise it's
+ * appended to file of that name.
+ *
+ * @param stream where the table is printed
+ */
+void bmp_stats_dump(FILE* stream);
+
+
+/**
+ * Kinds of counters added to the current operation of the thread.
+ */
+enum bmp_stat_counter {
+    BMP_COUNT_READ,
+    BMP_COUNT_WRITTEN,
+    BMP_COUNT_ALLOCATED,
+    BMP_COUNT_PIXELS
+};
+
+
+/**
+ * Measured call, the previous operation of the thread is restored when it
+ * ends.
+ */
+struct bmp_stat_scope {
+    enum bmp_stat_op op;
+    enum bmp_stat_op outer;
+    uint64_t start;
+};
+
+struct bmp_stat_scope bmp_stat_enter(enum bmp_stat_op op);
+void bmp_stat_leave(struct bmp_stat_scope* scope);
+void bmp_stat_count(enum bmp_stat_counter counter, uint64_t value);
+
+
+/**
+ * Instrumentation of hot paths, removed unless compiled with `BMP_STATS`.
+ * `BMP_STAT_SCOPE()` measures the rest of the block it's declared in, so
+ * every return of the function is counted.
+ */
+#ifdef BMP_STATS
+#define BMP_STAT_SCOPE(op) \
+    struct bmp_stat_scope bmp_stat_scope_ __attribute__((cleanup(bmp_stat_leave))) = bmp_stat_enter(op)
+#define BMP_STAT_READ(bytes) bmp_stat_count(BMP_COUNT_READ, (bytes))
+#define BMP_STAT_WRITTEN(bytes) bmp_stat_count(BMP_COUNT_WRITTEN, (bytes))
+#define BMP_STAT_ALLOCATED(bytes) bmp_stat_count(BMP_COUNT_ALLOCATED, (bytes))
+#define BMP_STAT_PIXELS(count) bmp_stat_count(BMP_COUNT_PIXELS, (count))
+#else
+#define BMP_STAT_SCOPE(op) ((void) 0)
+#define BMP_STAT_READ(bytes) ((void) 0)
+#define BMP_STAT_WRITTEN(bytes) ((void) 0)
+#define BMP_STAT_ALLOCATED(bytes) ((void) 0)
+#define BMP_STAT_PIXELS(count) ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,422 @@
+#include <string.h>
+#include <math.h>
+#include "stream.h"
+#include "filter.h"
+#include "transformations.h"
+#include "simd.h"
+
+/**
+ * Describes how rows and columns of result are taken from the source. Result
+ * row `r` comes from source row `row_offset + (r * source_rows) / height`
+ * (counted from the end if `reverse_rows` is set), columns are mapped the same
+ * way. Every channel is masked with `mask`.
+ */
+struct row_plan {
+    uint32_t width;
+    uint32_t height;
+    uint32_t row_offset;
+    uint32_t source_rows;
+    bool reverse_rows;
+    uint32_t col_offset;
+    uint32_t source_cols;
+    bool reverse_cols;
+    struct pixel mask;
+};
+
+struct bmp_reader* bmp_reader_open(FILE* stream) {
+
+    // Check stream
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    // Rows are streamed as they are, only 24-bit images are supported
+    struct bmp_header *header = read_bmp_header(stream);
+    if (header == NULL || header->bpp != BPP || header->compression != BI_RGB) {
+        free(header);
+        return NULL;
+    }
+
+    if (!bmp_check_size(stream, header)) {
+        free(header);
+        return NULL;
+    }
+
+    struct bmp_reader *reader = (struct bmp_reader*) calloc(1, sizeof(struct bmp_reader));
+    if (reader == NULL) {
+        free(header);
+        return NULL;
+    }
+    reader->stream = stream;
+    reader->header = header;
+    reader->row_size = (size_t) header->width * sizeof(struct pixel);
+    reader->stride_size = bmp_stride(header->width, BPP);
+    reader->next_row = 0;
+    reader->buffer = (uint8_t*) malloc(reader->stride_size + 1);
+    if (reader->buffer == NULL) {
+        bmp_reader_close(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+bool bmp_read_row(struct bmp_reader* reader, uint32_t row, struct pixel* dest) {
+
+    if (reader == NULL || dest == NULL || row >= reader->header->height) {
+        return false;
+    }
+
+    // Seek only when rows are not read in order
+    if (row != reader->next_row) {
+        if (fseek(reader->stream, reader->header->offset + (long) row * reader->stride_size, SEEK_SET) != 0) {
+            return false;
+        }
+    }
+
+    if (fread(reader->buffer, reader->stride_size, 1, reader->stream) != 1) {
+        reader->next_row = reader->header->height;
+        return false;
+    }
+    memcpy(dest, reader->buffer, reader->row_size);
+    reader->next_row = row + 1;
+
+    return true;
+}
+
+void bmp_reader_close(struct bmp_reader* reader) {
+    if (reader != NULL) {
+        free(reader->header);
+        free(reader->buffer);
+        free(reader);
+    }
+}
+
+struct bmp_writer* bmp_writer_open(FILE* stream, uint32_t width, uint32_t height) {
+
+    // Check stream
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    struct bmp_writer *writer = (struct bmp_writer*) calloc(1, sizeof(struct bmp_writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->stream = stream;
+    writer->row_size = (size_t) width * sizeof(struct pixel);
+    writer->stride_size = bmp_stride(width, BPP);
+
+    // Padding stays zero
+    writer->buffer = (uint8_t*) calloc(writer->stride_size + 1, 1);
+    if (writer->buffer == NULL) {
+        free(writer);
+        return NULL;
+    }
+
+    // Make header
+    writer->header.type = TYPE;
+    writer->header.width = width;
+    writer->header.height = height;
+    writer->header.image_size = writer->stride_size * height;
+    writer->header.size = writer->header.image_size + OFFSET;
+    writer->header.offset = OFFSET;
+    writer->header.dib_size = DIB_SIZE;
+    writer->header.planes = PLANES;
+    writer->header.bpp = BPP;
+
+    if (fwrite(&writer->header, sizeof(struct bmp_header), 1, stream) != 1) {
+        free(writer->buffer);
+        free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+bool bmp_write_row(struct bmp_writer* writer, const struct pixel* src) {
+
+    if (writer == NULL || src == NULL || writer->rows_written >= writer->header.height) {
+        return false;
+    }
+
+    memcpy(writer->buffer, src, writer->row_size);
+    if (fwrite(writer->buffer, writer->stride_size, 1, writer->stream) != 1) {
+        return false;
+    }
+    writer->rows_written++;
+
+    return true;
+}
+
+bool bmp_writer_close(struct bmp_writer* writer) {
+
+    if (writer == NULL) {
+        return false;
+    }
+
+    bool complete = writer->rows_written == writer->header.height;
+    free(writer->buffer);
+    free(writer);
+
+    return complete;
+}
+
+/**
+ * Reads rows of the source, maps them according to the plan and writes
+ * them to the output. Keeps one source row and one result row in memory.
+ */
+static bool run_plan(struct bmp_reader* reader, FILE* output, const struct row_plan* plan) {
+
+    struct bmp_writer *writer = bmp_writer_open(output, plan->width, plan->height);
+    if (writer == NULL) {
+        return false;
+    }
+
+    // Alloc rows and column table
+    struct pixel *source = (struct pixel*) malloc(reader->row_size + 1);
+    struct pixel *row = (struct pixel*) malloc(writer->row_size + 1);
+    uint32_t *cols = (uint32_t*) malloc(((size_t) plan->width + 1) * sizeof(uint32_t));
+    bool ok = source != NULL && row != NULL && cols != NULL;
+
+    // Column of source for every column of result
+    bool copyCols = !plan->reverse_cols && plan->source_cols == plan->width;
+    for (size_t w = 0; ok && w < plan->width; w++) {
+        size_t index = plan->reverse_cols ? plan->width - 1 - w : w;
+        cols[w] = plan->col_offset + (index * plan->source_cols) / plan->width;
+    }
+    bool keepAll = plan->mask.blue == 0xFF && plan->mask.green == 0xFF && plan->mask.red == 0xFF;
+
+    int64_t loaded = -1;
+    for (size_t h = 0; ok && h < plan->height; h++) {
+        size_t index = plan->reverse_rows ? plan->height - 1 - h : h;
+        uint32_t sourceRow = plan->row_offset + (index * plan->source_rows) / plan->height;
+
+        // Upscaled rows are read only once
+        if (sourceRow != loaded) {
+            ok = bmp_read_row(reader, sourceRow, source);
+            loaded = sourceRow;
+        }
+
+        if (copyCols && keepAll) {
+            ok = ok && bmp_write_row(writer, source + plan->col_offset);
+            continue;
+        }
+
+        for (size_t w = 0; w < plan->width; w++) {
+            row[w].blue = source[cols[w]].blue & plan->mask.blue;
+            row[w].green = source[cols[w]].green & plan->mask.green;
+            row[w].red = source[cols[w]].red & plan->mask.red;
+        }
+        ok = ok && bmp_write_row(writer, row);
+    }
+
+    free(source);
+    free(row);
+    free(cols);
+
+    return bmp_writer_close(writer) && ok;
+}
+
+/**
+ * Plan which copies the whole image as it is.
+ */
+static struct row_plan identity_plan(const struct bmp_header* header) {
+    struct row_plan plan = {
+        .width = header->width,
+        .height = header->height,
+        .source_rows = header->height,
+        .source_cols = header->width,
+        .mask = { 0xFF, 0xFF, 0xFF }
+    };
+    return plan;
+}
+
+bool stream_flip_horizontally(FILE* input, FILE* output) {
+
+    if (output == NULL)
+        return false;
+
+    struct bmp_reader *reader = bmp_reader_open(input);
+    if (reader == NULL)
+        return false;
+
+    struct row_plan plan = identity_plan(reader->header);
+    plan.reverse_cols = true;
+
+    bool ret = run_plan(reader, output, &plan);
+    bmp_reader_close(reader);
+
+    return ret;
+}
+
+bool stream_flip_vertically(FILE* input, FILE* output) {
+
+    if (output == NULL)
+        return false;
+
+    struct bmp_reader *reader = bmp_reader_open(input);
+    if (reader == NULL)
+        return false;
+
+    struct row_plan plan = identity_plan(reader->header);
+    plan.reverse_rows = true;
+
+    bool ret = run_plan(reader, output, &plan);
+    bmp_reader_close(reader);
+
+    return ret;
+}
+
+bool stream_scale(FILE* input, FILE* output, float factor) {
+
+    if (output == NULL || factor <= 0)
+        return false;
+
+    struct bmp_reader *reader = bmp_reader_open(input);
+    if (reader == NULL)
+        return false;
+
+    // Get source size data
+    size_t source_height = reader->header->height;
+    size_t source_width = reader->header->width;
+
+    struct row_plan plan = identity_plan(reader->header);
+    if (factor != 1) {
+        plan.width = round(source_width * factor);
+        plan.height = round(source_height * factor);
+    }
+
+    // Rows of empty result can't be written, the file would be truncated
+    if (plan.width == 0 || plan.height == 0) {
+        bmp_reader_close(reader);
+        return false;
+    }
+
+    bool ret = run_plan(reader, output, &plan);
+    bmp_reader_close(reader);
+
+    return ret;
+}
+
+bool stream_crop(FILE* input, FILE* output, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width) {
+
+    if (output == NULL)
+        return false;
+
+    struct bmp_reader *reader = bmp_reader_open(input);
+    if (reader == NULL)
+        return false;
+
+    // Get image stats
+    size_t source_width = reader->header->width;
+    size_t source_height = reader->header->height;
+
+    // Check staring point, crop size and bounds of crop
+    if (start_y >= source_height || start_x >= source_width || height < 1 || width < 1
+        || start_y + height > source_height || start_x + width > source_width) {
+        bmp_reader_close(reader);
+        return false;
+    }
+
+    // Rows are stored from bottom, so the area starts `start_y + height` rows from the top
+    struct row_plan plan = identity_plan(reader->header);
+    plan.width = width;
+    plan.height = height;
+    plan.source_cols = width;
+    plan.source_rows = height;
+    plan.col_offset = start_x;
+    plan.row_offset = source_height - start_y - height;
+
+    bool ret = run_plan(reader, output, &plan);
+    bmp_reader_close(reader);
+
+    return ret;
+}
+
+bool stream_extract(FILE* input, FILE* output, const char* colors_to_keep) {
+
+    struct pixel mask;
+
+    if (output == NULL || !parse_colors(colors_to_keep, &mask))
+        return false;
+
+    struct bmp_reader *reader = bmp_reader_open(input);
+    if (reader == NULL)
+        return false;
+
+    struct row_plan plan = identity_plan(reader->header);
+    plan.mask = mask;
+
+    bool ret = run_plan(reader, output, &plan);
+    bmp_reader_close(reader);
+
+    return ret;
+}
+
+/**
+ * Returns source row of the window, rows are read when they are needed
+ * for the first time. The window keeps last `count` read rows, which are
+ * all rows between the row leaving and the row entering the window.
+ */
+static struct pixel* window_row(struct bmp_reader* reader, struct pixel* window, size_t count, uint32_t* loaded, uint32_t row, bool* ok) {
+    size_t width = reader->header->width;
+
+    while (*ok && *loaded <= row) {
+        *ok = bmp_read_row(reader, *loaded, window + (*loaded % count) * width);
+        (*loaded)++;
+    }
+    return window + (row % count) * width;
+}
+
+bool stream_box_blur(FILE* input, FILE* output, uint32_t radius) {
+
+    if (output == NULL || radius > BOX_MAX_RADIUS)
+        return false;
+
+    struct bmp_reader *reader = bmp_reader_open(input);
+    if (reader == NULL)
+        return false;
+
+    // Get source size data
+    size_t width = reader->header->width;
+    size_t height = reader->header->height;
+    size_t channels = width * 3;
+
+    struct bmp_writer *writer = bmp_writer_open(output, width, height);
+    if (writer == NULL) {
+        bmp_reader_close(reader);
+        return false;
+    }
+
+    // Alloc window rows, sums of its columns and result row
+    size_t count = 2 * (size_t) radius + 2 < height ? 2 * (size_t) radius + 2 : height;
+    struct pixel *window = (struct pixel*) malloc(count * reader->row_size + 1);
+    int32_t *sums = (int32_t*) calloc(channels + 1, sizeof(int32_t));
+    struct pixel *row = (struct pixel*) malloc(writer->row_size + 1);
+    bool ok = window != NULL && sums != NULL && row != NULL;
+
+    // Rows outside of the image are the nearest edge row
+    uint32_t loaded = 0;
+    for (int64_t offset = -(int64_t) radius; ok && height > 0 && offset <= radius; offset++) {
+        uint32_t index = offset < 0 ? 0 : offset < (int64_t) height ? offset : height - 1;
+        accumulate_bytes(sums, (const uint8_t*) window_row(reader, window, count, &loaded, index, &ok), channels, 1);
+    }
+
+    for (size_t h = 0; ok && h < height; h++) {
+        box_blur_row((uint8_t*) row, sums, width, 3, radius);
+        ok = bmp_write_row(writer, row);
+
+        uint32_t entering = h + radius + 1 < height ? h + radius + 1 : height - 1;
+        uint32_t leaving = h > radius ? h - radius : 0;
+        accumulate_bytes(sums, (const uint8_t*) window_row(reader, window, count, &loaded, entering, &ok), channels, 1);
+        accumulate_bytes(sums, (const uint8_t*) window_row(reader, window, count, &loaded, leaving, &ok), channels, -1);
+    }
+
+    free(window);
+    free(sums);
+    free(row);
+    bmp_reader_close(reader);
+
+    return bmp_writer_close(writer) && ok;
+}
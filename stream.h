@@ -0,0 +1,182 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include "bmp.h"
+
+
+/**
+ * Structure describes BMP file opened for reading row by row. Only one row
+ * of the image is kept in memory at a time.
+ */
+struct bmp_reader {
+    FILE* stream;
+    struct bmp_header* header;
+    size_t row_size;            // size of row pixels in bytes
+    size_t stride_size;         // size of row in file including padding
+    uint32_t next_row;          // row at the current stream position
+    uint8_t* buffer;            // one padded row
+};
+
+
+/**
+ * Structure describes BMP file opened for writing row by row.
+ */
+struct bmp_writer {
+    FILE* stream;
+    struct bmp_header header;
+    size_t row_size;            // size of row pixels in bytes
+    size_t stride_size;         // size of row in file including padding
+    uint32_t rows_written;
+    uint8_t* buffer;            // one padded row
+};
+
+
+/**
+ * Opens BMP image for reading rows
+ *
+ * Reads and validates the header in the same way as `read_bmp()`, but does
+ * not load any pixels. Only 24-bit images can be streamed. If the stream
+ * is `NULL`, corrupted or of other format, returns `NULL`.
+ *
+ * @param stream opened stream, where the image data are located
+ * @return reader of the image or `NULL` if stream is not open or broken
+ */
+struct bmp_reader* bmp_reader_open(FILE* stream);
+
+
+/**
+ * Reads one row of pixels
+ *
+ * Rows are numbered as they are stored in the file, from bottom to top.
+ * Reading rows in increasing order doesn't seek, any other order seeks.
+ *
+ * @param reader the reader
+ * @param row index of the row in the range <0, height)
+ * @param dest buffer for `width` pixels
+ * @return `true`, if the row was read, `false` otherwise
+ */
+bool bmp_read_row(struct bmp_reader* reader, uint32_t row, struct pixel* dest);
+
+
+/**
+ * Closes the reader
+ *
+ * Frees the reader, the stream stays open.
+ *
+ * @param reader the reader
+ */
+void bmp_reader_close(struct bmp_reader* reader);
+
+
+/**
+ * Opens BMP image for writing rows
+ *
+ * Writes header of 24-bit image with given dimensions to the stream. Rows
+ * have to be written from bottom to top with `bmp_write_row()`.
+ *
+ * @param stream opened stream, where the image will be written
+ * @param width width of the image in pixels
+ * @param height height of the image in pixels
+ * @return writer of the image or `NULL` if stream is not open or header couldn't be written
+ */
+struct bmp_writer* bmp_writer_open(FILE* stream, uint32_t width, uint32_t height);
+
+
+/**
+ * Writes next row of pixels
+ *
+ * @param writer the writer
+ * @param src `width` pixels of the row
+ * @return `true`, if the row was written, `false` otherwise or if all rows were already written
+ */
+bool bmp_write_row(struct bmp_writer* writer, const struct pixel* src);
+
+
+/**
+ * Closes the writer
+ *
+ * Frees the writer, the stream stays open.
+ *
+ * @param writer the writer
+ * @return `true`, if all rows of the image were written, `false` otherwise
+ */
+bool bmp_writer_close(struct bmp_writer* writer);
+
+
+/**
+ * Flips image horizontally row by row.
+ *
+ * Reads image from `input` and writes it horizontally flipped to `output`.
+ * Only a single row is kept in memory.
+ * @arg input opened stream with the source image
+ * @arg output opened stream for the result
+ * @return `true` if image was written, `false` if a stream is `NULL` or the source is broken
+ */
+bool stream_flip_horizontally(FILE* input, FILE* output);
+
+
+/**
+ * Flips image vertically row by row.
+ *
+ * Reads rows of image from `input` from last to first and writes them to
+ * `output`. Input stream has to be seekable.
+ * @arg input opened stream with the source image
+ * @arg output opened stream for the result
+ * @return `true` if image was written, `false` if a stream is `NULL` or the source is broken
+ */
+bool stream_flip_vertically(FILE* input, FILE* output);
+
+
+/**
+ * Resize image height and width by scale factor row by row.
+ *
+ * Same as `scale()`, but only a single source and result row are kept in memory.
+ * @arg input opened stream with the source image
+ * @arg output opened stream for the result
+ * @arg factor the ratio of corresponding sides of original and created image
+ * @return `true` if image was written, `false` if a stream is `NULL`, the source is broken, factor value is not valid or the result would be empty
+ */
+bool stream_scale(FILE* input, FILE* output, float factor);
+
+
+/**
+ * Remove unwanted outer area from image row by row.
+ *
+ * Same as `crop()`, but rows outside of the area are skipped without being
+ * read and only a single row is kept in memory.
+ * @arg input opened stream with the source image
+ * @arg output opened stream for the result
+ * @arg start_y top-left corner position on y-axis of selected area
+ * @arg start_x top-left corner position on x-axis of selected area
+ * @arg height the height of selected area in pixels
+ * @arg width the width of selected area in pixels
+ * @return `true` if image was written, `false` if a stream is `NULL`, the source is broken or area position is out of range
+ */
+bool stream_crop(FILE* input, FILE* output, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width);
+
+
+/**
+ * Extract one or more color channels of image row by row.
+ *
+ * Same as `extract()`, but only a single row is kept in memory.
+ * @arg input opened stream with the source image
+ * @arg output opened stream for the result
+ * @arg colors_to_keep [bgr],b-blue, g-green, r-red
+ * @return `true` if image was written, `false` if a stream is `NULL`, the source is broken or color definition is not valid
+ */
+bool stream_extract(FILE* input, FILE* output, const char* colors_to_keep);
+
+
+/**
+ * Box blur of image row by row.
+ *
+ * Same as `box_blur()`, but only the `2 * radius + 2` source rows of the
+ * window and a single result row are kept in memory.
+ * @arg input opened stream with the source image
+ * @arg output opened stream for the result
+ * @arg radius the radius of the square in the range <0, BOX_MAX_RADIUS>
+ * @return `true` if image was written, `false` if a stream is `NULL`, the source is broken or radius is too large
+ */
+bool stream_box_blur(FILE* input, FILE* output, uint32_t radius);
+
+#endif
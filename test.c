@@ -0,0 +1,1518 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#include "bmp.h"
+#include "transformations.h"
+#include "filter.h"
+#include "color.h"
+#include "stream.h"
+#include "threadpool.h"
+#include "pipeline.h"
+#include "cache.h"
+#include "alloc.h"
+#include "batch.h"
+
+// Images of random size and format checked against reference kernels
+#define RANDOM_IMAGES 200
+
+// Largest side of random image, larger than a tile of rotation
+#define MAX_SIDE 150
+
+// Corrupted copies of every fuzzed file
+#define FUZZ_ROUNDS 400
+
+// Threads of the pool transformations are checked with
+#define POOL_SIZE 4
+
+// Length of paths of temporary files
+#define PATH_SIZE 1024
+
+static size_t checks = 0;
+static size_t failures = 0;
+static uint64_t seed = 0x2545F4914F6CDD1Dull;
+
+// Calls of malloc(), calloc() and realloc(), which are wrapped by the linker
+static size_t mallocs = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_add_fetch(&mallocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&mallocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+    __atomic_add_fetch(&mallocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(pointer, size);
+}
+
+/**
+ * Counts check, prints message if it failed.
+ */
+static bool check(bool ok, const char* format, ...) {
+    checks++;
+    if (!ok) {
+        failures++;
+        va_list args;
+        va_start(args, format);
+        fprintf(stderr, "FAIL: ");
+        vfprintf(stderr, format, args);
+        fprintf(stderr, "\n");
+        va_end(args);
+    }
+    return ok;
+}
+
+static uint32_t random_number(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed >> 32;
+}
+
+static uint32_t random_range(uint32_t min, uint32_t max) {
+    return min + random_number() % (max - min + 1);
+}
+
+/**
+ * Silences error messages of the library while corrupted files are read.
+ */
+static int quiet_start(void) {
+    fflush(stderr);
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+    return saved;
+}
+
+static void quiet_end(int saved) {
+    fflush(stderr);
+    if (saved >= 0) {
+        dup2(saved, STDERR_FILENO);
+        close(saved);
+    }
+}
+
+/**
+ * Writes image as BMP file into memory. Returns `NULL` if it failed.
+ */
+static char* encode(const struct bmp_image* image, bool rle, size_t* size) {
+
+    char *data = NULL;
+    FILE *stream = open_memstream(&data, size);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    bool ok = rle ? write_bmp_rle(stream, image) : write_bmp(stream, image);
+    ok = fclose(stream) == 0 && ok;
+    if (!ok) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * Files of both images are the same, so are pixels, palettes, headers and
+ * padding of rows.
+ */
+static bool same_file(const struct bmp_image* a, const struct bmp_image* b) {
+
+    size_t sizeA, sizeB;
+    char *dataA = a != NULL ? encode(a, false, &sizeA) : NULL;
+    char *dataB = b != NULL ? encode(b, false, &sizeB) : NULL;
+    bool same = dataA != NULL && dataB != NULL && sizeA == sizeB && memcmp(dataA, dataB, sizeA) == 0;
+
+    free(dataA);
+    free(dataB);
+    return same;
+}
+
+/**
+ * Color of pixel at column `x` of stored row `y` as BGRA, palette indices
+ * are looked up.
+ */
+static uint32_t color_at(const struct bmp_image* image, size_t x, size_t y) {
+
+    const uint8_t *pixel = (const uint8_t*) bmp_row(image, y) + x * image->pixel_size;
+    switch (image->pixel_size) {
+        case 1: {
+            if (*pixel >= image->colors) {
+                return 0;
+            }
+            const struct bmp_color *color = &image->palette[*pixel];
+            return color->blue | color->green << 8 | color->red << 16;
+        }
+        case 4:
+            return pixel[0] | pixel[1] << 8 | pixel[2] << 16 | (uint32_t) pixel[3] << 24;
+        default:
+            return pixel[0] | pixel[1] << 8 | pixel[2] << 16;
+    }
+}
+
+/**
+ * Both images show the same colors, formats may differ.
+ */
+static bool same_colors(const struct bmp_image* a, const struct bmp_image* b) {
+
+    if (a == NULL || b == NULL || a->info.width != b->info.width || a->info.height != b->info.height) {
+        return false;
+    }
+
+    for (size_t y = 0; y < a->info.height; y++) {
+        for (size_t x = 0; x < a->info.width; x++) {
+            if (color_at(a, x, y) != color_at(b, x, y)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Builds BMP file with random pixels of given format, palette images get
+ * random palette of all colors.
+ */
+static uint8_t* random_file(uint32_t width, uint32_t height, uint16_t bpp, size_t* size) {
+
+    uint32_t colors = bpp <= 8 ? 1u << bpp : 0;
+    size_t stride = bmp_stride(width, bpp);
+    size_t offset = OFFSET + colors * sizeof(struct bmp_color);
+    *size = offset + stride * height;
+
+    uint8_t *data = (uint8_t*) calloc(1, *size);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    struct bmp_header header = {
+        .type = TYPE,
+        .size = *size,
+        .offset = offset,
+        .dib_size = DIB_SIZE,
+        .width = width,
+        .height = height,
+        .planes = PLANES,
+        .bpp = bpp,
+        .compression = BI_RGB,
+        .image_size = stride * height,
+        .num_colors = colors
+    };
+    memcpy(data, &header, sizeof(header));
+
+    for (size_t index = sizeof(header); index < offset; index++) {
+        data[index] = (index - sizeof(header)) % 4 == 3 ? 0 : random_number();
+    }
+
+    // Whole pixels of every row are random, padding stays zero
+    size_t rowBits = (size_t) width * bpp;
+    for (size_t h = 0; h < height; h++) {
+        uint8_t *row = data + offset + h * stride;
+        for (size_t index = 0; index < rowBits / 8; index++) {
+            row[index] = random_number();
+        }
+        if (rowBits % 8 != 0) {
+            row[rowBits / 8] = random_number() & (0xFF00 >> (rowBits % 8));
+        }
+    }
+
+    return data;
+}
+
+/**
+ * Creates 8-bit compressed file of black image, which ends right away.
+ */
+static uint8_t* flat_rle_file(uint32_t width, uint32_t height, size_t* size) {
+
+    size_t offset = OFFSET + 256 * sizeof(struct bmp_color);
+    *size = offset + 2;
+
+    uint8_t *data = (uint8_t*) calloc(1, *size);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    struct bmp_header header = {
+        .type = TYPE,
+        .size = *size,
+        .offset = offset,
+        .dib_size = DIB_SIZE,
+        .width = width,
+        .height = height,
+        .planes = PLANES,
+        .bpp = 8,
+        .compression = BI_RLE8,
+        .image_size = 2,
+        .num_colors = 256
+    };
+    memcpy(data, &header, sizeof(header));
+
+    // End of bitmap, all pixels stay 0
+    data[offset] = 0x00;
+    data[offset + 1] = 0x01;
+
+    return data;
+}
+
+static struct bmp_image* random_image(uint32_t width, uint32_t height, uint16_t bpp) {
+
+    size_t size;
+    uint8_t *data = random_file(width, height, bpp, &size);
+    struct bmp_image *image = data != NULL ? read_bmp_memory(data, size) : NULL;
+    free(data);
+    return image;
+}
+
+/**
+ * Reference kernels, pixel by pixel on stored rows.
+ */
+static uint8_t* pixel_of(const struct bmp_image* image, size_t x, size_t y) {
+    return (uint8_t*) bmp_row(image, y) + x * image->pixel_size;
+}
+
+static struct bmp_image* ref_flip_horizontally(const struct bmp_image* image) {
+    size_t width = image->info.width, height = image->info.height;
+    struct bmp_image *result = create_bmp_image_like(image, width, height);
+    for (size_t y = 0; y < height; y++)
+        for (size_t x = 0; x < width; x++)
+            memcpy(pixel_of(result, x, y), pixel_of(image, width - 1 - x, y), image->pixel_size);
+    return result;
+}
+
+static struct bmp_image* ref_flip_vertically(const struct bmp_image* image) {
+    size_t width = image->info.width, height = image->info.height;
+    struct bmp_image *result = create_bmp_image_like(image, width, height);
+    for (size_t y = 0; y < height; y++)
+        for (size_t x = 0; x < width; x++)
+            memcpy(pixel_of(result, x, y), pixel_of(image, x, height - 1 - y), image->pixel_size);
+    return result;
+}
+
+static struct bmp_image* ref_rotate_right(const struct bmp_image* image) {
+    size_t width = image->info.width, height = image->info.height;
+    struct bmp_image *result = create_bmp_image_like(image, height, width);
+    for (size_t y = 0; y < width; y++)
+        for (size_t x = 0; x < height; x++)
+            memcpy(pixel_of(result, x, width - 1 - y), pixel_of(image, y, x), image->pixel_size);
+    return result;
+}
+
+static struct bmp_image* ref_rotate_left(const struct bmp_image* image) {
+    size_t width = image->info.width, height = image->info.height;
+    struct bmp_image *result = create_bmp_image_like(image, height, width);
+    for (size_t y = 0; y < width; y++)
+        for (size_t x = 0; x < height; x++)
+            memcpy(pixel_of(result, height - 1 - x, y), pixel_of(image, y, x), image->pixel_size);
+    return result;
+}
+
+static struct bmp_image* ref_rotate_180(const struct bmp_image* image) {
+    size_t width = image->info.width, height = image->info.height;
+    struct bmp_image *result = create_bmp_image_like(image, width, height);
+    for (size_t y = 0; y < height; y++)
+        for (size_t x = 0; x < width; x++)
+            memcpy(pixel_of(result, x, y), pixel_of(image, width - 1 - x, height - 1 - y), image->pixel_size);
+    return result;
+}
+
+/**
+ * `start_y` is counted from the top, rows are stored from the bottom.
+ */
+static struct bmp_image* ref_crop(const struct bmp_image* image, uint32_t start_y, uint32_t start_x, uint32_t height, uint32_t width) {
+    size_t first = image->info.height - start_y - height;
+    struct bmp_image *result = create_bmp_image_like(image, width, height);
+    for (size_t y = 0; y < height; y++)
+        for (size_t x = 0; x < width; x++)
+            memcpy(pixel_of(result, x, y), pixel_of(image, start_x + x, first + y), image->pixel_size);
+    return result;
+}
+
+static struct bmp_image* ref_scale(const struct bmp_image* image, float factor) {
+    size_t width = image->info.width, height = image->info.height;
+    size_t new_width = round(width * factor), new_height = round(height * factor);
+    struct bmp_image *result = create_bmp_image_like(image, new_width, new_height);
+    for (size_t y = 0; y < new_height; y++)
+        for (size_t x = 0; x < new_width; x++)
+            memcpy(pixel_of(result, x, y), pixel_of(image, x * width / new_width, y * height / new_height), image->pixel_size);
+    return result;
+}
+
+static struct bmp_image* ref_extract(const struct bmp_image* image, const char* colors) {
+    size_t width = image->info.width, height = image->info.height;
+    uint8_t mask[4] = { strchr(colors, 'b') ? 0xFF : 0, strchr(colors, 'g') ? 0xFF : 0, strchr(colors, 'r') ? 0xFF : 0, 0xFF };
+    struct bmp_image *result = create_bmp_image_like(image, width, height);
+
+    // Palette images keep indices and mask the palette
+    if (image->pixel_size == 1) {
+        for (size_t index = 0; index < result->colors; index++) {
+            result->palette[index].blue &= mask[0];
+            result->palette[index].green &= mask[1];
+            result->palette[index].red &= mask[2];
+        }
+    }
+
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            uint8_t *dest = pixel_of(result, x, y);
+            const uint8_t *src = pixel_of(image, x, y);
+            for (size_t byte = 0; byte < image->pixel_size; byte++) {
+                dest[byte] = image->pixel_size == 1 ? src[byte] : src[byte] & mask[byte];
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Reference filters of 24-bit and 32-bit images, pixels outside of the
+ * image are the nearest edge pixel.
+ */
+static const uint8_t* clamped_pixel(const struct bmp_image* image, int64_t x, int64_t y) {
+    int64_t width = image->info.width, height = image->info.height;
+    return pixel_of(image, x < 0 ? 0 : x >= width ? width - 1 : x, y < 0 ? 0 : y >= height ? height - 1 : y);
+}
+
+static struct bmp_image* ref_box_blur(const struct bmp_image* image, int64_t radius) {
+    size_t width = image->info.width, height = image->info.height;
+    int64_t count = (2 * radius + 1) * (2 * radius + 1);
+    struct bmp_image *result = create_bmp_image_like(image, width, height);
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            for (size_t byte = 0; byte < image->pixel_size; byte++) {
+                int64_t sum = 0;
+                for (int64_t dy = -radius; dy <= radius; dy++)
+                    for (int64_t dx = -radius; dx <= radius; dx++)
+                        sum += clamped_pixel(image, x + dx, y + dy)[byte];
+                pixel_of(result, x, y)[byte] = (sum + count / 2) / count;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Convolution with weights of 14 fractional bits, the vertical pass is
+ * rounded to bytes. Weight `k` of the vertical pass is `k - size / 2` rows
+ * below, which is lower stored row.
+ */
+static struct bmp_image* ref_convolve(const struct bmp_image* image, const int32_t* row, int64_t row_size, const int32_t* col, int64_t col_size) {
+    size_t width = image->info.width, height = image->info.height;
+    struct bmp_image *vertical = create_bmp_image_like(image, width, height);
+    struct bmp_image *result = create_bmp_image_like(image, width, height);
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            for (size_t byte = 0; byte < image->pixel_size; byte++) {
+                int32_t sum = 0;
+                for (int64_t tap = 0; tap < col_size; tap++)
+                    sum += col[tap] * clamped_pixel(image, x, y + col_size / 2 - tap)[byte];
+                sum = (sum + (1 << 13)) >> 14;
+                pixel_of(vertical, x, y)[byte] = sum < 0 ? 0 : sum > 255 ? 255 : sum;
+            }
+        }
+    }
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            for (size_t byte = 0; byte < image->pixel_size; byte++) {
+                int32_t sum = 0;
+                for (int64_t tap = 0; tap < row_size; tap++)
+                    sum += row[tap] * clamped_pixel(vertical, x + tap - row_size / 2, y)[byte];
+                sum = (sum + (1 << 13)) >> 14;
+                pixel_of(result, x, y)[byte] = sum < 0 ? 0 : sum > 255 ? 255 : sum;
+            }
+        }
+    }
+    free_bmp_image(vertical);
+    return result;
+}
+
+static struct bmp_image* copy_image(const struct bmp_image* image) {
+    struct bmp_image *copy = create_bmp_image_like(image, image->info.width, image->info.height);
+    for (size_t y = 0; y < image->info.height && copy != NULL; y++) {
+        memcpy(bmp_row(copy, y), bmp_row(image, y), (size_t) image->info.width * image->pixel_size);
+    }
+    return copy;
+}
+
+/**
+ * Compares result of transformation with the reference, both are freed.
+ */
+static void expect(struct bmp_image* result, struct bmp_image* reference, const char* name, const struct bmp_image* image, const char* mode) {
+    check(same_file(result, reference), "%s of %ux%u %u-bit image (%s)", name, image->info.width, image->info.height, image->info.bpp, mode);
+    free_bmp_image(result);
+    free_bmp_image(reference);
+}
+
+/**
+ * Runs in-place variant on a copy of the image and returns the copy.
+ */
+static struct bmp_image* run_inplace(const struct bmp_image* image, bool (*transform)(struct bmp_image*)) {
+    struct bmp_image *copy = copy_image(image);
+    if (copy != NULL && !transform(copy)) {
+        free_bmp_image(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+/**
+ * Checks every transformation of the image, copying and in-place variants,
+ * against the reference kernels.
+ */
+static void check_transformations(const struct bmp_image* image, const char* mode) {
+
+    uint32_t width = image->info.width;
+    uint32_t height = image->info.height;
+    const char *colorSets[] = { "b", "g", "r", "bg", "gr", "br", "bgr" };
+    const char *colors = colorSets[random_number() % 7];
+
+    expect(flip_horizontally(image), ref_flip_horizontally(image), "flip_horizontally", image, mode);
+    expect(flip_vertically(image), ref_flip_vertically(image), "flip_vertically", image, mode);
+    expect(rotate_right(image), ref_rotate_right(image), "rotate_right", image, mode);
+    expect(rotate_left(image), ref_rotate_left(image), "rotate_left", image, mode);
+    expect(rotate_180(image), ref_rotate_180(image), "rotate_180", image, mode);
+    expect(extract(image, colors), ref_extract(image, colors), "extract", image, mode);
+
+    // Random area inside of the image
+    uint32_t cropHeight = random_range(1, height);
+    uint32_t cropWidth = random_range(1, width);
+    uint32_t startY = random_range(0, height - cropHeight);
+    uint32_t startX = random_range(0, width - cropWidth);
+    expect(crop(image, startY, startX, cropHeight, cropWidth), ref_crop(image, startY, startX, cropHeight, cropWidth), "crop", image, mode);
+    expect(crop_view(image, startY, startX, cropHeight, cropWidth), ref_crop(image, startY, startX, cropHeight, cropWidth), "crop_view", image, mode);
+    check(crop(image, startY, startX, height + 1, width) == NULL, "crop out of range of %ux%u image", width, height);
+
+    float factors[] = { 0.3f, 0.5f, 1.0f, 1.7f, 2.0f };
+    float factor = factors[random_number() % 5];
+    expect(scale(image, factor), ref_scale(image, factor), "scale", image, mode);
+
+    // Filters have no exact reference, but they keep image of factor one
+    struct bmp_image *same = resample(image, 1.0f, SCALE_BILINEAR);
+    check(same_colors(same, image), "bilinear resample by 1 of %ux%u %u-bit image (%s)", width, height, image->info.bpp, mode);
+    free_bmp_image(same);
+    same = resample(image, 1.0f, SCALE_AREA);
+    check(same_colors(same, image), "area resample by 1 of %ux%u %u-bit image (%s)", width, height, image->info.bpp, mode);
+    free_bmp_image(same);
+
+    // Affine positions are stepped in fixed point, matrices moving whole pixels must match the references
+    double mirror[6] = { -1, 0, width, 0, 1, 0 };
+    double turn[6] = { 0, -1, height, 1, 0, 0 };
+    double identity[6] = { 1, 0, 0, 0, 1, 0 };
+    double singular[6] = { 1, 2, 0, 2, 4, 0 };
+    expect(affine(image, mirror, width, height, SCALE_NEAREST), ref_flip_horizontally(image), "affine mirror", image, mode);
+    expect(affine(image, turn, height, width, SCALE_NEAREST), ref_rotate_right(image), "affine turn", image, mode);
+    expect(rotate(image, -90, SCALE_BILINEAR), ref_rotate_left(image), "rotate by -90", image, mode);
+    expect(rotate(image, 540, SCALE_NEAREST), ref_rotate_180(image), "rotate by 540", image, mode);
+    same = affine(image, identity, width, height, SCALE_BILINEAR);
+    check(same_colors(same, image), "bilinear identity affine of %ux%u %u-bit image (%s)", width, height, image->info.bpp, mode);
+    free_bmp_image(same);
+    check(affine(image, singular, width, height, SCALE_NEAREST) == NULL, "singular affine of %ux%u image", width, height);
+
+    // Half of a turn to the right and back keeps the middle of the image
+    struct bmp_image *turned = rotate(image, 45, SCALE_NEAREST);
+    struct bmp_image *back = rotate(turned, -45, SCALE_NEAREST);
+    check(turned != NULL && back != NULL && back->info.width >= width && back->info.height >= height,
+          "rotate by 45 and back of %ux%u image", width, height);
+    free_bmp_image(turned);
+    free_bmp_image(back);
+
+    expect(run_inplace(image, flip_horizontally_inplace), ref_flip_horizontally(image), "flip_horizontally_inplace", image, mode);
+    expect(run_inplace(image, flip_vertically_inplace), ref_flip_vertically(image), "flip_vertically_inplace", image, mode);
+    expect(run_inplace(image, rotate_180_inplace), ref_rotate_180(image), "rotate_180_inplace", image, mode);
+    if (width == height) {
+        expect(run_inplace(image, rotate_right_inplace), ref_rotate_right(image), "rotate_right_inplace", image, mode);
+        expect(run_inplace(image, rotate_left_inplace), ref_rotate_left(image), "rotate_left_inplace", image, mode);
+    }
+
+    struct bmp_image *copy = copy_image(image);
+    check(copy != NULL && crop_inplace(copy, startY, startX, cropHeight, cropWidth), "crop_inplace of %ux%u image", width, height);
+    expect(copy, ref_crop(image, startY, startX, cropHeight, cropWidth), "crop_inplace", image, mode);
+
+    copy = copy_image(image);
+    check(copy != NULL && extract_inplace(copy, colors), "extract_inplace of %ux%u image", width, height);
+    expect(copy, ref_extract(image, colors), "extract_inplace", image, mode);
+}
+
+/**
+ * Filters against the reference filters, palette images are filtered as
+ * 24-bit images.
+ */
+static void check_filters(const struct bmp_image* image, const char* mode) {
+
+    uint32_t width = image->info.width;
+    uint32_t height = image->info.height;
+    struct bmp_image *direct = image->pixel_size == 1 ? resample(image, 1.0f, SCALE_BILINEAR) : copy_image(image);
+    if (!check(direct != NULL, "direct colors of %ux%u %u-bit image", width, height, image->info.bpp))
+        return;
+
+    uint32_t radius = random_range(0, 20);
+    expect(box_blur(image, radius), ref_box_blur(direct, radius), "box_blur", image, mode);
+    check(box_blur(image, BOX_MAX_RADIUS + 1) == NULL, "box_blur with too large radius");
+
+    // Weights are exact in fixed point, the sharpening pass overflows bytes
+    const float row[] = { 0.25f, 0.5f, 0.25f };
+    const float col[] = { -0.5f, 2.0f, -0.5f, 0.0f, 0.0f };
+    const int32_t rowFixed[] = { 4096, 8192, 4096 };
+    const int32_t colFixed[] = { -8192, 32768, -8192, 0, 0 };
+    expect(convolve(image, row, 3, col, 5), ref_convolve(direct, rowFixed, 3, colFixed, 5), "convolve", image, mode);
+    check(convolve(image, row, 2, col, 5) == NULL, "convolve with even kernel");
+
+    // Three boxes of radii 1, 1 and 2 have variance of sigma 2
+    struct bmp_image *first = ref_box_blur(direct, 1);
+    struct bmp_image *second = ref_box_blur(first, 1);
+    expect(gaussian_blur(image, 2.0f), ref_box_blur(second, 2), "gaussian_blur", image, mode);
+    free_bmp_image(first);
+    free_bmp_image(second);
+
+    // Narrow Gaussian and no sharpening keep the image
+    struct bmp_image *same = gaussian_blur(image, 0.3f);
+    check(same_colors(same, image), "narrow gaussian_blur of %ux%u %u-bit image (%s)", width, height, image->info.bpp, mode);
+    free_bmp_image(same);
+    same = unsharp_mask(image, 1.5f, 0.0f, 0);
+    check(same_colors(same, image), "unsharp_mask by 0 of %ux%u %u-bit image (%s)", width, height, image->info.bpp, mode);
+    free_bmp_image(same);
+
+    free_bmp_image(direct);
+}
+
+/**
+ * Arguments of streamed operations.
+ */
+struct stream_args {
+    float factor;
+    uint32_t start_y;
+    uint32_t start_x;
+    uint32_t height;
+    uint32_t width;
+    const char* colors;
+    uint32_t radius;
+};
+
+/**
+ * Streams file of 24-bit image through operation given by letter: h and v
+ * flip, s scales by `factor`, c crops the area, e extracts `colors`, b blurs
+ * by `radius`. Returns the result read back or `NULL` if streaming failed.
+ */
+static struct bmp_image* run_streamed(const struct bmp_image* image, char op, const struct stream_args* args) {
+
+    size_t size;
+    char *data = encode(image, false, &size);
+    FILE *input = data != NULL ? fmemopen(data, size, "rb") : NULL;
+    FILE *output = tmpfile();
+    bool ok = input != NULL && output != NULL;
+
+    if (ok && op == 'h')
+        ok = stream_flip_horizontally(input, output);
+    else if (ok && op == 'v')
+        ok = stream_flip_vertically(input, output);
+    else if (ok && op == 's')
+        ok = stream_scale(input, output, args->factor);
+    else if (ok && op == 'c')
+        ok = stream_crop(input, output, args->start_y, args->start_x, args->height, args->width);
+    else if (ok && op == 'e')
+        ok = stream_extract(input, output, args->colors);
+    else if (ok && op == 'b')
+        ok = stream_box_blur(input, output, args->radius);
+
+    struct bmp_image *result = NULL;
+    if (ok) {
+        rewind(output);
+        result = read_bmp(output);
+    }
+
+    if (input != NULL)
+        fclose(input);
+    if (output != NULL)
+        fclose(output);
+    free(data);
+    return result;
+}
+
+/**
+ * Streamed operations of 24-bit image against the references, rows read in
+ * reverse order are the rows of the image.
+ */
+static void check_streams(const struct bmp_image* image, const char* mode) {
+
+    if (image->info.bpp != 24)
+        return;
+
+    uint32_t width = image->info.width;
+    uint32_t height = image->info.height;
+    const char *colorSets[] = { "b", "g", "r", "bg", "gr", "br", "bgr" };
+    float factors[] = { 0.3f, 0.5f, 1.0f, 1.7f, 2.0f };
+    struct stream_args args = {
+        .factor = factors[random_number() % 5],
+        .height = random_range(1, height),
+        .width = random_range(1, width),
+        .colors = colorSets[random_number() % 7],
+        .radius = random_range(0, 20)
+    };
+    args.start_y = random_range(0, height - args.height);
+    args.start_x = random_range(0, width - args.width);
+
+    expect(run_streamed(image, 'h', &args), ref_flip_horizontally(image), "stream_flip_horizontally", image, mode);
+    expect(run_streamed(image, 'v', &args), ref_flip_vertically(image), "stream_flip_vertically", image, mode);
+    expect(run_streamed(image, 'c', &args), ref_crop(image, args.start_y, args.start_x, args.height, args.width), "stream_crop", image, mode);
+    expect(run_streamed(image, 'e', &args), ref_extract(image, args.colors), "stream_extract", image, mode);
+    expect(run_streamed(image, 'b', &args), ref_box_blur(image, args.radius), "stream_box_blur", image, mode);
+
+    size_t size;
+    char *data = encode(image, false, &size);
+    FILE *input = data != NULL ? fmemopen(data, size, "rb") : NULL;
+
+    // Empty result fails before anything is written
+    if (round(width * args.factor) >= 1 && round(height * args.factor) >= 1) {
+        expect(run_streamed(image, 's', &args), ref_scale(image, args.factor), "stream_scale", image, mode);
+    }
+    else {
+        FILE *output = tmpfile();
+        bool failed = input != NULL && output != NULL && !stream_scale(input, output, args.factor);
+        check(failed && fseek(output, 0, SEEK_END) == 0 && ftell(output) == 0, "stream_scale to empty image of %ux%u image", width, height);
+        if (output != NULL)
+            fclose(output);
+    }
+    struct bmp_reader *reader = input != NULL ? bmp_reader_open(input) : NULL;
+    struct pixel *row = (struct pixel*) malloc((size_t) width * sizeof(struct pixel));
+    bool ok = reader != NULL && row != NULL;
+    for (uint32_t h = height; ok && h > 0; h--) {
+        ok = bmp_read_row(reader, h - 1, row) && memcmp(row, bmp_row(image, h - 1), (size_t) width * sizeof(struct pixel)) == 0;
+    }
+    check(ok && !bmp_read_row(reader, height, row), "rows of %ux%u image read in reverse order (%s)", width, height, mode);
+    bmp_reader_close(reader);
+    free(row);
+    if (input != NULL)
+        fclose(input);
+    free(data);
+}
+
+/**
+ * Reference color adjustment, palette images adjust the palette.
+ */
+static void ref_adjust_color(uint8_t* color, const struct bmp_lut* lut) {
+    if (lut->grayscale) {
+        color[0] = color[1] = color[2] = (29 * color[0] + 150 * color[1] + 77 * color[2] + 128) >> 8;
+    }
+    for (size_t channel = 0; channel < CHANNELS; channel++) {
+        color[channel] = lut->tables[channel][color[channel]];
+    }
+}
+
+static struct bmp_image* ref_adjust_colors(const struct bmp_image* image, const struct bmp_lut* lut) {
+    struct bmp_image *result = copy_image(image);
+    if (image->pixel_size == 1) {
+        for (size_t index = 0; index < result->colors; index++)
+            ref_adjust_color((uint8_t*) &result->palette[index], lut);
+        return result;
+    }
+    for (size_t y = 0; y < image->info.height; y++)
+        for (size_t x = 0; x < image->info.width; x++)
+            ref_adjust_color(pixel_of(result, x, y), lut);
+    return result;
+}
+
+/**
+ * Histogram and color adjustments against the reference, tables of
+ * adjustments are checked by their properties.
+ */
+static void check_colors(const struct bmp_image* image, const char* mode) {
+
+    uint32_t width = image->info.width;
+    uint32_t height = image->info.height;
+
+    // Histogram of colors of all pixels
+    struct bmp_histogram histogram;
+    uint64_t counts[CHANNELS][256] = { { 0 } };
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            uint32_t color = color_at(image, x, y);
+            for (size_t channel = 0; channel < CHANNELS; channel++)
+                counts[channel][(color >> (8 * channel)) & 0xFF]++;
+        }
+    }
+    bool same = bmp_histogram(image, &histogram) && histogram.pixels == (uint64_t) width * height
+                && memcmp(counts, histogram.counts, sizeof(counts)) == 0;
+    for (size_t channel = 0; channel < CHANNELS && same; channel++) {
+        same = counts[channel][histogram.min[channel]] > 0 && counts[channel][histogram.max[channel]] > 0
+               && histogram.min[channel] <= histogram.mean[channel] && histogram.mean[channel] <= histogram.max[channel];
+    }
+    check(same, "histogram of %ux%u %u-bit image (%s)", width, height, image->info.bpp, mode);
+
+    // Same table for all channels, tables of every channel, gray
+    struct bmp_lut shared, levels, gray;
+    lut_identity(&shared);
+    check(lut_brightness_contrast(&shared, 30, 1.3f) && lut_gamma(&shared, 1.8f), "shared adjustment");
+    lut_invert(&shared);
+    lut_identity(&levels);
+    const uint8_t black[CHANNELS] = { 10, 40, 0 }, white[CHANNELS] = { 200, 255, 128 };
+    check(lut_levels(&levels, black, white, 0.7f), "levels adjustment");
+    check(!lut_levels(&levels, white, black, 1.0f), "levels with white below black");
+    lut_identity(&gray);
+    lut_grayscale(&gray);
+    lut_threshold(&gray, 100);
+
+    const struct bmp_lut *luts[] = { &shared, &levels, &gray };
+    const char *names[] = { "shared adjust_colors", "levels adjust_colors", "gray adjust_colors" };
+    for (size_t index = 0; index < 3; index++) {
+        expect(adjust_colors(image, luts[index]), ref_adjust_colors(image, luts[index]), names[index], image, mode);
+        struct bmp_image *copy = copy_image(image);
+        check(copy != NULL && adjust_colors_inplace(copy, luts[index]), "adjust_colors_inplace of %ux%u image", width, height);
+        expect(copy, ref_adjust_colors(image, luts[index]), "adjust_colors_inplace", image, mode);
+    }
+
+    // Inverting twice and full levels keep colors
+    struct bmp_lut identity, twice, full;
+    lut_identity(&identity);
+    lut_identity(&twice);
+    lut_invert(&twice);
+    lut_invert(&twice);
+    lut_identity(&full);
+    const uint8_t zero[CHANNELS] = { 0, 0, 0 }, top[CHANNELS] = { 255, 255, 255 };
+    lut_levels(&full, zero, top, 1.0f);
+    check(memcmp(&identity, &twice, sizeof(identity)) == 0 && memcmp(&identity, &full, sizeof(identity)) == 0,
+          "inverted twice and full levels are identity");
+
+    // Auto levels stretch every channel with more values to the whole range
+    struct bmp_lut stretch;
+    lut_identity(&stretch);
+    struct bmp_image *stretched = lut_auto_levels(&stretch, &histogram, 0.0f) ? adjust_colors(image, &stretch) : NULL;
+    struct bmp_histogram after;
+    same = stretched != NULL && bmp_histogram(stretched, &after);
+    for (size_t channel = 0; channel < CHANNELS && same; channel++) {
+        if (histogram.min[channel] < histogram.max[channel])
+            same = after.min[channel] == 0 && after.max[channel] == 255;
+    }
+    check(same, "auto levels of %ux%u %u-bit image (%s)", width, height, image->info.bpp, mode);
+    free_bmp_image(stretched);
+}
+
+/**
+ * Pipeline gives the same image as its operations called one by one.
+ */
+static void check_pipeline(const struct bmp_image* image) {
+
+    struct pipeline *pipeline = pipeline_create();
+    struct bmp_image *expected = copy_image(image);
+    size_t count = random_range(1, 4);
+
+    for (size_t op = 0; op < count && expected != NULL; op++) {
+        struct bmp_image *next = NULL;
+        uint32_t width = expected->info.width;
+        uint32_t height = expected->info.height;
+
+        switch (random_number() % 6) {
+            case 0:
+                pipeline_flip_horizontally(pipeline);
+                next = flip_horizontally(expected);
+                break;
+            case 1:
+                pipeline_flip_vertically(pipeline);
+                next = flip_vertically(expected);
+                break;
+            case 2:
+                pipeline_rotate_right(pipeline);
+                next = rotate_right(expected);
+                break;
+            case 3:
+                pipeline_rotate_left(pipeline);
+                next = rotate_left(expected);
+                break;
+            case 4: {
+                uint32_t cropHeight = random_range(1, height);
+                uint32_t cropWidth = random_range(1, width);
+                uint32_t startY = random_range(0, height - cropHeight);
+                uint32_t startX = random_range(0, width - cropWidth);
+                pipeline_crop(pipeline, startY, startX, cropHeight, cropWidth);
+                next = crop(expected, startY, startX, cropHeight, cropWidth);
+                break;
+            }
+            default:
+                pipeline_extract(pipeline, "gr");
+                next = extract(expected, "gr");
+        }
+
+        free_bmp_image(expected);
+        expected = next;
+    }
+
+    struct bmp_image *result = pipeline_run(pipeline, image);
+    check(same_colors(result, expected), "pipeline of %zu operations on %ux%u %u-bit image", count, image->info.width, image->info.height, image->info.bpp);
+
+    free_bmp_image(result);
+    free_bmp_image(expected);
+    pipeline_free(pipeline);
+}
+
+/**
+ * Transformations of random images of all formats, serial and on a pool.
+ * Odd widths have padding in every row.
+ */
+static void test_random_images(void) {
+
+    const uint16_t formats[] = { 1, 4, 8, 24, 32 };
+    struct thread_pool *pool = thread_pool_create(POOL_SIZE);
+    size_t before = failures;
+
+    for (size_t index = 0; index < RANDOM_IMAGES; index++) {
+        uint16_t bpp = formats[index % 5];
+        uint32_t width = random_range(1, index % 4 == 0 ? MAX_SIDE : 9);
+        uint32_t height = index % 3 == 0 ? width : random_range(1, index % 4 == 1 ? MAX_SIDE : 9);
+
+        struct bmp_image *image = random_image(width, height, bpp);
+        if (!check(image != NULL && image->info.bpp == bpp, "reading random %ux%u %u-bit image", width, height, bpp)) {
+            free_bmp_image(image);
+            continue;
+        }
+
+        set_thread_pool(NULL);
+        check_transformations(image, "serial");
+        check_filters(image, "serial");
+        check_streams(image, "serial");
+        check_colors(image, "serial");
+        if (pool != NULL) {
+            set_thread_pool(pool);
+            check_transformations(image, "threads");
+            check_filters(image, "threads");
+            check_colors(image, "threads");
+            set_thread_pool(NULL);
+        }
+        if (bpp == 24) {
+            check_pipeline(image);
+        }
+
+        // Same pixels are read back from any written file
+        size_t size;
+        char *data = encode(image, false, &size);
+        struct bmp_image *copy = data != NULL ? read_bmp_memory(data, size) : NULL;
+        check(same_file(image, copy), "round trip of random %ux%u %u-bit image", width, height, bpp);
+        free_bmp_image(copy);
+        free(data);
+
+        free_bmp_image(image);
+    }
+
+    thread_pool_free(pool);
+    printf("random images: %zu images, %zu failures\n", (size_t) RANDOM_IMAGES, failures - before);
+}
+
+/**
+ * Header of loaded file is probed without pixels, the file without its last
+ * byte is not valid.
+ */
+static void check_probe(const char* path, const struct bmp_image* image) {
+
+    struct bmp_header header;
+    check(bmp_probe(path, &header) && header.width == image->info.width && header.height == image->info.height
+        && header.bpp == image->info.bpp && header.compression == image->info.compression, "probe of %s", path);
+
+    FILE *stream = fopen(path, "rb");
+    uint8_t buffer[1 << 18];
+    size_t size = stream != NULL ? fread(buffer, 1, sizeof(buffer), stream) : 0;
+    if (stream != NULL) {
+        fclose(stream);
+    }
+
+    char truncated[] = "/tmp/bmp_test_XXXXXX";
+    int fd = size > 0 && size < sizeof(buffer) ? mkstemp(truncated) : -1;
+    if (fd < 0) {
+        return;
+    }
+    bool written = write(fd, buffer, size - 1) == (ssize_t) (size - 1);
+    close(fd);
+    check(written && !bmp_probe(truncated, &header), "probe of truncated %s", path);
+    unlink(truncated);
+}
+
+/**
+ * Every asset survives writing and reading back, plain and compressed,
+ * and mapping gives the same image as reading.
+ */
+static void test_assets(const char* pattern) {
+
+    glob_t files = { 0 };
+    if (!check(glob(pattern, 0, NULL, &files) == 0, "no assets match '%s'", pattern)) {
+        return;
+    }
+
+    size_t before = failures;
+    size_t loaded = 0;
+    for (size_t index = 0; index < files.gl_pathc; index++) {
+        const char *path = files.gl_pathv[index];
+        FILE *stream = fopen(path, "rb");
+        int saved = quiet_start();
+        struct bmp_image *image = stream != NULL ? read_bmp(stream) : NULL;
+        quiet_end(saved);
+        if (stream != NULL) {
+            fclose(stream);
+        }
+        if (image == NULL) {
+            continue;
+        }
+        loaded++;
+
+        size_t size;
+        char *data = encode(image, false, &size);
+        struct bmp_image *copy = data != NULL ? read_bmp_memory(data, size) : NULL;
+        check(same_file(image, copy), "round trip of %s", path);
+        free_bmp_image(copy);
+        free(data);
+
+        data = encode(image, true, &size);
+        copy = data != NULL ? read_bmp_memory(data, size) : NULL;
+        check(same_colors(image, copy), "compressed round trip of %s", path);
+        if (copy != NULL && copy->pixel_size == 1) {
+            check_transformations(copy, "rle asset");
+        }
+        free_bmp_image(copy);
+        free(data);
+
+        struct bmp_image *mapped = read_bmp_mmap(path);
+        check(same_file(image, mapped), "mapping of %s", path);
+        free_bmp_image(mapped);
+
+        check_probe(path, image);
+
+        check_transformations(image, path);
+        free_bmp_image(image);
+    }
+
+    globfree(&files);
+    printf("assets: %zu files, %zu loaded, %zu failures\n", files.gl_pathc, loaded, failures - before);
+}
+
+/**
+ * Reads corrupted file with every reader. Nothing may crash, images which
+ * still load are transformed and written.
+ */
+static void read_corrupted(uint8_t* data, size_t size) {
+
+    struct bmp_image *image = read_bmp_memory(data, size);
+    if (image != NULL) {
+        struct bmp_image *result = rotate_right(image);
+        size_t written;
+        free(encode(result, false, &written));
+        free_bmp_image(result);
+        free_bmp_image(image);
+    }
+
+    FILE *stream = size > 0 ? fmemopen(data, size, "rb") : NULL;
+    if (stream == NULL) {
+        return;
+    }
+    struct bmp_header *header = read_bmp_header(stream);
+    if (header != NULL) {
+        free(read_data(stream, header));
+        free(header);
+    }
+    fclose(stream);
+}
+
+/**
+ * Truncated files are refused, files with random bytes changed don't
+ * crash the readers.
+ */
+static void fuzz_file(const uint8_t* original, size_t size, const char* name) {
+
+    uint8_t *data = (uint8_t*) malloc(size);
+    if (data == NULL) {
+        return;
+    }
+
+    int saved = quiet_start();
+
+    // Every length of small files, some of large ones
+    size_t step = size > 4096 ? size / 512 : 1;
+    size_t accepted = 0;
+    for (size_t length = 0; length < size; length += step) {
+        memcpy(data, original, length);
+        struct bmp_image *image = length > 0 ? read_bmp_memory(data, length) : NULL;
+        accepted += image != NULL;
+        free_bmp_image(image);
+        read_corrupted(data, length);
+    }
+
+    // Header bytes are corrupted more often than pixels
+    for (size_t round = 0; round < FUZZ_ROUNDS; round++) {
+        memcpy(data, original, size);
+        size_t changes = random_range(1, 4);
+        for (size_t change = 0; change < changes; change++) {
+            size_t limit = random_number() % 2 == 0 && size > 128 ? 128 : size;
+            data[random_number() % limit] = random_number() % 3 == 0 ? 0xFF : random_number();
+        }
+        read_corrupted(data, size);
+    }
+
+    quiet_end(saved);
+    check(accepted == 0, "%zu truncated copies of %s were accepted", accepted, name);
+    free(data);
+}
+
+static void test_fuzz(void) {
+
+    size_t before = failures;
+    const char *paths[] = { "assets/square.2x3.bmp", "assets/fail.bmp", "assets/lenna.bmp" };
+    for (size_t index = 0; index < sizeof(paths) / sizeof(paths[0]); index++) {
+        FILE *stream = fopen(paths[index], "rb");
+        if (stream == NULL) {
+            continue;
+        }
+        uint8_t buffer[1 << 18];
+        size_t size = fread(buffer, 1, sizeof(buffer), stream);
+        fclose(stream);
+        fuzz_file(buffer, size, paths[index]);
+    }
+
+    // Generated files of other formats, compressed ones too
+    const uint16_t formats[] = { 1, 4, 8, 32 };
+    for (size_t index = 0; index < sizeof(formats) / sizeof(formats[0]); index++) {
+        size_t size;
+        uint8_t *data = random_file(13, 7, formats[index], &size);
+        if (data == NULL) {
+            continue;
+        }
+        fuzz_file(data, size, "random image");
+
+        struct bmp_image *image = read_bmp_memory(data, size);
+        char *compressed = image != NULL && image->pixel_size == 1 ? encode(image, true, &size) : NULL;
+        if (compressed != NULL) {
+            fuzz_file((uint8_t*) compressed, size, "compressed image");
+        }
+        free(compressed);
+        free_bmp_image(image);
+        free(data);
+    }
+
+    // Size of compressed file doesn't bound the image, only number of pixels does
+    size_t size;
+    uint8_t *data = flat_rle_file(4096, 4096, &size);
+    struct bmp_image *image = data != NULL ? read_bmp_memory(data, size) : NULL;
+    check(image != NULL && image->info.width == 4096 && image->info.height == 4096 && pixel_of(image, 4000, 3000)[0] == 0,
+        "flat compressed image of %zu bytes", size);
+    free_bmp_image(image);
+    free(data);
+
+    data = flat_rle_file(65536, 65536, &size);
+    int saved = quiet_start();
+    image = data != NULL ? read_bmp_memory(data, size) : NULL;
+    quiet_end(saved);
+    check(data != NULL && image == NULL, "compressed image over the pixel limit");
+    free_bmp_image(image);
+    free(data);
+
+    printf("fuzzing: %zu failures\n", failures - before);
+}
+
+/**
+ * Queues operations given by letters: r and l rotate, h and v flip, s scales
+ * by `factor`, c crops the top-left quarter of `side` x `side` image, e
+ * extracts `colors`.
+ */
+static struct pipeline* make_pipeline(const char* ops, float factor, uint32_t side, const char* colors) {
+    struct pipeline *pipeline = pipeline_create();
+    for (const char *op = ops; *op != '\0' && pipeline != NULL; op++) {
+        if (*op == 'r')
+            pipeline_rotate_right(pipeline);
+        else if (*op == 'l')
+            pipeline_rotate_left(pipeline);
+        else if (*op == 'h')
+            pipeline_flip_horizontally(pipeline);
+        else if (*op == 'v')
+            pipeline_flip_vertically(pipeline);
+        else if (*op == 's')
+            pipeline_scale(pipeline, factor);
+        else if (*op == 'c')
+            pipeline_crop(pipeline, 0, 0, side / 2, side / 2);
+        else if (*op == 'e')
+            pipeline_extract(pipeline, colors);
+    }
+    return pipeline;
+}
+
+/**
+ * Checks whether two pipelines have the same hash and whether the hash
+ * tells right if they give the same image.
+ */
+static void check_pipeline_hash(const struct bmp_image* image, const char* a, const char* b, bool same) {
+
+    uint32_t side = image->info.width;
+    struct pipeline *first = make_pipeline(a, 1, side, "gr");
+    struct pipeline *second = make_pipeline(b, 1, side, "rb");
+    check((pipeline_hash(first) == pipeline_hash(second)) == same, "hash of pipelines '%s' and '%s'", a, b);
+
+    struct bmp_image *firstResult = pipeline_run(first, image);
+    struct bmp_image *secondResult = pipeline_run(second, image);
+    check(same_colors(firstResult, secondResult) == same, "results of pipelines '%s' and '%s'", a, b);
+
+    free_bmp_image(firstResult);
+    free_bmp_image(secondResult);
+    pipeline_free(first);
+    pipeline_free(second);
+}
+
+/**
+ * Result of key `index` of cache checks, `size` bytes of its number.
+ */
+static void fill_result(uint8_t* data, size_t size, size_t index) {
+    memset(data, (int) index, size);
+}
+
+static bool cached(struct bmp_cache* cache, size_t index, size_t size) {
+    struct bmp_cache_key key = { index, 7 };
+    size_t found = 0;
+    uint8_t *data = bmp_cache_get(cache, &key, &found);
+    uint8_t expected[256];
+    fill_result(expected, size, index);
+    bool ok = data != NULL && found == size && memcmp(data, expected, size) == 0;
+    free(data);
+    return ok;
+}
+
+static bool store(struct bmp_cache* cache, size_t index, size_t size) {
+    struct bmp_cache_key key = { index, 7 };
+    uint8_t data[256];
+    fill_result(data, size, index);
+    return bmp_cache_put(cache, &key, data, size);
+}
+
+/**
+ * One job of the allocator check, reads the file, runs transformations
+ * using scratch buffers and writes results.
+ */
+static bool allocator_job(const uint8_t* file, size_t size, const struct pipeline* pipeline) {
+
+    struct bmp_image *image = read_bmp_memory(file, size);
+    struct bmp_image *rotated = rotate_right(image);
+    struct bmp_image *scaled = resample(image, 0.7f, SCALE_BILINEAR);
+    struct bmp_image *blurred = box_blur(image, 3);
+    struct bmp_image *piped = pipeline_run(pipeline, image);
+    bool ok = rotated != NULL && scaled != NULL && blurred != NULL && piped != NULL
+        && flip_horizontally_inplace(rotated);
+
+    size_t encoded;
+    char *data = ok ? encode(piped, false, &encoded) : NULL;
+    ok = data != NULL;
+    free(data);
+
+    free_bmp_image(image);
+    free_bmp_image(rotated);
+    free_bmp_image(scaled);
+    free_bmp_image(blurred);
+    free_bmp_image(piped);
+    return ok;
+}
+
+/**
+ * Once the pool is warmed up, jobs of the same size don't take any buffers
+ * from the system and don't call malloc() at all.
+ */
+static void test_allocator(void) {
+
+    size_t before = failures;
+    FILE *stream = fopen("assets/lenna.bmp", "rb");
+    if (!check(stream != NULL, "allocator asset")) {
+        return;
+    }
+    uint8_t *file = (uint8_t*) malloc(1 << 18);
+    size_t size = file != NULL ? fread(file, 1, 1 << 18, stream) : 0;
+    fclose(stream);
+
+    struct bmp_allocator *allocator = bmp_allocator_create(0);
+    struct pipeline *pipeline = pipeline_create();
+    pipeline_rotate_left(pipeline);
+    pipeline_crop(pipeline, 10, 20, 100, 120);
+    pipeline_extract(pipeline, "rb");
+    set_thread_pool(NULL);
+    bmp_set_allocator(allocator);
+
+    bool ok = allocator != NULL && size > 0;
+    for (size_t round = 0; round < 2 && ok; round++) {
+        ok = allocator_job(file, size, pipeline);
+    }
+    size_t warm = bmp_allocator_system_allocations(allocator);
+    size_t warmMallocs = __atomic_load_n(&mallocs, __ATOMIC_RELAXED);
+    for (size_t round = 0; round < 6 && ok; round++) {
+        ok = allocator_job(file, size, pipeline);
+    }
+    size_t jobMallocs = __atomic_load_n(&mallocs, __ATOMIC_RELAXED) - warmMallocs;
+    check(ok, "jobs of allocator");
+    check(warm > 0 && bmp_allocator_system_allocations(allocator) == warm, "system allocations of warm pool, %zu before, %zu after",
+        warm, bmp_allocator_system_allocations(allocator));
+    check(jobMallocs == 0, "mallocs of jobs with warm pool, %zu in 6 jobs", jobMallocs);
+
+    bmp_set_allocator(NULL);
+    bmp_allocator_free(allocator);
+    pipeline_free(pipeline);
+    free(file);
+    printf("allocator: %zu failures\n", failures - before);
+}
+
+/**
+ * Hashes of images and pipelines, eviction of the least recently used
+ * results and the disk tier.
+ */
+static void test_cache(void) {
+
+    size_t before = failures;
+
+    // Hash of pixels, views are the same as copies
+    struct bmp_image *image = random_image(37, 37, 24);
+    struct bmp_image *copy = image != NULL ? copy_image(image) : NULL;
+    struct bmp_image *view = image != NULL ? crop_view(image, 0, 0, 37, 36) : NULL;
+    struct bmp_image *cropped = image != NULL ? crop(image, 0, 0, 37, 36) : NULL;
+    if (!check(copy != NULL && view != NULL && cropped != NULL, "images of cache checks")) {
+        free_bmp_image(image);
+        free_bmp_image(copy);
+        free_bmp_image(view);
+        free_bmp_image(cropped);
+        return;
+    }
+    check(bmp_hash(image) == bmp_hash(copy), "hash of copy of image");
+    check(bmp_hash(view) == bmp_hash(cropped), "hash of view and cropped copy");
+    pixel_of(copy, 17, 11)[1] ^= 1;
+    check(bmp_hash(image) != bmp_hash(copy), "hash of changed image");
+
+    // Equivalent pipelines share results
+    check_pipeline_hash(image, "rr", "hv", true);
+    check_pipeline_hash(image, "rl", "", true);
+    check_pipeline_hash(image, "hrhr", "", true);
+    check_pipeline_hash(image, "s", "", true);
+    check_pipeline_hash(image, "ee", "e", false);
+    check_pipeline_hash(image, "r", "l", false);
+    check_pipeline_hash(image, "ch", "hc", false);
+    check_pipeline_hash(image, "rrrc", "lc", true);
+
+    // Three results fit, the oldest one not looked up is dropped
+    struct bmp_cache *cache = bmp_cache_create(240, NULL);
+    check(cache != NULL && store(cache, 1, 80) && store(cache, 2, 80) && store(cache, 3, 80), "storing results");
+    check(cached(cache, 1, 80), "cached result");
+    check(store(cache, 4, 80), "storing result over the limit");
+    check(!cached(cache, 2, 80) && cached(cache, 1, 80) && cached(cache, 3, 80) && cached(cache, 4, 80), "least recently used result dropped");
+    check(!store(cache, 5, 256), "result larger than the limit");
+
+    struct bmp_cache_stats stats = { 0 };
+    bmp_cache_get_stats(cache, &stats);
+    check(stats.entries == 3 && stats.bytes == 240 && stats.evictions == 1 && stats.misses == 1, "counters of cache");
+    bmp_cache_free(cache);
+
+    // Results on disk are found by another cache
+    char directory[] = "/tmp/bmp_test_XXXXXX";
+    if (check(mkdtemp(directory) != NULL, "directory of disk cache")) {
+        cache = bmp_cache_create(0, directory);
+        check(cache != NULL && store(cache, 1, 200) && !cached(cache, 2, 200), "storing result on disk");
+        bmp_cache_free(cache);
+
+        cache = bmp_cache_create(1000, directory);
+        check(cached(cache, 1, 200) && cached(cache, 1, 200), "result read from disk");
+        bmp_cache_get_stats(cache, &stats);
+        check(stats.disk_hits == 1 && stats.hits == 1, "counters of disk cache");
+        bmp_cache_free(cache);
+
+        glob_t files = { 0 };
+        char pattern[sizeof(directory) + 8];
+        snprintf(pattern, sizeof(pattern), "%s/*", directory);
+        if (glob(pattern, 0, NULL, &files) == 0) {
+            check(files.gl_pathc == 1, "files of disk cache");
+            for (size_t index = 0; index < files.gl_pathc; index++) {
+                unlink(files.gl_pathv[index]);
+            }
+        }
+        globfree(&files);
+        rmdir(directory);
+    }
+
+    free_bmp_image(image);
+    free_bmp_image(copy);
+    free_bmp_image(view);
+    free_bmp_image(cropped);
+    printf("cache: %zu failures\n", failures - before);
+}
+
+/**
+ * Reads whole file, returns `NULL` if it can't be read.
+ */
+static uint8_t* read_file(const char* path, size_t* size) {
+
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    long length = fseek(stream, 0, SEEK_END) == 0 ? ftell(stream) : -1;
+    uint8_t *data = length >= 0 && fseek(stream, 0, SEEK_SET) == 0 ? (uint8_t*) malloc(length + 1) : NULL;
+    bool ok = data != NULL && fread(data, 1, length, stream) == (size_t) length;
+    fclose(stream);
+    if (!ok) {
+        free(data);
+        return NULL;
+    }
+
+    *size = length;
+    return data;
+}
+
+static bool write_file(const char* path, const void* data, size_t size) {
+
+    FILE *stream = fopen(path, "wb");
+    if (stream == NULL) {
+        return false;
+    }
+
+    bool ok = fwrite(data, 1, size, stream) == size;
+    return fclose(stream) == 0 && ok;
+}
+
+/**
+ * Files written by batch processing of copies of the assets are the same
+ * as results of the pipeline run in memory, with direct reads and with
+ * every backend of asynchronous I/O.
+ */
+static void test_batch(const char* pattern) {
+
+    size_t before = failures;
+    char inputs[] = "/tmp/bmp_test_XXXXXX";
+    char outputs[] = "/tmp/bmp_test_XXXXXX";
+    glob_t files = { 0 };
+    if (!check(glob(pattern, 0, NULL, &files) == 0, "no assets match '%s'", pattern)) {
+        return;
+    }
+    if (!check(mkdtemp(inputs) != NULL, "directory of batch inputs")) {
+        globfree(&files);
+        return;
+    }
+    if (!check(mkdtemp(outputs) != NULL, "directory of batch outputs")) {
+        rmdir(inputs);
+        globfree(&files);
+        return;
+    }
+
+    struct pipeline *pipeline = pipeline_create();
+    pipeline_rotate_right(pipeline);
+    pipeline_flip_horizontally(pipeline);
+    pipeline_extract(pipeline, "gb");
+
+    // Loadable assets are copied with their results in both formats
+    size_t count = 0;
+    char **paths = (char**) calloc(files.gl_pathc, sizeof(char*));
+    char **expected[2] = { (char**) calloc(files.gl_pathc, sizeof(char*)), (char**) calloc(files.gl_pathc, sizeof(char*)) };
+    size_t *sizes[2] = { (size_t*) calloc(files.gl_pathc, sizeof(size_t)), (size_t*) calloc(files.gl_pathc, sizeof(size_t)) };
+    bool ok = pipeline != NULL && paths != NULL && expected[0] != NULL && expected[1] != NULL && sizes[0] != NULL && sizes[1] != NULL;
+    for (size_t index = 0; index < files.gl_pathc && ok; index++) {
+        size_t size;
+        uint8_t *data = read_file(files.gl_pathv[index], &size);
+        int saved = quiet_start();
+        struct bmp_image *image = data != NULL ? read_bmp_memory(data, size) : NULL;
+        quiet_end(saved);
+        if (image == NULL) {
+            free(data);
+            continue;
+        }
+
+        const char *name = strrchr(files.gl_pathv[index], '/');
+        name = name != NULL ? name + 1 : files.gl_pathv[index];
+        paths[count] = (char*) malloc(PATH_SIZE);
+        struct bmp_image *result = pipeline_run(pipeline, image);
+        ok = paths[count] != NULL && result != NULL;
+        if (ok) {
+            snprintf(paths[count], PATH_SIZE, "%s/%s", inputs, name);
+            expected[0][count] = encode(result, false, &sizes[0][count]);
+            expected[1][count] = encode(result, true, &sizes[1][count]);
+            ok = write_file(paths[count], data, size) && expected[0][count] != NULL && expected[1][count] != NULL;
+            count++;
+        }
+        check(ok, "batch input %s", files.gl_pathv[index]);
+        free_bmp_image(result);
+        free_bmp_image(image);
+        free(data);
+    }
+
+    struct {
+        bool async_io;
+        enum bmp_io_backend backend;
+        bool rle;
+    } runs[] = {
+        { false, BMP_IO_AUTO, false },
+        { true, BMP_IO_THREADS, false },
+        { true, BMP_IO_URING, true },
+        { true, BMP_IO_AUTO, false }
+    };
+    for (size_t run = 0; run < sizeof(runs) / sizeof(runs[0]) && ok; run++) {
+        struct batch_options options = {
+            .pipeline = pipeline,
+            .output_dir = outputs,
+            .readers = 2,
+            .workers = 2,
+            .writers = 2,
+            .rle = runs[run].rle,
+            .async_io = runs[run].async_io,
+            .backend = runs[run].backend
+        };
+        struct batch_stats stats;
+        check(batch_run((const char* const*) paths, count, &options, &stats) && stats.files == count, "batch run %zu with %s", run, stats.io);
+        check(stats.read_busy_seconds <= stats.seconds && stats.write_busy_seconds <= stats.seconds, "busy times of %s within the batch", stats.io);
+
+        for (size_t index = 0; index < count; index++) {
+            char path[PATH_SIZE];
+            snprintf(path, sizeof(path), "%s/%s", outputs, strrchr(paths[index], '/') + 1);
+            size_t size = 0;
+            uint8_t *data = read_file(path, &size);
+            size_t format = runs[run].rle ? 1 : 0;
+            check(data != NULL && size == sizes[format][index] && memcmp(data, expected[format][index], size) == 0,
+                "batch result %s with %s", path, stats.io);
+            free(data);
+            unlink(path);
+        }
+        printf("batch: %s, %zu files\n", stats.io, stats.files);
+    }
+
+    for (size_t index = 0; index < count; index++) {
+        unlink(paths[index]);
+        free(paths[index]);
+        free(expected[0][index]);
+        free(expected[1][index]);
+    }
+    free(paths);
+    free(expected[0]);
+    free(expected[1]);
+    free(sizes[0]);
+    free(sizes[1]);
+    rmdir(inputs);
+    rmdir(outputs);
+    pipeline_free(pipeline);
+    globfree(&files);
+    printf("batch: %zu failures\n", failures - before);
+}
+
+int main(int argc, char *argv[]) {
+
+    // Seed can be given to repeat a failed run
+    if (argc > 1) {
+        seed = strtoull(argv[1], NULL, 0);
+        seed = seed != 0 ? seed : 1;
+    }
+    printf("seed: 0x%llx\n", (unsigned long long) seed);
+
+    test_assets("assets/*.bmp");
+    test_random_images();
+    test_fuzz();
+    test_cache();
+    test_allocator();
+    test_batch("assets/*.bmp");
+
+    printf("%zu checks, %zu failures\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+// Chunks per thread, more chunks balance uneven work better
+#define CHUNKS_PER_THREAD 4
+
+/**
+ * Takes chunks of current job until there are none left. Expects the lock
+ * to be held and holds it again on return.
+ */
+static void work_on_job(struct thread_pool* pool) {
+    while (pool->next < pool->count) {
+        size_t start = pool->next;
+        size_t end = start + pool->chunk < pool->count ? start + pool->chunk : pool->count;
+        pool->next = end;
+
+        pthread_mutex_unlock(&pool->lock);
+        pool->task(pool->arg, start, end);
+        pthread_mutex_lock(&pool->lock);
+    }
+}
+
+static void* worker(void* arg) {
+
+    struct thread_pool *pool = (struct thread_pool*) arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        // Wait for new job
+        while (pool->generation == seen && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->generation;
+
+        work_on_job(pool);
+
+        pool->finished++;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct thread_pool* thread_pool_create(size_t size) {
+
+    // One thread per CPU
+    if (size == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size = cpus > 0 ? (size_t) cpus : 1;
+    }
+
+    struct thread_pool *pool = (struct thread_pool*) calloc(1, sizeof(struct thread_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->threads = (pthread_t*) calloc(size, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->size = 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    // Caller is the first thread
+    for (size_t index = 0; index + 1 < size; index++) {
+        if (pthread_create(&pool->threads[index], NULL, worker, pool) != 0) {
+            thread_pool_free(pool);
+            return NULL;
+        }
+        pool->size++;
+    }
+
+    return pool;
+}
+
+void thread_pool_free(struct thread_pool* pool) {
+    if (pool != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (size_t index = 0; index + 1 < pool->size; index++) {
+            pthread_join(pool->threads[index], NULL);
+        }
+
+        pthread_mutex_destroy(&pool->lock);
+        pthread_mutex_destroy(&pool->run_lock);
+        pthread_cond_destroy(&pool->work);
+        pthread_cond_destroy(&pool->done);
+        free(pool->threads);
+        free(pool);
+    }
+}
+
+void thread_pool_run(struct thread_pool* pool, size_t count, thread_task task, void* arg) {
+
+    if (count == 0) {
+        return;
+    }
+
+    // Nothing to share the work with
+    if (pool == NULL || pool->size == 1 || count == 1) {
+        task(arg, 0, count);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->run_lock);
+    pthread_mutex_lock(&pool->lock);
+
+    // Publish job
+    pool->task = task;
+    pool->arg = arg;
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->chunk = count / (pool->size * CHUNKS_PER_THREAD);
+    if (pool->chunk < 1) {
+        pool->chunk = 1;
+    }
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work);
+
+    work_on_job(pool);
+
+    // Wait for workers, they may still run their last chunk
+    while (pool->finished < pool->size - 1) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run_lock);
+}
@@ -0,0 +1,70 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+
+/**
+ * Task run by the pool on range of items <start, end).
+ */
+typedef void (*thread_task)(void* arg, size_t start, size_t end);
+
+
+/**
+ * Structure describes pool of worker threads, which are created once and
+ * reused for every job. The thread which runs a job works on it as well.
+ */
+struct thread_pool {
+    pthread_t* threads;
+    size_t size;                // number of threads working on a job, including caller
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // new job or stop
+    pthread_cond_t done;        // worker finished job
+    pthread_mutex_t run_lock;   // only one job runs at a time
+    thread_task task;
+    void* arg;
+    size_t count;               // number of items of the job
+    size_t chunk;               // number of items taken at once
+    size_t next;                // first item not taken yet
+    size_t finished;            // workers done with current job
+    unsigned long generation;   // incremented for every job
+    bool stop;
+};
+
+
+/**
+ * Creates thread pool
+ *
+ * Starts `size - 1` worker threads, the thread calling `thread_pool_run()`
+ * is the last one. If `size` is 0, one thread per online CPU is used.
+ *
+ * @param size number of threads working on a job
+ * @return the pool or `NULL` if threads couldn't be started or there is not enough memory
+ */
+struct thread_pool* thread_pool_create(size_t size);
+
+
+/**
+ * Stops all threads and frees the pool from the memory
+ *
+ * @param pool the pool
+ */
+void thread_pool_free(struct thread_pool* pool);
+
+
+/**
+ * Runs task on items <0, count) and waits until it's done
+ *
+ * Items are split into chunks, which are taken by threads as they become
+ * free. If pool is `NULL`, task runs on all items in calling thread.
+ *
+ * @param pool the pool or `NULL`
+ * @param count number of items
+ * @param task function run on chunks of items
+ * @param arg argument passed to the task
+ */
+void thread_pool_run(struct thread_pool* pool, size_t count, thread_task task, void* arg);
+
+#endif
@@ -1,238 +1,989 @@
+#include <string.h>
 #include "transformations.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "alloc.h"
+#include "stats.h"
+#include "bands.h"
 #include "math.h"
 
+// Size of square block of pixels rotated at once
+#define TILE_SIZE 64
+
+// Pool splitting transformations into row bands, `NULL` runs them serially
+static struct thread_pool *threads = NULL;
+
+// Fixed point weights of resampling taps, one is `1 << WEIGHT_BITS`
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+
+/**
+ * Source pixels contributing to every pixel of the result along one axis.
+ * Pixel `index` is weighted sum of `count[index]` source pixels starting at
+ * `start[index]`, weights are stored at `weights[index * max_count]`.
+ */
+struct taps {
+    uint32_t* start;
+    uint32_t* count;
+    uint16_t* weights;
+    size_t max_count;
+};
+
+// Fixed point source positions of affine transformation, one is `1 << WARP_BITS`
+#define WARP_BITS 32
+#define WARP_HALF ((int64_t) 1 << (WARP_BITS - 1))
+
+/**
+ * Source position of the center of result pixel (0, 0) and its steps to
+ * the next column and row. Rows of both images are counted from the bottom,
+ * as they are stored.
+ */
+struct warp {
+    int64_t x;
+    int64_t y;
+    int64_t col_x;
+    int64_t col_y;
+    int64_t row_x;
+    int64_t row_y;
+    bool bilinear;
+};
+
+/**
+ * Arguments of band kernels, which fill rows <start, end) of the result.
+ */
+struct band {
+    const struct bmp_image* image;
+    struct bmp_image* newImage;
+    size_t start_x;
+    size_t start_y;
+    struct pixel mask;
+    const uint32_t* table;
+    const struct taps* cols;
+    const struct taps* rows;
+    const struct warp* warp;
+    struct bmp_allocator* allocator;    // allocator of scratch buffers
+    bool* failed;                       // set by tasks without scratch buffers
+    uint8_t* scratch;                   // row buffers, one slot per band
+};
+
+static void free_taps(struct taps* taps, struct bmp_allocator* allocator);
+
+void set_thread_pool(struct thread_pool* pool) {
+    threads = pool;
+}
+
+struct thread_pool* get_thread_pool(void) {
+    return threads;
+}
+
+/**
+ * Kernels below are written for pixels of `size` bytes and inlined with
+ * constant size, so every format gets its own specialized loop.
+ */
+#define SPECIALIZED static inline __attribute__((always_inline))
+
+SPECIALIZED void copy_pixel(uint8_t* dest, const uint8_t* src, size_t size) {
+    memcpy(dest, src, size);
+}
+
+SPECIALIZED void reverse_row_of(uint8_t* dest, const uint8_t* src, size_t width, size_t size) {
+    for (size_t w = 0; w < width; w++) {
+        copy_pixel(dest + w * size, src + (width - 1 - w) * size, size);
+    }
+}
+
+/**
+ * Reverses order of `width` pixels of `size` bytes, buffers must not overlap.
+ */
+static void reverse_row(void* dest, const void* src, size_t width, size_t size) {
+    switch (size) {
+        case 1:
+            reverse_row_of((uint8_t*) dest, (const uint8_t*) src, width, 1);
+            break;
+        case 4:
+            reverse_row_of((uint8_t*) dest, (const uint8_t*) src, width, 4);
+            break;
+        default:
+            reverse_pixels((struct pixel*) dest, (const struct pixel*) src, width);
+    }
+}
+
+static void flip_horizontally_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    size_t width = band->image->info.width;
+
+    for (size_t h = start; h < end; h++) {
+        reverse_row(bmp_row(band->newImage, h), bmp_row(band->image, h), width, band->image->pixel_size);
+    }
+}
+
+static void flip_vertically_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    size_t rowSize = band->image->info.width * band->image->pixel_size;
+    size_t height = band->image->info.height;
+
+    for (size_t h = start; h < end; h++) {
+        memcpy(bmp_row(band->newImage, h), bmp_row(band->image, height - 1 - h), rowSize);
+    }
+}
+
+/**
+ * Turns tile rows <start, end) of the result, so rows of both images touched
+ * by a tile stay in cache. Pixel of result row `h` and column `w` comes from
+ * source column `h` (counted from the end if turning right) and source row
+ * `w` (counted from the end if turning left).
+ */
+SPECIALIZED void rotate_tiles_of(const struct band* band, size_t start, size_t end, bool right, size_t size) {
+    const uint8_t *source = (const uint8_t*) band->image->data;
+    size_t stride = band->image->stride;
+    size_t width = band->image->info.width;
+    size_t height = band->image->info.height;
+    size_t new_width = height;
+    size_t new_height = width;
+
+    for (size_t tileY = start * TILE_SIZE; tileY < end * TILE_SIZE && tileY < new_height; tileY += TILE_SIZE) {
+        size_t endY = tileY + TILE_SIZE < new_height ? tileY + TILE_SIZE : new_height;
+
+        for (size_t tileX = 0; tileX < new_width; tileX += TILE_SIZE) {
+            size_t endX = tileX + TILE_SIZE < new_width ? tileX + TILE_SIZE : new_width;
+
+            for (size_t h = tileY; h < endY; h++) {
+                uint8_t *row = (uint8_t*) bmp_row(band->newImage, h);
+                if (right) {
+                    const uint8_t *column = source + (width - 1 - h) * size;
+                    for (size_t w = tileX; w < endX; w++) {
+                        copy_pixel(row + w * size, column + w * stride, size);
+                    }
+                }
+                else {
+                    const uint8_t *column = source + h * size;
+                    for (size_t w = tileX; w < endX; w++) {
+                        copy_pixel(row + w * size, column + (height - 1 - w) * stride, size);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void rotate_right_tiles(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+
+    switch (band->image->pixel_size) {
+        case 1:
+            rotate_tiles_of(band, start, end, true, 1);
+            break;
+        case 4:
+            rotate_tiles_of(band, start, end, true, 4);
+            break;
+        default:
+            rotate_tiles_of(band, start, end, true, 3);
+    }
+}
+
+static void rotate_left_tiles(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+
+    switch (band->image->pixel_size) {
+        case 1:
+            rotate_tiles_of(band, start, end, false, 1);
+            break;
+        case 4:
+            rotate_tiles_of(band, start, end, false, 4);
+            break;
+        default:
+            rotate_tiles_of(band, start, end, false, 3);
+    }
+}
+
+/**
+ * Turning by 180 degrees reverses order of all pixels, so every row is
+ * the reversed row from the other end of the image.
+ */
+static void rotate_180_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    size_t width = band->image->info.width;
+    size_t height = band->image->info.height;
+
+    for (size_t h = start; h < end; h++) {
+        reverse_row(bmp_row(band->newImage, h), bmp_row(band->image, height - 1 - h), width, band->image->pixel_size);
+    }
+}
+
+/**
+ * Copies rows of selected area. `start_y` is the first source row of the
+ * area as it is stored, from the bottom.
+ */
+static void crop_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    size_t size = band->image->pixel_size;
+    size_t rowSize = band->newImage->info.width * size;
+
+    for (size_t h = start; h < end; h++) {
+        memcpy(bmp_row(band->newImage, h), (const uint8_t*) bmp_row(band->image, band->start_y + h) + band->start_x * size, rowSize);
+    }
+}
+
+/**
+ * Nearest neighbor scaling, `table` holds source column of every column
+ * of the result.
+ */
+SPECIALIZED void scale_rows_of(const struct band* band, size_t start, size_t end, size_t size) {
+    size_t source_height = band->image->info.height;
+    size_t new_width = band->newImage->info.width;
+    size_t new_height = band->newImage->info.height;
+
+    for (size_t hIndex = start; hIndex < end; hIndex++) {
+        const uint8_t *source = (const uint8_t*) bmp_row(band->image, (hIndex * source_height) / new_height);
+        uint8_t *row = (uint8_t*) bmp_row(band->newImage, hIndex);
+        for (size_t wIndex = 0; wIndex < new_width; wIndex++) {
+            copy_pixel(row + wIndex * size, source + band->table[wIndex] * size, size);
+        }
+    }
+}
+
+static void scale_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+
+    switch (band->image->pixel_size) {
+        case 1:
+            scale_rows_of(band, start, end, 1);
+            break;
+        case 4:
+            scale_rows_of(band, start, end, 4);
+            break;
+        default:
+            scale_rows_of(band, start, end, 3);
+    }
+}
+
+/**
+ * Converts rows of palette image to 24-bit pixels, indices out of the
+ * palette are black.
+ */
+static void expand_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    expand_palette_rows(band->image, band->newImage, start, end);
+}
+
+/**
+ * Creates taps of source pixels for every pixel of the result along one
+ * axis of size `source` scaled to `size`. Returns `NULL` if there is not
+ * enough memory.
+ */
+static struct taps* create_taps(size_t source, size_t size, enum scale_mode mode, struct bmp_allocator* allocator) {
+
+    double ratio = (double) source / size;
+
+    // Bilinear always blends two neighbours, box covers up to `ratio` + 1 pixels
+    size_t max_count = mode == SCALE_BILINEAR ? 2 : (size_t) ceil(ratio) + 1;
+
+    struct taps *taps = (struct taps*) bmp_buffer_alloc(allocator, sizeof(struct taps));
+    if (taps == NULL) {
+        return NULL;
+    }
+    taps->max_count = max_count;
+    taps->start = (uint32_t*) bmp_buffer_alloc(allocator, size * sizeof(uint32_t));
+    taps->count = (uint32_t*) bmp_buffer_alloc(allocator, size * sizeof(uint32_t));
+    taps->weights = (uint16_t*) bmp_buffer_alloc(allocator, size * max_count * sizeof(uint16_t));
+    if (taps->start == NULL || taps->count == NULL || taps->weights == NULL) {
+        free_taps(taps, allocator);
+        return NULL;
+    }
+    memset(taps->start, 0, size * sizeof(uint32_t));
+    memset(taps->count, 0, size * sizeof(uint32_t));
+    memset(taps->weights, 0, size * max_count * sizeof(uint16_t));
+
+    for (size_t index = 0; index < size; index++) {
+        uint16_t *weights = taps->weights + index * max_count;
+
+        if (mode == SCALE_BILINEAR) {
+            // Centers of pixels are aligned, edges are clamped
+            double center = (index + 0.5) * ratio - 0.5;
+            if (center < 0) {
+                center = 0;
+            }
+            size_t first = (size_t) center;
+            if (source == 1) {
+                taps->count[index] = 1;
+                weights[0] = WEIGHT_ONE;
+                continue;
+            }
+
+            // Last pixel is taken as the second tap of its left neighbour
+            if (first >= source - 1) {
+                first = source - 2;
+                center = source - 1;
+            }
+
+            taps->start[index] = first;
+            taps->count[index] = 2;
+            weights[1] = (uint16_t) lround((center - first) * WEIGHT_ONE);
+            weights[0] = WEIGHT_ONE - weights[1];
+            continue;
+        }
+
+        // Box covers <low, high) of the source, pixels count by the covered part
+        double low = index * ratio;
+        double high = (index + 1) * ratio;
+        size_t first = (size_t) low;
+        size_t last = (size_t) ceil(high);
+        if (last > source) {
+            last = source;
+        }
+        if (last <= first) {
+            last = first + 1;
+        }
+
+        taps->start[index] = first;
+        taps->count[index] = last - first;
+
+        // Round weights and give the rest to the largest one, so they add up to one
+        size_t largest = 0;
+        int32_t sum = 0;
+        for (size_t tap = 0; tap < last - first; tap++) {
+            double covered = fmin(high, first + tap + 1.0) - fmax(low, (double) first + tap);
+            weights[tap] = (uint16_t) lround(covered / ratio * WEIGHT_ONE);
+            sum += weights[tap];
+            if (weights[tap] > weights[largest]) {
+                largest = tap;
+            }
+        }
+        weights[largest] += WEIGHT_ONE - sum;
+    }
+
+    return taps;
+}
+
+static void free_taps(struct taps* taps, struct bmp_allocator* allocator) {
+    if (taps != NULL) {
+        bmp_buffer_free(allocator, taps->start);
+        bmp_buffer_free(allocator, taps->count);
+        bmp_buffer_free(allocator, taps->weights);
+        bmp_buffer_free(allocator, taps);
+    }
+}
+
+/**
+ * Resamples one source row of pixels with `size` channels horizontally.
+ * Channels of the result are stored with 8 fractional bits.
+ */
+SPECIALIZED void resample_row_of(const uint8_t* bytes, const struct taps* cols, size_t new_width, uint16_t* dest, size_t size) {
+
+    // Bilinear, every pixel has two taps
+    if (cols->max_count == 2 && (new_width == 0 || cols->count[0] == 2)) {
+        for (size_t w = 0; w < new_width; w++) {
+            const uint8_t *first = bytes + cols->start[w] * size;
+            uint32_t left = cols->weights[w * 2];
+            uint32_t right = cols->weights[w * 2 + 1];
+
+            for (size_t c = 0; c < size; c++) {
+                dest[w * size + c] = (first[c] * left + first[size + c] * right + (1 << (WEIGHT_BITS - 9))) >> (WEIGHT_BITS - 8);
+            }
+        }
+        return;
+    }
+
+    for (size_t w = 0; w < new_width; w++) {
+        const uint8_t *first = bytes + cols->start[w] * size;
+        const uint16_t *weights = cols->weights + w * cols->max_count;
+        uint32_t sum[4] = { 0 };
+
+        for (size_t tap = 0; tap < cols->count[w]; tap++) {
+            for (size_t c = 0; c < size; c++) {
+                sum[c] += first[tap * size + c] * weights[tap];
+            }
+        }
+
+        for (size_t c = 0; c < size; c++) {
+            dest[w * size + c] = (sum[c] + (1 << (WEIGHT_BITS - 9))) >> (WEIGHT_BITS - 8);
+        }
+    }
+}
+
+static void resample_row(const void* source, const struct taps* cols, size_t new_width, uint16_t* dest, size_t size) {
+    if (size == 4) {
+        resample_row_of((const uint8_t*) source, cols, new_width, dest, 4);
+    }
+    else {
+        resample_row_of((const uint8_t*) source, cols, new_width, dest, 3);
+    }
+}
+
+/**
+ * Bilinear and box scaling. Every source row of a result row is resampled
+ * horizontally and added to accumulator with its weight, the accumulator
+ * loop has no dependencies between channels and vectorizes. Neighbouring
+ * result rows share source rows, so the resampled rows are cached.
+ */
+static void resample_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    size_t new_width = band->newImage->info.width;
+    size_t size = band->image->pixel_size;
+    size_t channels = new_width * size;
+
+    // Cache of resampled rows, rows are requested in increasing order
+    size_t slots = band->rows->max_count + 1;
+    uint16_t *cache = (uint16_t*) bmp_buffer_alloc(band->allocator, slots * (channels + 1) * sizeof(uint16_t));
+    int64_t *cached = (int64_t*) bmp_buffer_alloc(band->allocator, slots * sizeof(int64_t));
+    uint32_t *sum = (uint32_t*) bmp_buffer_alloc(band->allocator, (channels + 1) * sizeof(uint32_t));
+    if (cache == NULL || cached == NULL || sum == NULL) {
+        bmp_buffer_free(band->allocator, cache);
+        bmp_buffer_free(band->allocator, cached);
+        bmp_buffer_free(band->allocator, sum);
+        band_failed(band->failed);
+        return;
+    }
+    for (size_t slot = 0; slot < slots; slot++) {
+        cached[slot] = -1;
+    }
+
+    for (size_t h = start; h < end; h++) {
+        const uint16_t *weights = band->rows->weights + h * band->rows->max_count;
+        memset(sum, 0, channels * sizeof(uint32_t));
+
+        for (size_t tap = 0; tap < band->rows->count[h]; tap++) {
+            int64_t sourceRow = band->rows->start[h] + tap;
+
+            // Find the row or replace the oldest one
+            size_t slot = 0;
+            for (size_t index = 0; index < slots; index++) {
+                if (cached[index] == sourceRow) {
+                    slot = index;
+                    break;
+                }
+                if (cached[index] < cached[slot]) {
+                    slot = index;
+                }
+            }
+            uint16_t *row = cache + slot * (channels + 1);
+            if (cached[slot] != sourceRow) {
+                resample_row(bmp_row(band->image, sourceRow), band->cols, new_width, row, size);
+                cached[slot] = sourceRow;
+            }
+
+            uint32_t weight = weights[tap];
+            for (size_t index = 0; index < channels; index++) {
+                sum[index] += row[index] * weight;
+            }
+        }
+
+        uint8_t *dest = (uint8_t*) bmp_row(band->newImage, h);
+        for (size_t index = 0; index < channels; index++) {
+            dest[index] = (sum[index] + (1 << (WEIGHT_BITS + 7))) >> (WEIGHT_BITS + 8);
+        }
+    }
+
+    bmp_buffer_free(band->allocator, cache);
+    bmp_buffer_free(band->allocator, cached);
+    bmp_buffer_free(band->allocator, sum);
+}
+
+/**
+ * Affine transformation of tile rows <start, end) of the result. Source
+ * position is stepped along the row, one multiply per row of a tile, so
+ * the inner loop only adds. Tiles keep the source rows crossed by slanted
+ * rows of the result in cache.
+ */
+SPECIALIZED void affine_tiles_of(const struct band* band, size_t start, size_t end, size_t size) {
+    const struct warp *warp = band->warp;
+    const uint8_t *source = (const uint8_t*) band->image->data;
+    size_t stride = band->image->stride;
+    uint64_t width = band->image->info.width;
+    uint64_t height = band->image->info.height;
+    size_t new_width = band->newImage->info.width;
+    size_t new_height = band->newImage->info.height;
+
+    for (size_t tileY = start * TILE_SIZE; tileY < end * TILE_SIZE && tileY < new_height; tileY += TILE_SIZE) {
+        size_t endY = tileY + TILE_SIZE < new_height ? tileY + TILE_SIZE : new_height;
+
+        for (size_t tileX = 0; tileX < new_width; tileX += TILE_SIZE) {
+            size_t endX = tileX + TILE_SIZE < new_width ? tileX + TILE_SIZE : new_width;
+
+            for (size_t h = tileY; h < endY; h++) {
+                uint8_t *row = (uint8_t*) bmp_row(band->newImage, h);
+                int64_t x = warp->x + (int64_t) h * warp->row_x + (int64_t) tileX * warp->col_x;
+                int64_t y = warp->y + (int64_t) h * warp->row_y + (int64_t) tileX * warp->col_y;
+
+                for (size_t w = tileX; w < endX; w++, x += warp->col_x, y += warp->col_y) {
+                    uint8_t *dest = row + w * size;
+                    uint64_t sourceX = (uint64_t) (x >> WARP_BITS);
+                    uint64_t sourceY = (uint64_t) (y >> WARP_BITS);
+
+                    // Negative positions wrap around and fail the test too
+                    if (sourceX >= width || sourceY >= height) {
+                        memset(dest, 0, size);
+                        continue;
+                    }
+
+                    if (!warp->bilinear) {
+                        copy_pixel(dest, source + sourceY * stride + sourceX * size, size);
+                        continue;
+                    }
+
+                    // Pixels around the position, edge pixels are repeated
+                    int64_t left = (x - WARP_HALF) >> WARP_BITS;
+                    int64_t bottom = (y - WARP_HALF) >> WARP_BITS;
+                    uint32_t fx = ((x - WARP_HALF) >> (WARP_BITS - 8)) & 0xFF;
+                    uint32_t fy = ((y - WARP_HALF) >> (WARP_BITS - 8)) & 0xFF;
+                    size_t x0 = left < 0 ? 0 : left;
+                    size_t x1 = left + 1 < (int64_t) width ? left + 1 : width - 1;
+                    size_t y0 = bottom < 0 ? 0 : bottom;
+                    size_t y1 = bottom + 1 < (int64_t) height ? bottom + 1 : height - 1;
+
+                    const uint8_t *p00 = source + y0 * stride + x0 * size;
+                    const uint8_t *p01 = source + y0 * stride + x1 * size;
+                    const uint8_t *p10 = source + y1 * stride + x0 * size;
+                    const uint8_t *p11 = source + y1 * stride + x1 * size;
+                    for (size_t channel = 0; channel < size; channel++) {
+                        uint32_t lower = p00[channel] * (256 - fx) + p01[channel] * fx;
+                        uint32_t upper = p10[channel] * (256 - fx) + p11[channel] * fx;
+                        dest[channel] = (lower * (256 - fy) + upper * fy + (1 << 15)) >> 16;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void affine_tiles(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+
+    switch (band->image->pixel_size) {
+        case 1:
+            affine_tiles_of(band, start, end, 1);
+            break;
+        case 4:
+            affine_tiles_of(band, start, end, 4);
+            break;
+        default:
+            affine_tiles_of(band, start, end, 3);
+    }
+}
+
+/**
+ * Masks `count` pixels of given size, palette indices are copied as they
+ * are. Buffers may be the same.
+ */
+static void mask_row(void* dest, const void* src, size_t count, size_t size, struct pixel mask) {
+    switch (size) {
+        case 1:
+            if (dest != src) {
+                memcpy(dest, src, count);
+            }
+            break;
+        case 4:
+            mask_bgra((uint8_t*) dest, (const uint8_t*) src, count, mask);
+            break;
+        default:
+            mask_pixels((struct pixel*) dest, (const struct pixel*) src, count, mask);
+    }
+}
+
+/**
+ * Rows of the band without padding follow each other, so the whole band is
+ * masked at once.
+ */
+static void extract_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    size_t width = band->image->info.width;
+    size_t size = band->image->pixel_size;
+
+    if (band->image->stride == width * size && band->newImage->stride == band->image->stride) {
+        mask_row(bmp_row(band->newImage, start), bmp_row(band->image, start), (end - start) * width, size, band->mask);
+        return;
+    }
+
+    for (size_t h = start; h < end; h++) {
+        mask_row(bmp_row(band->newImage, h), bmp_row(band->image, h), width, size, band->mask);
+    }
+}
+
+/**
+ * Masks colors of palette, indices of pixels stay the same.
+ */
+static void mask_palette(struct bmp_image* image, struct pixel mask) {
+    for (size_t index = 0; index < image->colors; index++) {
+        image->palette[index].blue &= mask.blue;
+        image->palette[index].green &= mask.green;
+        image->palette[index].red &= mask.red;
+    }
+}
+
+bool parse_colors(const char* colors_to_keep, struct pixel* mask) {
+
+    if (colors_to_keep == NULL)
+        return false;
+
+    mask->blue = 0x00;
+    mask->green = 0x00;
+    mask->red = 0x00;
+
+    // Check string content
+    for (size_t index = 0; colors_to_keep[index] != '\0'; index++) {
+        // check if red
+        if (colors_to_keep[index] == R)
+            mask->red = 0xFF;
+
+        // check if green
+        else if (colors_to_keep[index] == G)
+            mask->green = 0xFF;
+
+        // check if blue
+        else if (colors_to_keep[index] == B)
+            mask->blue = 0xFF;
+
+        else
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Checks that position in pixels can be stepped in fixed point without
+ * overflow, rejects infinities and NaN too.
+ */
+static bool fits_warp(double value) {
+    return fabs(value) < (double) (1 << 28);
+}
+
+static int64_t to_warp(double value) {
+    return llround(value * ((int64_t) 1 << WARP_BITS));
+}
+
+/**
+ * Checks that area of given size starting at the top-left corner
+ * <start_y, start_x> lies inside of the image.
+ */
+static bool check_area(const struct bmp_image* image, size_t start_y, size_t start_x, size_t height, size_t width) {
+
+    // Check staring point and crop size
+    if (start_y >= image->info.height || start_x >= image->info.width || height < 1 || width < 1)
+        return false;
+
+    // Check bounds of crop
+    return start_y + height <= image->info.height && start_x + width <= image->info.width;
+}
+
+/**
+ * Mapped images and views can't be changed.
+ */
+static bool is_read_only(const struct bmp_image* image) {
+    return image->mapping != NULL || image->parent != NULL;
+}
+
+/**
+ * Size of one slot of row buffers of in-place flips.
+ */
+static size_t row_slot_size(const struct bmp_image* image) {
+    return (image->info.width + 1) * image->pixel_size;
+}
+
+/**
+ * Allocates row buffers of in-place flips for `bands` bands, so flips can
+ * fail before any pixel is moved.
+ */
+static uint8_t* alloc_row_slots(const struct bmp_image* image, size_t bands, struct bmp_allocator* allocator) {
+    return (uint8_t*) bmp_buffer_alloc(allocator, (bands > 0 ? bands : 1) * row_slot_size(image));
+}
+
+/**
+ * Reverses rows of bands <start, end).
+ */
+static void flip_horizontally_inplace_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    size_t width = band->newImage->info.width;
+    size_t size = band->newImage->pixel_size;
+    size_t first, last;
+    band_range(band->newImage->info.height, BAND_ROWS, start, end, &first, &last);
+
+    // Row is reversed into buffer and copied back
+    uint8_t *buffer = band->scratch + start * row_slot_size(band->newImage);
+    for (size_t h = first; h < last; h++) {
+        struct pixel *row = bmp_row(band->newImage, h);
+        reverse_row(buffer, row, width, size);
+        memcpy(row, buffer, width * size);
+    }
+}
+
+/**
+ * Swaps row pairs of bands <start, end), row `h` with row `height - 1 - h`.
+ */
+static void flip_vertically_inplace_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    size_t height = band->newImage->info.height;
+    size_t rowSize = band->newImage->info.width * band->newImage->pixel_size;
+    size_t first, last;
+    band_range(height / 2, BAND_ROWS, start, end, &first, &last);
+
+    uint8_t *buffer = band->scratch + start * row_slot_size(band->newImage);
+    for (size_t h = first; h < last; h++) {
+        struct pixel *top = bmp_row(band->newImage, h);
+        struct pixel *bottom = bmp_row(band->newImage, height - 1 - h);
+        memcpy(buffer, top, rowSize);
+        memcpy(top, bottom, rowSize);
+        memcpy(bottom, buffer, rowSize);
+    }
+}
+
+static void flip_horizontally_bands(struct bmp_image* image, uint8_t* scratch) {
+    struct band band = { .image = image, .newImage = image, .scratch = scratch };
+    thread_pool_run(threads, band_count(image->info.height, BAND_ROWS), flip_horizontally_inplace_rows, &band);
+}
+
+static void flip_vertically_bands(struct bmp_image* image, uint8_t* scratch) {
+    struct band band = { .image = image, .newImage = image, .scratch = scratch };
+    thread_pool_run(threads, band_count(image->info.height / 2, BAND_ROWS), flip_vertically_inplace_rows, &band);
+}
+
+static void extract_inplace_rows(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+    size_t width = band->newImage->info.width;
+
+    for (size_t h = start; h < end; h++) {
+        struct pixel *row = bmp_row(band->newImage, h);
+        mask_row(row, row, width, band->newImage->pixel_size, band->mask);
+    }
+}
+
+/**
+ * Transposes square image in place, tile row `start` is swapped with tile
+ * column `start`. Tiles on the diagonal are transposed within themselves.
+ */
+SPECIALIZED void transpose_tiles_of(const struct band* band, size_t start, size_t end, size_t size) {
+    size_t length = band->newImage->info.width;
+
+    for (size_t tileY = start * TILE_SIZE; tileY < end * TILE_SIZE && tileY < length; tileY += TILE_SIZE) {
+        size_t endY = tileY + TILE_SIZE < length ? tileY + TILE_SIZE : length;
+
+        for (size_t tileX = tileY; tileX < length; tileX += TILE_SIZE) {
+            size_t endX = tileX + TILE_SIZE < length ? tileX + TILE_SIZE : length;
+
+            for (size_t h = tileY; h < endY; h++) {
+                // Below diagonal of diagonal tile is already swapped
+                size_t w = tileX == tileY ? h + 1 : tileX;
+                uint8_t *row = (uint8_t*) bmp_row(band->newImage, h);
+                for (; w < endX; w++) {
+                    uint8_t *other = (uint8_t*) bmp_row(band->newImage, w) + h * size;
+                    uint8_t swap[4];
+                    copy_pixel(swap, row + w * size, size);
+                    copy_pixel(row + w * size, other, size);
+                    copy_pixel(other, swap, size);
+                }
+            }
+        }
+    }
+}
+
+static void transpose_tiles(void* arg, size_t start, size_t end) {
+    const struct band *band = (const struct band*) arg;
+
+    switch (band->newImage->pixel_size) {
+        case 1:
+            transpose_tiles_of(band, start, end, 1);
+            break;
+        case 4:
+            transpose_tiles_of(band, start, end, 4);
+            break;
+        default:
+            transpose_tiles_of(band, start, end, 3);
+    }
+}
+
 struct bmp_image* flip_horizontally(const struct bmp_image* image) {
 
+    BMP_STAT_SCOPE(BMP_STAT_FLIP_HORIZONTALLY);
+
     if (image == NULL)
         return NULL;
 
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
     // Get size data
-    size_t height = image->header->height;
-    size_t width = image->header->width;
-    size_t pxcount = width * height;
-    
+    size_t height = image->info.height;
+    size_t width = image->info.width;
+
     // Alloc
-    struct bmp_image *newImage = (struct bmp_image*) malloc(sizeof(struct bmp_image));
-    newImage->header = (struct bmp_header*) calloc(1,sizeof(struct bmp_header)); 
-    newImage->data = (struct pixel*) calloc(pxcount, sizeof(struct pixel));
-
-    // Copy header
-    newImage->header->size = image->header->size;
-    newImage->header->width = image->header->width;
-    newImage->header->height = image->header->height;
-    newImage->header->type = 0x4d42;
-    newImage->header->offset = 0x36;
-    newImage->header->dib_size = 0x28;
-    newImage->header->bpp = 0x18;
-    newImage->header->planes = 0x01;
-    newImage->header->image_size = image->header->size - 0x36;
+    struct bmp_image *newImage = create_bmp_image_like(image, width, height);
+    if (newImage == NULL)
+        return NULL;
 
     // Flip data horizontally
-    for (size_t h = 0; h < height; h++) {
-        for (size_t w = 0; w < width; w++) {
-            newImage->data[(h * width) + w].blue = image->data[(h * width) + (width - 1 - w)].blue;
-            newImage->data[(h * width) + w].red = image->data[(h * width) + (width - 1 - w)].red;
-            newImage->data[(h * width) + w].green = image->data[(h * width) + (width - 1 - w)].green;
-        }
-    }
+    struct band band = { .image = image, .newImage = newImage };
+    thread_pool_run(threads, height, flip_horizontally_rows, &band);
+
     return newImage;
 }
 
 struct bmp_image* flip_vertically(const struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_FLIP_VERTICALLY);
     
     if (image == NULL)
         return NULL;
 
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
     // Get size data
-    size_t height = image->header->height;
-    size_t width = image->header->width;
-    size_t pxcount = width * height;
-    
+    size_t height = image->info.height;
+    size_t width = image->info.width;
+
     // Alloc
-    struct bmp_image *newImage = (struct bmp_image*) malloc(sizeof(struct bmp_image));
-    newImage->header = (struct bmp_header*) calloc(1,sizeof(struct bmp_header)); 
-    newImage->data = (struct pixel*) calloc(pxcount, sizeof(struct pixel));
-
-    // Copy header
-    newImage->header->size = image->header->size;
-    newImage->header->width = image->header->width;
-    newImage->header->height = image->header->height;
-    newImage->header->type = 0x4d42;
-    newImage->header->offset = 0x36;
-    newImage->header->dib_size = 0x28;
-    newImage->header->bpp = 0x18;
-    newImage->header->planes = 0x01;
-    newImage->header->image_size = image->header->size - 0x36;
+    struct bmp_image *newImage = create_bmp_image_like(image, width, height);
+    if (newImage == NULL)
+        return NULL;
 
     // Flip data vertically
-    for (size_t h = 0; h < height; h++) {
-        for (size_t w = 0; w < width; w++) {
-            newImage->data[(h * width) + w].blue = image->data[((height - 1 - h) * width) + w].blue;
-            newImage->data[(h * width) + w].red = image->data[((height - 1 - h) * width) + w].red;
-            newImage->data[(h * width) + w].green = image->data[((height - 1 - h) * width) + w].green;
-        }
-    }
-    return newImage;
+    struct band band = { .image = image, .newImage = newImage };
+    thread_pool_run(threads, height, flip_vertically_rows, &band);
 
+    return newImage;
 }
 
 struct bmp_image* rotate_right(const struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_ROTATE_RIGHT);
     
     if (image == NULL)
         return NULL;
 
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
     // Get size data
-    size_t height = image->header->height;
-    size_t width = image->header->width;
-    size_t pxcount = width * height;
-    
+    size_t height = image->info.height;
+    size_t width = image->info.width;
+
     // Alloc
-    struct bmp_image *newImage = (struct bmp_image*) malloc(sizeof(struct bmp_image));
-    newImage->header = (struct bmp_header*) calloc(1,sizeof(struct bmp_header)); 
-    newImage->data = (struct pixel*) calloc(pxcount, sizeof(struct pixel));
-
-    // Make header
-    // Change  w/h
-    newImage->header->width = image->header->height;
-    newImage->header->height = image->header->width;
-
-    // Calculate data size
-    newImage->header->image_size = ((newImage->header->width * 24 + 31) / 32) * 4 * newImage->header->height;
-    newImage->header->size = newImage->header->image_size + 0x36;
-
-    // Add constants
-    newImage->header->type = 0x4d42;
-    newImage->header->offset = 0x36;
-    newImage->header->dib_size = 0x28;
-    newImage->header->bpp = 0x18;
-    newImage->header->planes = 0x01;
-
-
-    // Turn right
-    for (size_t h = 0; h < newImage->header->height; h++) {
-        for (size_t w = 0; w < newImage->header->width; w++) {
-            newImage->data[((newImage->header->height - 1 - h) * newImage->header->width) + w].blue = image->data[(w * width) + h].blue;
-            newImage->data[((newImage->header->height - 1 - h) * newImage->header->width) + w].red = image->data[(w * width) + h].red;
-            newImage->data[((newImage->header->height - 1 - h) * newImage->header->width) + w].green = image->data[(w * width) + h].green;
-        }
-    }
+    struct bmp_image *newImage = create_bmp_image_like(image, height, width);
+    if (newImage == NULL)
+        return NULL;
+
+
+    // Turn right by bands of tile rows
+    struct band band = { .image = image, .newImage = newImage };
+    thread_pool_run(threads, (width + TILE_SIZE - 1) / TILE_SIZE, rotate_right_tiles, &band);
 
     return newImage;
 }
 
 struct bmp_image* rotate_left(const struct bmp_image* image) {
 
+    BMP_STAT_SCOPE(BMP_STAT_ROTATE_LEFT);
+
     if (image == NULL)
         return NULL;
 
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
     // Get size data
-    size_t height = image->header->height;
-    size_t width = image->header->width;
-    size_t pxcount = width * height;
-    
+    size_t height = image->info.height;
+    size_t width = image->info.width;
+
     // Alloc
-    struct bmp_image *newImage = (struct bmp_image*) malloc(sizeof(struct bmp_image));
-    newImage->header = (struct bmp_header*) calloc(1,sizeof(struct bmp_header)); 
-    newImage->data = (struct pixel*) calloc(pxcount, sizeof(struct pixel));
-
-    // Make header
-    // Change  w/h
-    newImage->header->width = image->header->height;
-    newImage->header->height = image->header->width;
-
-    // Calculate data size
-    newImage->header->image_size = ((newImage->header->width * 24 + 31) / 32) * 4 * newImage->header->height;
-    newImage->header->size = newImage->header->image_size + 0x36;
-
-    // Add constants
-    newImage->header->type = 0x4d42;
-    newImage->header->offset = 0x36;
-    newImage->header->dib_size = 0x28;
-    newImage->header->bpp = 0x18;
-    newImage->header->planes = 0x01;
-
-    // Turn left 1
-    for (size_t h = 0; h < newImage->header->height; h++) {
-        for (size_t w = 0; w < newImage->header->width; w++) {
-            newImage->data[(h * newImage->header->width) + (newImage->header->width - 1 - w)].blue = image->data[(w * width) + h].blue;
-            newImage->data[(h * newImage->header->width) + (newImage->header->width - 1 - w)].red = image->data[(w * width) + h].red;
-            newImage->data[(h * newImage->header->width) + (newImage->header->width - 1 - w)].green = image->data[(w * width) + h].green;
-        }
-    }
+    struct bmp_image *newImage = create_bmp_image_like(image, height, width);
+    if (newImage == NULL)
+        return NULL;
+
+    // Turn left by bands of tile rows
+    struct band band = { .image = image, .newImage = newImage };
+    thread_pool_run(threads, (width + TILE_SIZE - 1) / TILE_SIZE, rotate_left_tiles, &band);
 
     return newImage;
 }
 
-struct bmp_image* crop(const struct bmp_image* image, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width) {
-    
+struct bmp_image* rotate_180(const struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_ROTATE_180);
+
     if (image == NULL)
         return NULL;
 
-    // Get image stats
-    size_t source_width = image->header->width;
-    size_t source_height = image->header->height;
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    // Get size data
+    size_t height = image->info.height;
+    size_t width = image->info.width;
 
-    // Check staring point
-    if (start_y < 0 || start_y >= source_height || start_x < 0 || start_x >= source_width)
+    // Alloc
+    struct bmp_image *newImage = create_bmp_image_like(image, width, height);
+    if (newImage == NULL)
         return NULL;
 
-    // Check crop size
-    if (height < 1 || width < 1)
+    // Turn by 180 degrees
+    struct band band = { .image = image, .newImage = newImage };
+    thread_pool_run(threads, height, rotate_180_rows, &band);
+
+    return newImage;
+}
+
+struct bmp_image* crop(const struct bmp_image* image, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width) {
+
+    BMP_STAT_SCOPE(BMP_STAT_CROP);
+    
+    if (image == NULL)
         return NULL;
 
-    // Check bounds of crop
-    if (start_y + height > source_height || start_x + width > source_width)
+    BMP_STAT_PIXELS((uint64_t) width * height);
+
+    if (!check_area(image, start_y, start_x, height, width))
         return NULL;
 
+    // Alloc
+    struct bmp_image *newImage = create_bmp_image_like(image, width, height);
+    if (newImage == NULL)
+        return NULL;
 
-    // Get size data
-    size_t pxcount = width * height;
+    // Rows are stored from bottom, so the area starts `start_y + height` rows from the top
+    struct band band = {
+        .image = image,
+        .newImage = newImage,
+        .start_x = start_x,
+        .start_y = image->info.height - start_y - height
+    };
+    thread_pool_run(threads, height, crop_rows, &band);
 
-    // Alloc new image
-    struct bmp_image *newImage = (struct bmp_image*) malloc(sizeof(struct bmp_image));
-    newImage->header = (struct bmp_header*) calloc(1,sizeof(struct bmp_header)); 
-    newImage->data = (struct pixel*) calloc(pxcount, sizeof(struct pixel));
+    return newImage;
+}
 
-    // Create header
-    // Change w/h
-    newImage->header->width = width;
-    newImage->header->height = height;
+struct bmp_image* crop_view(const struct bmp_image* image, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width) {
 
-    //Calculate size
-    newImage->header->image_size = ((width * 24 + 31) / 32) * 4 * height;
-    newImage->header->size = newImage->header->image_size + 0x36;
+    BMP_STAT_SCOPE(BMP_STAT_CROP_VIEW);
 
-    // Add constants
-    newImage->header->type = 0x4d42;
-    newImage->header->offset = 0x36;
-    newImage->header->dib_size = 0x28;
-    newImage->header->bpp = 0x18;
-    newImage->header->planes = 0x01;
+    if (image == NULL)
+        return NULL;
 
-    for (size_t h = 0; h < height; h++) {
-        for (size_t w = 0; w < width; w++) {
-            newImage->data[(h * width) + w].blue = image->data[((source_height - start_y - h) * source_width) - (source_width - start_x - w)].blue;
-            newImage->data[(h * width) + w].red = image->data[((source_height - start_y - h) * source_width) - (source_width - start_x - w)].red;
-            newImage->data[(h * width) + w].green = image->data[((source_height - start_y - h) * source_width) - (source_width - start_x - w)].green;
-        }  
-    }
-    struct bmp_image *ret = flip_vertically(newImage);
-    free_bmp_image(newImage);
+    BMP_STAT_PIXELS((uint64_t) width * height);
 
-    return ret;
+    if (!check_area(image, start_y, start_x, height, width))
+        return NULL;
+
+    // Rows are stored from bottom, the view starts at the bottom row of the area
+    return create_bmp_view(image, image->info.height - start_y - height, start_x, width, height);
 }
 
 struct bmp_image* scale(const struct bmp_image* image, float factor) {
+    return resample(image, factor, SCALE_NEAREST);
+}
+
+struct bmp_image* resample(const struct bmp_image* image, float factor, enum scale_mode mode) {
+
+    BMP_STAT_SCOPE(BMP_STAT_RESAMPLE);
 
     if (image == NULL)
         return NULL;
 
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
     if (factor <= 0)
         return NULL;
 
+    if (mode != SCALE_NEAREST && mode != SCALE_BILINEAR && mode != SCALE_AREA)
+        return NULL;
+
     // Get source size data
-    size_t source_height = image->header->height;
-    size_t source_width = image->header->width;
+    size_t source_height = image->info.height;
+    size_t source_width = image->info.width;
     size_t source_pxcount = source_width * source_height;
 
     size_t new_height;
@@ -252,94 +1003,401 @@ struct bmp_image* scale(const struct bmp_image* image, float factor) {
         new_pxcount = new_width * new_height;
     }
 
+    // Palette colors can't be mixed, filtered palette image becomes 24-bit
+    bool expand = mode != SCALE_NEAREST && image->pixel_size == 1;
+
     // Alloc
-    struct bmp_image *newImage = (struct bmp_image*) malloc(sizeof(struct bmp_image));
-    newImage->header = (struct bmp_header*) calloc(1,sizeof(struct bmp_header)); 
-    newImage->data = (struct pixel*) calloc(new_pxcount, sizeof(struct pixel));
-
-    // Copy header
-    // Change h/w
-    newImage->header->width = new_width;
-    newImage->header->height = new_height;
-
-    // Calculate size
-    newImage->header->image_size = ((new_width * 24 + 31) / 32) * 4 * new_height;
-    newImage->header->size = newImage->header->image_size + 0x36;
-    newImage->header->type = 0x4d42;
-    newImage->header->offset = 0x36;
-    newImage->header->dib_size = 0x28;
-    newImage->header->bpp = 0x18;
-    newImage->header->planes = 0x01;
-
-    for (size_t hIndex = 0; hIndex < new_height; hIndex++) {
+    struct bmp_image *newImage = expand ? create_bmp_image(new_width, new_height) : create_bmp_image_like(image, new_width, new_height);
+    if (newImage == NULL)
+        return NULL;
+
+    if (new_pxcount == 0 || source_pxcount == 0)
+        return newImage;
+
+    struct band band = { .image = image, .newImage = newImage, .allocator = newImage->allocator };
+
+    // Source column of every column is computed only once
+    if (mode == SCALE_NEAREST) {
+        uint32_t *table = (uint32_t*) bmp_buffer_alloc(band.allocator, new_width * sizeof(uint32_t));
+        if (table == NULL) {
+            free_bmp_image(newImage);
+            return NULL;
+        }
         for (size_t wIndex = 0; wIndex < new_width; wIndex++) {
-            newImage->data[(hIndex * new_width) + wIndex].blue = image->data[((hIndex*source_height)/new_height)*source_width + (wIndex * source_width)/new_width].blue;
-            newImage->data[(hIndex * new_width) + wIndex].green = image->data[((hIndex*source_height)/new_height)*source_width + (wIndex * source_width)/new_width].green;
-            newImage->data[(hIndex * new_width) + wIndex].red = image->data[((hIndex*source_height)/new_height)*source_width + (wIndex * source_width)/new_width].red;
-        }        
+            table[wIndex] = (wIndex * source_width) / new_width;
+        }
+        band.table = table;
+
+        thread_pool_run(threads, new_height, scale_rows, &band);
+        bmp_buffer_free(band.allocator, table);
+
+        return newImage;
+    }
+
+    struct taps *cols = create_taps(source_width, new_width, mode, band.allocator);
+    struct taps *rows = create_taps(source_height, new_height, mode, band.allocator);
+    if (cols == NULL || rows == NULL) {
+        free_taps(cols, band.allocator);
+        free_taps(rows, band.allocator);
+        free_bmp_image(newImage);
+        return NULL;
+    }
+    band.cols = cols;
+    band.rows = rows;
+
+    // Colors of palette image are looked up first
+    struct bmp_image *expanded = NULL;
+    if (expand) {
+        expanded = create_bmp_image(source_width, source_height);
+        if (expanded == NULL) {
+            free_taps(cols, band.allocator);
+            free_taps(rows, band.allocator);
+            free_bmp_image(newImage);
+            return NULL;
+        }
+        struct band expandBand = { .image = image, .newImage = expanded };
+        thread_pool_run(threads, source_height, expand_rows, &expandBand);
+        band.image = expanded;
+    }
+
+    bool failed = false;
+    band.failed = &failed;
+    thread_pool_run(threads, new_height, resample_rows, &band);
+    free_taps(cols, band.allocator);
+    free_taps(rows, band.allocator);
+    free_bmp_image(expanded);
+
+    if (failed) {
+        free_bmp_image(newImage);
+        return NULL;
     }
+
     return newImage;
 }
 
-struct bmp_image* extract(const struct bmp_image* image, const char* colors_to_keep) {
+struct bmp_image* affine(const struct bmp_image* image, const double matrix[6], uint32_t width, uint32_t height, enum scale_mode mode) {
 
-    uint8_t blue = 0x00;
-    uint8_t red = 0x00;
-    uint8_t green = 0x00;
+    BMP_STAT_SCOPE(BMP_STAT_AFFINE);
 
-    //Check pointers
-    if (image == NULL || colors_to_keep == NULL)
+    if (image == NULL || matrix == NULL)
         return NULL;
 
-    // Check string content
-    short index = 0;
-    while (colors_to_keep[index] != '\0') {
-        // check if red
-        if (colors_to_keep[index] == 0x72) 
-            red = 0xFF;
+    BMP_STAT_PIXELS((uint64_t) width * height);
 
-        // check if green
-        else if (colors_to_keep[index] == 0x67)
-            green = 0xFF;
+    if (mode != SCALE_NEAREST && mode != SCALE_BILINEAR)
+        return NULL;
 
-        // check if blue
-        else if (colors_to_keep[index] == 0x62)
-            blue = 0xFF;
-        
-        else
-            return NULL;
+    // Pixels of the result are looked up in the source, so the matrix is inverted
+    double det = matrix[0] * matrix[4] - matrix[1] * matrix[3];
+    if (det == 0 || !isfinite(det))
+        return NULL;
+
+    double a = matrix[4] / det;
+    double b = -matrix[1] / det;
+    double c = (matrix[1] * matrix[5] - matrix[2] * matrix[4]) / det;
+    double d = -matrix[3] / det;
+    double e = matrix[0] / det;
+    double f = (matrix[2] * matrix[3] - matrix[0] * matrix[5]) / det;
+
+    // Rows of both images are stored from bottom, y-axis of the steps is turned over
+    double x = a * 0.5 + b * (height - 0.5) + c;
+    double y = image->info.height - (d * 0.5 + e * (height - 0.5) + f);
+    if (!fits_warp(x) || !fits_warp(y) || !fits_warp(a * width) || !fits_warp(d * width)
+            || !fits_warp(b * height) || !fits_warp(e * height))
+        return NULL;
+
+    struct warp warp = {
+        .x = to_warp(x),
+        .y = to_warp(y),
+        .col_x = to_warp(a),
+        .col_y = to_warp(-d),
+        .row_x = to_warp(-b),
+        .row_y = to_warp(e),
+        .bilinear = mode == SCALE_BILINEAR
+    };
+
+    // Palette colors can't be mixed, filtered palette image becomes 24-bit
+    bool expand = mode != SCALE_NEAREST && image->pixel_size == 1;
 
-        index++;
-    }
-    
-    // Get size data
-    size_t height = image->header->height;
-    size_t width = image->header->width;
-    size_t pxcount = width * height;
-    
     // Alloc
-    struct bmp_image *newImage = (struct bmp_image*) malloc(sizeof(struct bmp_image));
-    newImage->header = (struct bmp_header*) calloc(1,sizeof(struct bmp_header)); 
-    newImage->data = (struct pixel*) calloc(pxcount, sizeof(struct pixel));
-
-    // Copy header
-    newImage->header->size = image->header->size;
-    newImage->header->width = image->header->width;
-    newImage->header->height = image->header->height;
-    newImage->header->type = 0x4d42;
-    newImage->header->offset = 0x36;
-    newImage->header->dib_size = 0x28;
-    newImage->header->bpp = 0x18;
-    newImage->header->planes = 0x01;
-    newImage->header->image_size = image->header->size - 0x36;
+    struct bmp_image *newImage = expand ? create_bmp_image(width, height) : create_bmp_image_like(image, width, height);
+    if (newImage == NULL)
+        return NULL;
 
-    for (size_t w = 0; w < width; w++) {
-        for (size_t h = 0; h < height; h++) {
-            newImage->data[(h * width) + w].blue = image->data[(h * width) + w].blue & blue;
-            newImage->data[(h * width) + w].red = image->data[(h * width) + w].red & red;
-            newImage->data[(h * width) + w].green = image->data[(h * width) + w].green & green;
+    if ((uint64_t) width * height == 0 || (uint64_t) image->info.width * image->info.height == 0)
+        return newImage;
+
+    struct band band = { .image = image, .newImage = newImage, .warp = &warp };
+
+    // Colors of palette image are looked up first
+    struct bmp_image *expanded = NULL;
+    if (expand) {
+        expanded = create_bmp_image(image->info.width, image->info.height);
+        if (expanded == NULL) {
+            free_bmp_image(newImage);
+            return NULL;
         }
+        struct band expandBand = { .image = image, .newImage = expanded };
+        thread_pool_run(threads, image->info.height, expand_rows, &expandBand);
+        band.image = expanded;
     }
 
+    // Transform by bands of tile rows
+    thread_pool_run(threads, (height + TILE_SIZE - 1) / TILE_SIZE, affine_tiles, &band);
+    free_bmp_image(expanded);
+
+    return newImage;
+}
+
+struct bmp_image* rotate(const struct bmp_image* image, double degrees, enum scale_mode mode) {
+
+    BMP_STAT_SCOPE(BMP_STAT_ROTATE);
+
+    if (image == NULL)
+        return NULL;
+
+    if (!isfinite(degrees) || (mode != SCALE_NEAREST && mode != SCALE_BILINEAR))
+        return NULL;
+
+    // Get size data
+    double height = image->info.height;
+    double width = image->info.width;
+
+    // Quarter turns only move pixels
+    double angle = fmod(degrees, 360);
+    if (angle < 0)
+        angle += 360;
+    if (angle == 0)
+        return crop(image, 0, 0, image->info.height, image->info.width);
+    if (angle == 90)
+        return rotate_right(image);
+    if (angle == 180)
+        return rotate_180(image);
+    if (angle == 270)
+        return rotate_left(image);
+
+    // The result holds all corners, y-axis points down, so positive angle turns right
+    double radians = angle * (3.14159265358979323846 / 180);
+    double cosine = cos(radians);
+    double sine = sin(radians);
+    double new_width = ceil(width * fabs(cosine) + height * fabs(sine) - 1e-6);
+    double new_height = ceil(width * fabs(sine) + height * fabs(cosine) - 1e-6);
+
+    // Centers of both images are at the same position
+    double matrix[6] = {
+        cosine, -sine, new_width / 2 - (cosine * width / 2 - sine * height / 2),
+        sine, cosine, new_height / 2 - (sine * width / 2 + cosine * height / 2)
+    };
+
+    return affine(image, matrix, new_width, new_height, mode);
+}
+
+struct bmp_image* extract(const struct bmp_image* image, const char* colors_to_keep) {
+
+    BMP_STAT_SCOPE(BMP_STAT_EXTRACT);
+
+    struct pixel mask;
+
+    //Check pointers
+    if (image == NULL || !parse_colors(colors_to_keep, &mask))
+        return NULL;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    // Get size data
+    size_t height = image->info.height;
+    size_t width = image->info.width;
+
+    // Alloc
+    struct bmp_image *newImage = create_bmp_image_like(image, width, height);
+    if (newImage == NULL)
+        return NULL;
+
+    struct band band = {
+        .image = image,
+        .newImage = newImage,
+        .mask = mask
+    };
+    thread_pool_run(threads, height, extract_rows, &band);
+
+    // Indices are kept, colors are masked in the palette
+    if (newImage->pixel_size == 1)
+        mask_palette(newImage, mask);
+
     return newImage;
 }
+
+bool flip_horizontally_inplace(struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_FLIP_HORIZONTALLY_INPLACE);
+
+    if (image == NULL || is_read_only(image))
+        return false;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    uint8_t *scratch = alloc_row_slots(image, band_count(image->info.height, BAND_ROWS), allocator);
+    if (scratch == NULL)
+        return false;
+
+    flip_horizontally_bands(image, scratch);
+    bmp_buffer_free(allocator, scratch);
+
+    return true;
+}
+
+bool flip_vertically_inplace(struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_FLIP_VERTICALLY_INPLACE);
+
+    if (image == NULL || is_read_only(image))
+        return false;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    uint8_t *scratch = alloc_row_slots(image, band_count(image->info.height / 2, BAND_ROWS), allocator);
+    if (scratch == NULL)
+        return false;
+
+    flip_vertically_bands(image, scratch);
+    bmp_buffer_free(allocator, scratch);
+
+    return true;
+}
+
+bool rotate_right_inplace(struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_ROTATE_RIGHT_INPLACE);
+
+    if (image == NULL || is_read_only(image))
+        return false;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    // Only square image keeps its size
+    if (image->info.width != image->info.height)
+        return false;
+
+    // Buffers of the flip are allocated first, so a failure leaves the image intact
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    uint8_t *scratch = alloc_row_slots(image, band_count(image->info.height / 2, BAND_ROWS), allocator);
+    if (scratch == NULL)
+        return false;
+
+    // Rotation to the right is transposition with rows in reverse order
+    struct band band = { .image = image, .newImage = image };
+    thread_pool_run(threads, (image->info.width + TILE_SIZE - 1) / TILE_SIZE, transpose_tiles, &band);
+
+    flip_vertically_bands(image, scratch);
+    bmp_buffer_free(allocator, scratch);
+
+    return true;
+}
+
+bool rotate_left_inplace(struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_ROTATE_LEFT_INPLACE);
+
+    if (image == NULL || is_read_only(image))
+        return false;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    // Only square image keeps its size
+    if (image->info.width != image->info.height)
+        return false;
+
+    // Buffers of the flip are allocated first, so a failure leaves the image intact
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    uint8_t *scratch = alloc_row_slots(image, band_count(image->info.height, BAND_ROWS), allocator);
+    if (scratch == NULL)
+        return false;
+
+    // Rotation to the left is transposition with columns in reverse order
+    struct band band = { .image = image, .newImage = image };
+    thread_pool_run(threads, (image->info.width + TILE_SIZE - 1) / TILE_SIZE, transpose_tiles, &band);
+
+    flip_horizontally_bands(image, scratch);
+    bmp_buffer_free(allocator, scratch);
+
+    return true;
+}
+
+bool rotate_180_inplace(struct bmp_image* image) {
+
+    BMP_STAT_SCOPE(BMP_STAT_ROTATE_180_INPLACE);
+
+    if (image == NULL || is_read_only(image))
+        return false;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    // Horizontal flip has more bands, its buffers serve both flips
+    struct bmp_allocator *allocator = bmp_get_allocator();
+    uint8_t *scratch = alloc_row_slots(image, band_count(image->info.height, BAND_ROWS), allocator);
+    if (scratch == NULL)
+        return false;
+
+    flip_vertically_bands(image, scratch);
+    flip_horizontally_bands(image, scratch);
+    bmp_buffer_free(allocator, scratch);
+
+    return true;
+}
+
+bool crop_inplace(struct bmp_image* image, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width) {
+
+    BMP_STAT_SCOPE(BMP_STAT_CROP_INPLACE);
+
+    if (image == NULL || is_read_only(image))
+        return false;
+
+    BMP_STAT_PIXELS((uint64_t) width * height);
+
+    if (!check_area(image, start_y, start_x, height, width))
+        return false;
+
+    // Rows move only towards the start, so they can be compacted in order
+    size_t first = image->info.height - start_y - height;
+    size_t size = image->pixel_size;
+    size_t rowSize = (size_t) width * size;
+    size_t stride = bmp_stride(width, size * 8);
+    uint8_t *data = (uint8_t*) image->data;
+    for (size_t h = 0; h < height; h++) {
+        memmove(data + h * stride, (uint8_t*) bmp_row(image, first + h) + start_x * size, rowSize);
+        memset(data + h * stride + rowSize, 0, stride - rowSize);
+    }
+
+    // Update header, the block is kept whole
+    image->stride = stride;
+    image->info.width = width;
+    image->info.height = height;
+    image->info.image_size = bmp_stride(width, image->info.bpp) * height;
+    image->info.size = image->info.image_size + image->info.offset;
+
+    return true;
+}
+
+bool extract_inplace(struct bmp_image* image, const char* colors_to_keep) {
+
+    BMP_STAT_SCOPE(BMP_STAT_EXTRACT_INPLACE);
+
+    struct pixel mask;
+
+    if (image == NULL || is_read_only(image) || !parse_colors(colors_to_keep, &mask))
+        return false;
+
+    BMP_STAT_PIXELS((uint64_t) image->info.width * image->info.height);
+
+    if (image->pixel_size == 1) {
+        mask_palette(image, mask);
+        return true;
+    }
+
+    struct band band = { .image = image, .newImage = image, .mask = mask };
+    thread_pool_run(threads, image->info.height, extract_inplace_rows, &band);
+
+    return true;
+}
@@ -3,6 +3,38 @@
 
 #include "bmp.h"
 
+struct thread_pool;
+
+
+/**
+ * Methods of computing pixels of scaled image.
+ */
+enum scale_mode {
+    SCALE_NEAREST,      // nearest source pixel
+    SCALE_BILINEAR,     // blend of 2 x 2 nearest source pixels, for enlarging
+    SCALE_AREA          // average of source pixels covered by the pixel, for shrinking
+};
+
+
+/**
+ * Sets thread pool used by transformations.
+ *
+ * Transformations split their work into bands of rows, which run on the
+ * threads of the pool. Results are the same as with serial execution. The
+ * pool is not owned, it has to outlive its use and be freed by the caller.
+ * @arg pool the pool or NULL to run transformations in calling thread
+ */
+void set_thread_pool(struct thread_pool* pool);
+
+
+/**
+ * Returns thread pool used by transformations.
+ *
+ * Other modules working on bands of rows (filters) run on the same pool.
+ * @return the pool set by `set_thread_pool()` or NULL
+ */
+struct thread_pool* get_thread_pool(void);
+
 
 /**
  * Flips image horizontally.
@@ -41,6 +73,15 @@ struct bmp_image* rotate_right(const struct bmp_image* image);
  */
 struct bmp_image* rotate_left(const struct bmp_image* image);
 
+/**
+ * Rotate image by 180 degrees.
+ *
+ * Creates copy of original file, which is upside down.
+ * @arg image the image
+ * @return the copy of image rotated by 180 degrees given as argument or null, if there is no image (NULL given)
+ */
+struct bmp_image* rotate_180(const struct bmp_image* image);
+
 /**
  * Resize image height and width by scale factor.
  *
@@ -52,6 +93,55 @@ struct bmp_image* rotate_left(const struct bmp_image* image);
 struct bmp_image* scale(const struct bmp_image* image, float factor);
 
 
+/**
+ * Resize image height and width by scale factor with selected method.
+ *
+ * Creates copy of original file, which is proportionally scaled. Size of the
+ * result is the same as with `scale()`, which is the same as `SCALE_NEAREST`.
+ * Palette images resampled with other modes produce 24-bit images.
+ * @arg image the image
+ * @arg factor the ratio of corresponding sides of original and created image, factor > 1 created image is larger, factor < 1 created image is smaller
+ * @arg mode method of computing pixels of created image
+ * @return the copy of image scaled by factor given as argument or NULL, if there is no image (NULL given) or factor or mode value is not valid
+ */
+struct bmp_image* resample(const struct bmp_image* image, float factor, enum scale_mode mode);
+
+
+/**
+ * Affine transformation of image (rotation, shear, translation, scaling).
+ *
+ * Creates image of given size, point (x, y) of the original image is moved
+ * to (matrix[0] * x + matrix[1] * y + matrix[2], matrix[3] * x + matrix[4] * y + matrix[5]).
+ * Coordinates are measured in pixels from the top-left corner of the image,
+ * center of the top-left pixel is (0.5, 0.5). Pixels of created image, which
+ * don't come from the original image, are zero (black or the first palette
+ * color). Palette images transformed with `SCALE_BILINEAR` produce 24-bit
+ * images.
+ * @arg image the image
+ * @arg matrix the first two rows of 3 x 3 matrix of the transformation, in row order
+ * @arg width the width of created image
+ * @arg height the height of created image
+ * @arg mode `SCALE_NEAREST` or `SCALE_BILINEAR`
+ * @return the transformed copy of image or NULL, if there is no image (NULL given), matrix can't be inverted or mode is not valid
+ */
+struct bmp_image* affine(const struct bmp_image* image, const double matrix[6], uint32_t width, uint32_t height, enum scale_mode mode);
+
+
+/**
+ * Rotate image by any angle to the right.
+ *
+ * Creates copy of image rotated around its center, which is large enough
+ * to hold the whole rotated image, corners are filled like by `affine()`.
+ * Multiples of 90 degrees are the same as `rotate_right()`,
+ * `rotate_180()` and `rotate_left()`.
+ * @arg image the image
+ * @arg degrees the angle, negative angles rotate to the left
+ * @arg mode `SCALE_NEAREST` or `SCALE_BILINEAR`
+ * @return the rotated copy of image or NULL, if there is no image (NULL given) or angle or mode is not valid
+ */
+struct bmp_image* rotate(const struct bmp_image* image, double degrees, enum scale_mode mode);
+
+
 /**
  * Remove unwanted outer area from image.
  *
@@ -67,6 +157,23 @@ struct bmp_image* scale(const struct bmp_image* image, float factor);
 struct bmp_image* crop(const struct bmp_image* image, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width);
 
 
+/**
+ * Select rectangular area of image without copying.
+ *
+ * Same as `crop()`, but the result is a view sharing pixels with the image.
+ * The view is read-only, can be passed to all transformations and
+ * `write_bmp()` and must be freed before the image.
+ *
+ * @arg image the image
+ * @arg start_y top-left corner position on y-axis of selected area in the range <0, image->height>
+ * @arg start_x top-left corner position on x-axis of selected area in the range <0, image->width>
+ * @arg height the height of selected area in pixels in the range <1, image->height>
+ * @arg width the width of selected area in pixels in the range <1, image->width>
+ * @return the view of selected area or null, if there is no image (NULL given) or area position is out of range
+ */
+struct bmp_image* crop_view(const struct bmp_image* image, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width);
+
+
 /**
  * Extract one or more color channels of image.
  *
@@ -77,4 +184,96 @@ struct bmp_image* crop(const struct bmp_image* image, const uint32_t start_y, co
  * @return the copy of image containing only selected color channels or null, if there is no image (NULL given) or color definition is not valid.
  */
 struct bmp_image* extract(const struct bmp_image* image, const char* colors_to_keep);
+
+
+/**
+ * Flips image horizontally in place.
+ *
+ * Same as `flip_horizontally()`, but changes the given image instead of
+ * creating a copy. Images loaded with `read_bmp_mmap()` and views are
+ * read-only.
+ * @arg image the image
+ * @return `true` if image was flipped, `false` if there is no image (NULL given), it is read-only or there is not enough memory
+ */
+bool flip_horizontally_inplace(struct bmp_image* image);
+
+
+/**
+ * Flips image vertically in place.
+ *
+ * Same as `flip_vertically()`, but swaps rows of the given image.
+ * @arg image the image
+ * @return `true` if image was flipped, `false` if there is no image (NULL given), it is read-only or there is not enough memory
+ */
+bool flip_vertically_inplace(struct bmp_image* image);
+
+
+/**
+ * Rotate square image 90 degrees to the right in place.
+ *
+ * Same as `rotate_right()`, but changes the given image. Only images with
+ * the same width and height can be rotated in place.
+ * @arg image the image
+ * @return `true` if image was rotated, `false` if there is no image (NULL given), it is read-only, not square or there is not enough memory
+ */
+bool rotate_right_inplace(struct bmp_image* image);
+
+
+/**
+ * Rotate square image 90 degrees to the left in place.
+ *
+ * Same as `rotate_left()`, but changes the given image. Only images with
+ * the same width and height can be rotated in place.
+ * @arg image the image
+ * @return `true` if image was rotated, `false` if there is no image (NULL given), it is read-only, not square or there is not enough memory
+ */
+bool rotate_left_inplace(struct bmp_image* image);
+
+
+/**
+ * Rotate image by 180 degrees in place.
+ *
+ * Same as `rotate_180()`, but changes the given image.
+ * @arg image the image
+ * @return `true` if image was rotated, `false` if there is no image (NULL given), it is read-only or there is not enough memory
+ */
+bool rotate_180_inplace(struct bmp_image* image);
+
+
+/**
+ * Remove unwanted outer area from image in place.
+ *
+ * Same as `crop()`, but moves rows of selected area to the start of pixels
+ * of the given image and shrinks them.
+ * @arg image the image
+ * @arg start_y top-left corner position on y-axis of selected area in the range <0, image->height>
+ * @arg start_x top-left corner position on x-axis of selected area in the range <0, image->width>
+ * @arg height the height of selected area in pixels in the range <1, image->height>
+ * @arg width the width of selected area in pixels in the range <1, image->width>
+ * @return `true` if image was cropped, `false` if there is no image (NULL given), it is read-only or area position is out of range
+ */
+bool crop_inplace(struct bmp_image* image, const uint32_t start_y, const uint32_t start_x, const uint32_t height, const uint32_t width);
+
+
+/**
+ * Extract one or more color channels of image in place.
+ *
+ * Same as `extract()`, but masks channels of the given image.
+ * @arg image the image
+ * @arg colors_to_keep [bgr],b-blue, g-green, r-red
+ * @return `true` if channels were extracted, `false` if there is no image (NULL given), it is read-only or color definition is not valid
+ */
+bool extract_inplace(struct bmp_image* image, const char* colors_to_keep);
+
+
+/**
+ * Parses color definition of extraction.
+ *
+ * Creates mask keeping the listed color channels, the same definition is
+ * accepted by `extract()`, `pipeline_extract()` and `stream_extract()`.
+ * @arg colors_to_keep [bgr],b-blue, g-green, r-red
+ * @arg mask where mask with 0xFF for kept channels is stored
+ * @return `true` if color definition is valid, `false` if there is no definition (NULL given) or it contains other characters
+ */
+bool parse_colors(const char* colors_to_keep, struct pixel* mask);
 #endif